@@ -1,184 +1,547 @@
-void kernel ludcmpBig(global const double *matrix,
-                      global double *vv,
-                      const int matrixSize) {
-    int i = get_global_id(0);
-    int stampId = get_global_id(1);
+// Element type of the image buffers, set with -DREAL when building
+#ifndef REAL
+#define REAL double
+#endif
 
-    double v = 0.0;
+// Outputs are written as FLOAT_IMG, so they are converted before the transfer
+void kernel toFloat(global const REAL *in, global float *out, const int offset) {
+    const int id = get_global_id(0);
 
-    if (i > 0) {
-        double big = 0.0;
+    out[id] = in[id + offset];
+}
 
-        for (int j = 1; j < matrixSize; j++) {
-            double m = fabs(matrix[stampId * matrixSize * matrixSize + i * matrixSize + j]);
+/*
+ * Solver for batches of symmetric systems, one work-group per system. The
+ * systems are stored one after another, matrixSize^2 values each, and use
+ * indices 1 to matrixSize - 1 like Numerical Recipes. The solution
+ * replaces the right-hand side.
+ *
+ * The matrix is factored as L D L^T in its lower triangle. When a pivot is
+ * not clearly positive the lower triangle is restored from the untouched
+ * upper one and LU with implicit partial pivoting is used instead.
+ */
+
+#define LDL_PIVOT_TOLERANCE 1e-14
+
+// Solves L y = b for a unit lower triangular L
+void solveUnitLower(global const double *a, global double *b, const int n) {
+    for (int k = 1; k < n; k++) {
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        double bk = b[k];
+        for (int i = k + 1 + get_local_id(0); i < n; i += get_local_size(0)) {
+            b[i] -= a[i * n + k] * bk;
+        }
+    }
+    barrier(CLK_GLOBAL_MEM_FENCE);
+}
 
-            if (m > big) {
-                big = m;
-            }
+// Solves U x = y, or L^T x = y with a unit diagonal when transposed is set
+void solveUpper(global const double *a, global double *b, const int n, const bool transposed) {
+    for (int k = n - 1; k >= 1; k--) {
+        if (!transposed && get_local_id(0) == 0) {
+            b[k] /= a[k * n + k];
         }
+        barrier(CLK_GLOBAL_MEM_FENCE);
 
-        v = 1.0 / big;
+        double bk = b[k];
+        for (int i = 1 + get_local_id(0); i < k; i += get_local_size(0)) {
+            b[i] -= (transposed ? a[k * n + i] : a[i * n + k]) * bk;
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
     }
-
-    vv[stampId * matrixSize + i] = v;
 }
 
-void kernel ludcmpRest(global double *vv, global double *matrix, global int *index,
-                       const int matrixSize) {
-    int stampId = get_global_id(0);
+// Returns false when a pivot is too small, the matrix is then partly factored
+bool factorLdl(global double *a, global const double *diag, const int n) {
+    int lid = get_local_id(0);
+    int localSize = get_local_size(0);
 
-    int firstMtxId = stampId * matrixSize * matrixSize;
-    int firstVId = stampId * matrixSize;
-    int firstIId = stampId * matrixSize;
-    int maxI = 0;
+    for (int j = 1; j < n; j++) {
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        double dj = a[j * n + j];
+        if (!(dj > LDL_PIVOT_TOLERANCE * fabs(diag[j]))) return false;
 
-    // Terrible implementation
-    // Should be parallelized a lot better
-    for (int j = 1; j < matrixSize; j++) {
-        for (int i = 1; i < j; i++) {
-            double sum = matrix[firstMtxId + i * matrixSize + j];
+        // Trailing update of the lower triangle, column j is only read
+        int m = n - 1 - j;
+        for (int p = lid; p < m * m; p += localSize) {
+            int r = j + 1 + p / m;
+            int c = j + 1 + p % m;
+            if (c > r) continue;
 
-            for (int k = 1; k < i; k++) {
-                sum -= matrix[firstMtxId + i * matrixSize + k] * matrix[firstMtxId + k * matrixSize + j];
-            }
+            a[r * n + c] -= a[r * n + j] * a[c * n + j] / dj;
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
 
-            matrix[firstMtxId + i * matrixSize + j] = sum;
+        for (int i = j + 1 + lid; i < n; i += localSize) {
+            a[i * n + j] /= dj;
         }
+    }
 
-        double big = 0.0;
+    barrier(CLK_GLOBAL_MEM_FENCE);
+    return true;
+}
 
-        for (int i = j; i < matrixSize; i++) {
-            double sum = matrix[firstMtxId + i * matrixSize + j];
-            
-            for(int k = 1; k < j; k++) {
-                sum -= matrix[firstMtxId + i * matrixSize + k] * matrix[firstMtxId + k * matrixSize + j];
-            }
+// LU with implicit partial pivoting, the row swaps are applied to b at once
+void factorLu(global double *a, global double *b, global double *vv, const int n,
+              local double *values, local int *indices) {
+    int lid = get_local_id(0);
+    int localSize = get_local_size(0);
 
-            matrix[firstMtxId + i * matrixSize + j] = sum;
-            double dum = vv[firstVId + i] * fabs(sum);
+    for (int i = 1 + lid; i < n; i += localSize) {
+        double big = 0.0;
+        for (int j = 1; j < n; j++) {
+            big = max(big, fabs(a[i * n + j]));
+        }
+        vv[i] = big == 0.0 ? 0.0 : 1.0 / big;
+    }
 
+    for (int j = 1; j < n; j++) {
+        barrier(CLK_GLOBAL_MEM_FENCE);
+
+        // Pivot row, the last of equal candidates like Numerical Recipes
+        double big = -1.0;
+        int pivot = j;
+        for (int i = j + lid; i < n; i += localSize) {
+            double dum = vv[i] * fabs(a[i * n + j]);
             if (dum >= big) {
                 big = dum;
-                maxI = i;
+                pivot = i;
             }
         }
-        
-        if (j != maxI) {
-            for (int k = 1; k < matrixSize; k++) {
-                double dum = matrix[firstMtxId + maxI * matrixSize + k];
-                matrix[firstMtxId + maxI * matrixSize + k] = matrix[firstMtxId + j * matrixSize + k];
-                matrix[firstMtxId + j * matrixSize + k] = dum;
+
+        values[lid] = big;
+        indices[lid] = pivot;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int s = localSize / 2; s > 0; s >>= 1) {
+            if (lid < s) {
+                double other = values[lid + s];
+                if (other > values[lid] || (other == values[lid] && indices[lid + s] > indices[lid])) {
+                    values[lid] = other;
+                    indices[lid] = indices[lid + s];
+                }
             }
-            
-            vv[firstVId + maxI] = vv[firstVId + j];
+            barrier(CLK_LOCAL_MEM_FENCE);
         }
 
-        index[firstIId + j] = maxI;
-        matrix[firstMtxId + j * matrixSize + j] = matrix[firstMtxId + j * matrixSize + j] == 0.0 ? 1.0e-20 : matrix[firstMtxId + j * matrixSize + j];
+        pivot = indices[0];
 
-        if(j != matrixSize - 1) {
-            double dum = 1.0 / matrix[firstMtxId + j * matrixSize + j];
+        if (pivot != j) {
+            for (int k = 1 + lid; k < n; k += localSize) {
+                double dum = a[pivot * n + k];
+                a[pivot * n + k] = a[j * n + k];
+                a[j * n + k] = dum;
+            }
 
-            for(int i = j + 1; i < matrixSize; i++) {
-                matrix[firstMtxId + i * matrixSize + j] *= dum;
+            if (lid == 0) {
+                vv[pivot] = vv[j];
+                double dum = b[pivot];
+                b[pivot] = b[j];
+                b[j] = dum;
             }
         }
-    }
-}
+        barrier(CLK_GLOBAL_MEM_FENCE);
 
-void kernel lubksb(const global double *matrix, const global int *index,
-                   global double *result,
-                   const int matrixSize) {
-    int stampId = get_global_id(0);
+        if (a[j * n + j] == 0.0) {
+            barrier(CLK_GLOBAL_MEM_FENCE);
+            if (lid == 0) a[j * n + j] = 1.0e-20;
+            barrier(CLK_GLOBAL_MEM_FENCE);
+        }
 
-    int firstMtxId = stampId * matrixSize * matrixSize;
-    int firstIId = stampId * matrixSize;
-    int firstResId = stampId * matrixSize;
+        double invPivot = 1.0 / a[j * n + j];
+        for (int i = j + 1 + lid; i < n; i += localSize) {
+            a[i * n + j] *= invPivot;
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
 
-    int ii = 0;
+        int m = n - 1 - j;
+        for (int p = lid; p < m * m; p += localSize) {
+            int r = j + 1 + p / m;
+            int c = j + 1 + p % m;
+            a[r * n + c] -= a[r * n + j] * a[j * n + c];
+        }
+    }
 
-    // Also terrible implementation, too little parallelism
-    for(int i = 1; i < matrixSize; i++) {
-        int ip = index[firstIId + i];
-        double sum = result[firstResId + ip];
-        result[firstResId + ip] = result[firstResId + i];
+    barrier(CLK_GLOBAL_MEM_FENCE);
+}
 
-        if (ii != 0) {
-            for(int j = ii; j <= i - 1; j++) {
-                sum -= matrix[firstMtxId + i * matrixSize + j] * result[firstResId + j];
-            }
-        }
-        else if (sum != 0.0) {
-            ii = i;
-        }
+void kernel solveSymmetric(global double *matrix, global double *result, global double *scratch,
+                           const int matrixSize, local double *values, local int *indices) {
+    const int n = matrixSize;
+    const int system = get_group_id(0);
+    int lid = get_local_id(0);
+    int localSize = get_local_size(0);
 
-        result[firstResId + i] = sum;
+    global double *a = matrix + (size_t)system * n * n;
+    global double *b = result + (size_t)system * n;
+    global double *diag = scratch + (size_t)system * n;
+
+    for (int i = 1 + lid; i < n; i += localSize) {
+        diag[i] = a[i * n + i];
     }
+    barrier(CLK_GLOBAL_MEM_FENCE);
 
-    for(int i = matrixSize - 1; i >= 1; i--) {
-        double sum = result[firstResId + i];
+    if (factorLdl(a, diag, n)) {
+        solveUnitLower(a, b, n);
 
-        for(int j = i + 1; j < matrixSize; j++) {
-            sum -= matrix[firstMtxId + i * matrixSize + j] * result[firstResId + j];
+        for (int i = 1 + lid; i < n; i += localSize) {
+            b[i] /= a[i * n + i];
         }
 
-        result[firstResId + i] = sum / matrix[firstMtxId + i * matrixSize + i];
+        solveUpper(a, b, n, true);
+        return;
+    }
+
+    // Restore the matrix from the upper triangle and the saved diagonal
+    for (int p = lid; p < n * n; p += localSize) {
+        int r = p / n;
+        int c = p % n;
+        if (r > c && c > 0) a[p] = a[c * n + r];
+        else if (r == c && r > 0) a[p] = diag[r];
     }
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    factorLu(a, b, diag, n, values, indices);
+    solveUnitLower(a, b, n);
+    solveUpper(a, b, n, false);
 }
 
-void kernel sigmaClipInitMask(global uchar *mask) {
-    int id = get_global_id(0);
+/*
+ * Sigma clip that stays on the device. state holds the number of points not
+ * yet clipped, the points clipped in this iteration and a done flag. Every
+ * iteration is sigmaClipCalc, sigmaClipStats, sigmaClipMask and
+ * sigmaClipUpdate; once done is set the remaining iterations return at once.
+ */
+
+#define SIGMA_CLIP_LOCAL_SIZE 32
 
-    mask[id - get_global_offset(0)] = 0;
+void kernel sigmaClipInitMask(global uchar *mask, global int *state, const int count) {
+    int id = get_global_id(0) - get_global_offset(0);
+
+    mask[id] = 0;
+
+    if (id == 0) {
+        state[0] = count;
+        state[1] = 0;
+        state[2] = 0;
+    }
 }
 
+// Sum and sum of squares of the points not clipped, per work-group.
 void kernel sigmaClipCalc(global double *sum, global double *sum2,
                           global const double *data, global const uchar *mask,
-                          const int count) {
+                          const int count, global const int *state) {
+    if (state[2]) return;
+
     int gid = get_global_id(0);
     int gidNoOffset = gid - get_global_offset(0);
     
     int lid = get_local_id(0);
     int groupId = get_group_id(0);
 
-    local double localD[32];
+    local double localD[SIGMA_CLIP_LOCAL_SIZE];
+    local double localD2[SIGMA_CLIP_LOCAL_SIZE];
 
+    double d = 0.0;
     if (gidNoOffset < count) {
-        double d = select(0.0, data[gid], (ulong)(mask[gidNoOffset] == 0));
-
-        localD[lid] = d;
+        d = select(0.0, data[gid], (ulong)(mask[gidNoOffset] == 0));
     }
 
+    localD[lid] = d;
+    localD2[lid] = d * d;
     barrier(CLK_LOCAL_MEM_FENCE);
 
+    for (int stride = SIGMA_CLIP_LOCAL_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            localD[lid] += localD[lid + stride];
+            localD2[lid] += localD2[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
     if (lid == 0) {
-        double s = 0.0;
-        double s2 = 0.0;
+        sum[groupId] = localD[0];
+        sum2[groupId] = localD2[0];
+    }
+}
 
-        int localCount = min((int)get_local_size(0), count - gidNoOffset);
+// Reduces the sums of sigmaClipCalc in one work-group and stores the mean and
+// standard deviation at resultIndex. Less than two points give mean 0 and a
+// standard deviation of 1e10, like the host version did.
+void kernel sigmaClipStats(global const double *sum, global const double *sum2, const int groupCount,
+                           global double *means, global double *stdDevs, const int resultIndex,
+                           global int *state) {
+    if (state[2]) return;
 
-        for (int i = 0; i < localCount; i++) {
-            double d = localD[i];
+    int lid = get_local_id(0);
+
+    local double localS[SIGMA_CLIP_LOCAL_SIZE];
+    local double localS2[SIGMA_CLIP_LOCAL_SIZE];
 
-            s += d;
-            s2 += d * d;
+    double s = 0.0;
+    double s2 = 0.0;
+    for (int i = lid; i < groupCount; i += SIGMA_CLIP_LOCAL_SIZE) {
+        s += sum[i];
+        s2 += sum2[i];
+    }
+
+    localS[lid] = s;
+    localS2[lid] = s2;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = SIGMA_CLIP_LOCAL_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            localS[lid] += localS[lid + stride];
+            localS2[lid] += localS2[lid + stride];
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        int n = state[0];
 
-        sum[groupId] = s;
-        sum2[groupId] = s2;
+        if (n <= 1) {
+            means[resultIndex] = 0.0;
+            stdDevs[resultIndex] = 1e10;
+            state[2] = 1;
+            return;
+        }
+
+        double mean = localS[0] / n;
+        means[resultIndex] = mean;
+        stdDevs[resultIndex] = sqrt((localS2[0] - n * mean * mean) / (n - 1));
+        state[1] = 0;
     }
 }
 
-void kernel sigmaClipMask(global uchar *mask, global int *clipCount,
+void kernel sigmaClipMask(global uchar *mask, global int *state,
                           global const double *data,
-                          const double invStdDev, const double mean, const double sigClipAlpha) {
+                          global const double *means, global const double *stdDevs, const int resultIndex,
+                          const double sigClipAlpha) {
+    if (state[2]) return;
+
     int dataId = get_global_id(0);
     int maskId = dataId - get_global_offset(0);
 
+    double mean = means[resultIndex];
+    double invStdDev = 1.0 / stdDevs[resultIndex];
+
     if (mask[maskId] == 0) {
         if (fabs(data[dataId] - mean) * invStdDev > sigClipAlpha) {
             mask[maskId] = 1;
-            atomic_inc(clipCount);
+            atomic_inc(&state[1]);
+        }
+    }
+}
+
+// Stops once an iteration clipped nothing.
+void kernel sigmaClipUpdate(global int *state) {
+    if (state[2]) return;
+
+    state[0] -= state[1];
+    if (state[1] == 0) {
+        state[2] = 1;
+    }
+}
+
+// Sigma clips segments of stride points at once, one work-group per segment
+// of which the first counts[segment] points are used. Same iterations and
+// results as the sigmaClip kernels above, mask holds the clipped points.
+void kernel sigmaClipSegments(global const double *data, global const int *counts, const int stride,
+                              global uchar *mask, global double *means, global double *stdDevs,
+                              const int maxIter, const double sigClipAlpha) {
+    const int segment = get_group_id(0);
+    const int lid = get_local_id(0);
+    const int count = counts[segment];
+
+    global const double *d = data + (size_t)segment * stride;
+    global uchar *m = mask + (size_t)segment * stride;
+
+    local double localS[SIGMA_CLIP_LOCAL_SIZE];
+    local double localS2[SIGMA_CLIP_LOCAL_SIZE];
+    local int localClip[SIGMA_CLIP_LOCAL_SIZE];
+
+    // Every work-item only touches its own points, so no barrier is needed
+    for (int i = lid; i < count; i += SIGMA_CLIP_LOCAL_SIZE) {
+        m[i] = 0;
+    }
+
+    int n = count;
+    double mean = 0.0;
+    double stdDev = 1e10;
+
+    for (int iter = 0; iter < maxIter; iter++) {
+        if (n <= 1) {
+            mean = 0.0;
+            stdDev = 1e10;
+            break;
+        }
+
+        // Calculate mean and standard deviation
+        double s = 0.0;
+        double s2 = 0.0;
+        for (int i = lid; i < count; i += SIGMA_CLIP_LOCAL_SIZE) {
+            if (m[i] == 0) {
+                s += d[i];
+                s2 += d[i] * d[i];
+            }
+        }
+
+        localS[lid] = s;
+        localS2[lid] = s2;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int stride = SIGMA_CLIP_LOCAL_SIZE / 2; stride > 0; stride >>= 1) {
+            if (lid < stride) {
+                localS[lid] += localS[lid + stride];
+                localS2[lid] += localS2[lid + stride];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        mean = localS[0] / n;
+        stdDev = sqrt((localS2[0] - n * mean * mean) / (n - 1));
+
+        // Mask bad values
+        double invStdDev = 1.0 / stdDev;
+        int clip = 0;
+        for (int i = lid; i < count; i += SIGMA_CLIP_LOCAL_SIZE) {
+            if (m[i] == 0 && fabs(d[i] - mean) * invStdDev > sigClipAlpha) {
+                m[i] = 1;
+                clip++;
+            }
+        }
+
+        localClip[lid] = clip;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int stride = SIGMA_CLIP_LOCAL_SIZE / 2; stride > 0; stride >>= 1) {
+            if (lid < stride) {
+                localClip[lid] += localClip[lid + stride];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        int clipped = localClip[0];
+        n -= clipped;
+        if (clipped == 0) break;
+    }
+
+    if (lid == 0) {
+        means[segment] = mean;
+        stdDevs[segment] = stdDev;
+    }
+}
+
+// Sorts segments of n = 2^k values in ascending order, one work-group per
+// segment. The whole bitonic network runs in local memory, every work-item
+// handles the pairs i, i ^ j of its indices.
+void kernel bitonicSortSegments(global double *data, local double *buf, const int n) {
+    const int lid = get_local_id(0);
+    const int localSize = get_local_size(0);
+    global double *segment = data + (size_t)get_group_id(0) * n;
+
+    for (int i = lid; i < n; i += localSize) {
+        buf[i] = segment[i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = 2; k <= n; k <<= 1) {
+        for (int j = k >> 1; j > 0; j >>= 1) {
+            for (int i = lid; i < n; i += localSize) {
+                int ixj = i ^ j;
+                if (ixj > i) {
+                    double a = buf[i];
+                    double b = buf[ixj];
+                    bool ascending = (i & k) == 0;
+
+                    if ((a > b) == ascending) {
+                        buf[i] = b;
+                        buf[ixj] = a;
+                    }
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+
+    for (int i = lid; i < n; i += localSize) {
+        segment[i] = buf[i];
+    }
+}
+
+// Exclusive scan of one value per work-item, returns the sum of the values
+// before the work-item and the sum of all in total. Work-efficient up- and
+// down-sweep over scan, the local size must be a power of two.
+int workGroupScan(const int v, local int *scan, int *total) {
+    const int lid = get_local_id(0);
+    const int n = get_local_size(0);
+
+    scan[lid] = v;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int d = 1; d < n; d <<= 1) {
+        int i = (lid + 1) * (d << 1) - 1;
+        if (i < n) {
+            scan[i] += scan[i - d];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    *total = scan[n - 1];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0) {
+        scan[n - 1] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int d = n >> 1; d > 0; d >>= 1) {
+        int i = (lid + 1) * (d << 1) - 1;
+        if (i < n) {
+            int t = scan[i - d];
+            scan[i - d] = scan[i];
+            scan[i] += t;
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    int prefix = scan[lid];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return prefix;
+}
+
+// Exclusive prefix sum of n values and their total, in one work-group. Chunks
+// of the local size are scanned one after another and offset by the sum of
+// the previous chunks.
+void kernel exclusiveScan(global const int *in, global int *out, const int n,
+                          global int *total, local int *scan) {
+    const int localSize = get_local_size(0);
+    int carry = 0;
+
+    for (int base = 0; base < n; base += localSize) {
+        int i = base + get_local_id(0);
+        int chunkTotal;
+        int prefix = workGroupScan(i < n ? in[i] : 0, scan, &chunkTotal);
+
+        if (i < n) {
+            out[i] = carry + prefix;
+        }
+        carry += chunkTotal;
+    }
+
+    if (get_local_id(0) == 0) {
+        *total = carry;
+    }
+}
+
+// Writes the index of every set flag to its position from the exclusive
+// scan of the flags, so the indices keep ascending order.
+void kernel scatterIndices(global const int *flags, global const int *positions,
+                           global int *indices, const int n) {
+    int i = get_global_id(0);
+    if (i < n && flags[i] != 0) {
+        indices[positions[i]] = i;
     }
 }
@@ -51,102 +51,49 @@ void kernel saveKernelSums(global const double *vec,
     kernelSums[stampId] = vec[stampId * matrixSize + 1];
 }
 
-void kernel genCdTestStamps(global const double *kernelSums,
-                            global int *testStampIndices, global int *testStampCount,
+void kernel genCdTestStamps(global const double *kernelSums, global int *testStampFlags,
                             const double kernelMean, const double kernelStdev, const double sigKernFit, const int stampCount) {
     int stampId = get_global_id(0);
-    int lstampId = get_local_id(0);
+    if (stampId >= stampCount) return;
 
-    local int localTestStampCount;
-
-    if (lstampId == 0) {
-        localTestStampCount = 0;
-    }
-
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    bool keepStamp = false;
-    int localIndex = 0;
-
-    if (stampId < stampCount) {
-        double diff = fabs((kernelSums[stampId] - kernelMean) / kernelStdev);
-        keepStamp = diff < sigKernFit;
-
-        if (keepStamp) {
-            localIndex = atomic_inc(&localTestStampCount);
-        }
-    }
-
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    local int firstGlobalId;
-
-    if (lstampId == 0) {
-        firstGlobalId = atomic_add(testStampCount, localTestStampCount);
-    }
-    
-    barrier(CLK_LOCAL_MEM_FENCE);
-
-    if (keepStamp) {
-        int index = firstGlobalId + localIndex;
-        testStampIndices[index] = stampId;
-    }
+    double diff = fabs((kernelSums[stampId] - kernelMean) / kernelStdev);
+    testStampFlags[stampId] = diff < sigKernFit;
 }
 
-void kernel copyTestSubStampsCoords(global const int2 *in, global const int *testStampIndices,
-                                    global int2 *out,
-                                    const int maxSubStamps) {
-    int subStampId = get_global_id(0);
+// Gathers all fields of the test stamps in one launch, one row of work-items
+// per test stamp. Each work-item strides over the elements of every field.
+void kernel gatherTestStamps(global const int *testStampIndices,
+                             global const int2 *inCoords, global const int *inCurrents, global const int *inCounts,
+                             global const double *inW, global const double *inQ, global const double *inB,
+                             global int2 *outCoords, global int *outCurrents, global int *outCounts,
+                             global double *outW, global double *outQ, global double *outB,
+                             const int maxSubStamps, const int wSize, const int qSize, const int bSize) {
+    int lid = get_global_id(0);
+    int step = get_global_size(0);
     int dstStampId = get_global_id(1);
 
     int srcStampId = testStampIndices[dstStampId];
 
-    out[dstStampId * maxSubStamps + subStampId] = in[srcStampId * maxSubStamps + subStampId];
-}
-
-void kernel copyTestSubStampsCounts(global const int *inCurrents, global const int *inCounts, global const int *testStampIndices,
-                                    global int *outCurrents, global int *outCounts) {
-    int dstStampId = get_global_id(0);
-
-    int srcStampId = testStampIndices[dstStampId];
-
-    outCurrents[dstStampId] = inCurrents[srcStampId];
-    outCounts[dstStampId] = inCounts[srcStampId];
-}
-
-void kernel copyTestStampsW(global const double *in, global const int *testStampIndices,
-                            global double *out,
-                            const int wRows, const int wColumns) {
-    int i = get_global_id(0);
-    int j = get_global_id(1);
-    int dstStampId = get_global_id(2);
-
-    int srcStampId = testStampIndices[dstStampId];
-
-    out[dstStampId * wColumns * wRows + j * wColumns + i] = in[srcStampId * wColumns * wRows + j * wColumns + i];
-}
-
-void kernel copyTestStampsQ(global const double *in, global const int *testStampIndices,
-                            global double *out,
-                            const int qCount) {
-    int i = get_global_id(0);
-    int j = get_global_id(1);
-    int dstStampId = get_global_id(2);
-
-    int srcStampId = testStampIndices[dstStampId];
+    if (lid == 0) {
+        outCurrents[dstStampId] = inCurrents[srcStampId];
+        outCounts[dstStampId] = inCounts[srcStampId];
+    }
 
-    out[dstStampId * qCount * qCount + j * qCount + i] = in[srcStampId * qCount * qCount + j * qCount + i];
-}
+    for (int i = lid; i < maxSubStamps; i += step) {
+        outCoords[dstStampId * maxSubStamps + i] = inCoords[srcStampId * maxSubStamps + i];
+    }
 
-void kernel copyTestStampsB(global const double *in, global const int *testStampIndices,
-                            global double *out,
-                            const int bCount) {
-    int i = get_global_id(0);
-    int dstStampId = get_global_id(1);
+    for (int i = lid; i < wSize; i += step) {
+        outW[(size_t)dstStampId * wSize + i] = inW[(size_t)srcStampId * wSize + i];
+    }
 
-    int srcStampId = testStampIndices[dstStampId];
+    for (int i = lid; i < qSize; i += step) {
+        outQ[(size_t)dstStampId * qSize + i] = inQ[(size_t)srcStampId * qSize + i];
+    }
 
-    out[dstStampId * bCount + i] = in[srcStampId * bCount + i];
+    for (int i = lid; i < bSize; i += step) {
+        outB[(size_t)dstStampId * bSize + i] = inB[(size_t)srcStampId * bSize + i];
+    }
 }
 
 void kernel createMatrixWeights(global const int2 *subStampCoords, global const int *currentSubStamps, global const int *subStampCounts, global const int2 *xy,
@@ -179,122 +126,125 @@ void kernel createMatrixWeights(global const int2 *subStampCoords, global const
     weights[stampId * count + k] = a;
 }
 
-void kernel createMatrix(global const double *weights, global const double *w, global const double *q,
-                         global double *matrix,
-                         const int stampCount, const int matrixSize, const int pixStamp, const int nComp1, const int nComp2,
-                         const int wRows, const int wColumns, const int qCount) {
-    int column = get_global_id(0);
-    int row = get_global_id(1);
+#define GRAM_TILE 16
 
-    int nComp = nComp1 * nComp2;
+// Gram matrix W * W^T of every stamp, as a batched matrix product in local
+// memory tiles. Only the tiles on and below the diagonal are computed, the
+// ones above are mirrored. Work-group z handles tile pair z % tilePairs of
+// stamp z / tilePairs.
+void kernel createStampGram(global const double *w, global double *gram,
+                            const int wRows, const int wColumns, const int tileCount) {
+    local double rowTile[GRAM_TILE][GRAM_TILE];
+    local double columnTile[GRAM_TILE][GRAM_TILE];
 
-    double m0 = 0.0;
+    int tx = get_local_id(0);
+    int ty = get_local_id(1);
 
-    if (column == 1 && row == 1) {
-        for (int stampId = 0; stampId < stampCount; stampId++) {
-            double q0 = q[stampId * qCount * qCount + 1 * qCount + 1];
-            m0 += q0;
-        }
-    }
-    else if (row > nComp + 1 && column > nComp + 1) {
-        int j = max(row, column);
-        int i = min(row, column);
+    int tilePairs = tileCount * (tileCount + 1) / 2;
+    int stampId = get_group_id(2) / tilePairs;
+    int pair = get_group_id(2) % tilePairs;
 
-        int iBg = j - (nComp + 2);
-        int jBg = i - (nComp + 2);
-        int iVecBg = nComp1 + iBg + 1;
+    // Lower triangle index to tile row and column
+    int tileRow = (int)((sqrt(8.0 * pair + 1.0) - 1.0) / 2.0);
+    while (tileRow * (tileRow + 1) / 2 > pair) tileRow--;
+    while ((tileRow + 1) * (tileRow + 2) / 2 <= pair) tileRow++;
+    int tileColumn = pair - tileRow * (tileRow + 1) / 2;
 
-        for (int stampId = 0; stampId < stampCount; stampId++) {
-            double q = 0.0;
+    int row = tileRow * GRAM_TILE + ty;
+    int column = tileColumn * GRAM_TILE + tx;
 
-            for (int k = 0; k < pixStamp; k++) {
-                double w0 = w[stampId * wRows * wColumns + iVecBg * wColumns + k];
-                double w1 = w[stampId * wRows * wColumns + (nComp1 + jBg + 1) * wColumns + k];
-                q += w0 * w1;
-            }
+    global const double *stampW = w + (size_t)stampId * wRows * wColumns;
+    double acc = 0.0;
 
-            m0 += q;
+    for (int k0 = 0; k0 < wColumns; k0 += GRAM_TILE) {
+        int k = k0 + tx;
+        int loadRow = tileRow * GRAM_TILE + ty;
+        int loadColumn = tileColumn * GRAM_TILE + ty;
+
+        rowTile[ty][tx] = loadRow < wRows && k < wColumns ? stampW[loadRow * wColumns + k] : 0.0;
+        columnTile[ty][tx] = loadColumn < wRows && k < wColumns ? stampW[loadColumn * wColumns + k] : 0.0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int t = 0; t < GRAM_TILE; t++) {
+            acc += rowTile[ty][t] * columnTile[tx][t];
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    else if (min(column, row) == 1 && max(column, row) > nComp + 1) {
-        int j = max(row, column);
-        int i = min(row, column);
-        
-        int iBg = j - (nComp + 2);
-        int iVecBg = nComp1 + iBg + 1;
 
-        for (int stampId = 0; stampId < stampCount; stampId++) {
-            double p0 = 0.0;
-
-            for (int k = 0; k < pixStamp; k++) {
-                double w0 = w[stampId * wRows * wColumns + 0 * wColumns + k];
-                double w1 = w[stampId * wRows * wColumns + iVecBg * wColumns + k];
-                p0 += w0 * w1;
-            }
+    if (row >= wRows || column >= wRows) return;
 
-            m0 += p0;
-        }
+    global double *stampGram = gram + (size_t)stampId * wRows * wRows;
+    stampGram[row * wRows + column] = acc;
+    if (tileRow != tileColumn) {
+        stampGram[column * wRows + row] = acc;
     }
-    else if (max(column, row) > nComp + 1 && min(column, row) >= 2) {
-        int j = max(row, column);
-        int i = min(row, column);
+}
 
-        int iBg = j - (nComp + 2);
-        int iVecBg = nComp1 + iBg + 1;
+// Normal equations from the stamp Gram matrices, one work-item per entry
+// on or below the diagonal, which also writes the mirrored entry.
+void kernel createMatrix(global const double *weights, global const double *gram,
+                         global double *matrix,
+                         const int stampCount, const int matrixSize, const int nComp1, const int nComp2,
+                         const int wRows) {
+    int column = get_global_id(0);
+    int row = get_global_id(1);
 
-        int jj = i - 1;
+    if (column > row) return;
 
-        int i1 = ((jj - 1) / nComp2) + 1;
-        int i2 = (jj - 1) % nComp2;
+    int nComp = nComp1 * nComp2;
+    int gramSize = wRows * wRows;
 
-        for (int stampId = 0; stampId < stampCount; stampId++) {
-            double p0 = 0.0;
-            
-            for (int k = 0; k < pixStamp; k++) {
-                double w0 = w[stampId * wRows * wColumns + i1 * wColumns + k];
-                double w1 = w[stampId * wRows * wColumns + iVecBg * wColumns + k];
-                p0 += w0 * w1;
-            }
-            
-            m0 += p0 * weights[stampId * nComp2 + i2];
-        }
-    }
-    else if (min(column, row) == 1 && max(column, row) >= 2) {
-        int i = max(row, column) - 2;
-        
-        int i1 = i / nComp2;
-        int i2 = i - i1 * nComp2;
+    // Gram rows of the two entry terms, and the weight of each
+    int gramRow = -1;
+    int gramColumn = -1;
+    int weightRow = -1;
+    int weightColumn = -1;
 
-        for (int stampId = 0; stampId < stampCount; stampId++) {
-            double w0 = weights[stampId * nComp2 + i2];
-            double q0 = q[stampId * qCount * qCount + (i1 + 2) * qCount + 1];
-            m0 += w0 * q0;
-        }
+    if (row == 1 && column == 1) {
+        gramRow = 0;
+        gramColumn = 0;
+    }
+    else if (row > nComp + 1 && column > nComp + 1) {
+        gramRow = nComp1 + row - (nComp + 2) + 1;
+        gramColumn = nComp1 + column - (nComp + 2) + 1;
+    }
+    else if (column == 1 && row > nComp + 1) {
+        gramRow = nComp1 + row - (nComp + 2) + 1;
+        gramColumn = 0;
+    }
+    else if (row > nComp + 1 && column >= 2) {
+        gramRow = nComp1 + row - (nComp + 2) + 1;
+        gramColumn = (column - 2) / nComp2 + 1;
+        weightColumn = (column - 2) % nComp2;
+    }
+    else if (column == 1 && row >= 2) {
+        gramRow = (row - 2) / nComp2 + 1;
+        gramColumn = 0;
+        weightRow = (row - 2) % nComp2;
     }
     else if (row >= 2 && column >= 2) {
-        int j = column - 2;
-        int i = row - 2;
-        
-        int ti = max(i, j);
-        int tj = min(i, j);
-        
-        int i1 = ti / nComp2;
-        int i2 = ti - i1 * nComp2;
-        int j1 = tj / nComp2;
-        int j2 = tj - j1 * nComp2;
+        gramRow = (row - 2) / nComp2 + 1;
+        gramColumn = (column - 2) / nComp2 + 1;
+        weightRow = (row - 2) % nComp2;
+        weightColumn = (column - 2) % nComp2;
+    }
+
+    double m0 = 0.0;
 
+    if (gramRow >= 0) {
         for (int stampId = 0; stampId < stampCount; stampId++) {
-            double w0 = weights[stampId * nComp2 + i2];
-            double w1 = weights[stampId * nComp2 + j2];
-            double q0 = q[stampId * qCount * qCount + (i1 + 2) * qCount + (j1 + 2)];
-            m0 += w0 * w1 * q0;
+            double g = gram[stampId * gramSize + gramRow * wRows + gramColumn];
+            if (weightRow >= 0) g *= weights[stampId * nComp2 + weightRow];
+            if (weightColumn >= 0) g *= weights[stampId * nComp2 + weightColumn];
+            m0 += g;
         }
     }
 
     matrix[row * matrixSize + column] = m0;
+    matrix[column * matrixSize + row] = m0;
 }
 
-void kernel createScProd(const global double *img, const global double *weights, const global double *b, const global double *w,
+void kernel createScProd(const global REAL *img, const global double *weights, const global double *b, const global double *w,
                          const global int2 *subStampCoords, const global int *currentSubStamps, const global int *subStampCounts,
                          global double *res,
                          const int width, const int stampCount, const int nComp1, const int nComp2, const int nBGComp,
@@ -530,7 +480,7 @@ void kernel makeModel(global const double *w, global const double *kernSol, glob
     model[stampId * modelSize + j] = m0;
 }
 
-void kernel calcSig(global const float *model, global const double *bg, global const double *tImg, global const double *sImg,
+void kernel calcSig(global const float *model, global const double *bg, global const REAL *tImg, global const REAL *sImg,
                     global const int2 *subStampCoords, global const int *currentSubStamps, global const int *subStampCounts,
                     global double *sig, global int *sigCount, global ushort *mask, local double *localSig,
                     const int width, const int subStampWidth, const int maxSubStamps, const int modelSize, const int reduceCount) {
@@ -67,89 +67,88 @@ void kernel createKernelVector(global const int2 *kernelXy,
     vec[n * kernelWidth * kernelWidth + v * kernelWidth + u] = vv;
 }
 
-void kernel convStampY(global const double *img, global const int2 *subStampCoords, global const int *currentSubStamps, global const int *subStampCounts,
-                       global const double *filterY,
-                       global float *tmp,
-                       const int kernelWidth, const int subStampWidth,
-                       const int width, const int gaussCount, const int maxSubStamps) {
-    int pixel = get_global_id(0);
-    int n = get_global_id(1);
-    int stampId = get_global_id(2);
+// Convolves one substamp with every gaussian basis, one work-group per stamp.
+// When it fits, the substamp window is loaded into local memory once and
+// shared by the Y and X passes of all bases, otherwise the Y pass reads the
+// image. The Y pass is done tmpRows output rows at a time so that tmp fits
+// in local memory. The even bases but the first have the first basis
+// subtracted, each work-item reads back the pixels it wrote for it.
+void kernel convStamp(global const REAL *img, global const int2 *subStampCoords, global const int *currentSubStamps, global const int *subStampCounts,
+                      global const int2 *kernelXy, global const double *filterX, global const double *filterY,
+                      global double *w,
+                      const int kernelWidth, const int subStampWidth,
+                      const int width, const int gaussCount, const int maxSubStamps,
+                      const int wRows, const int wColumns,
+                      local float *window, local float *tmp,
+                      const int windowResident, const int tmpRows) {
+    int lid = get_local_id(0);
+    int localSize = get_local_size(0);
+    int stampId = get_global_id(1);
 
     int ssIndex = currentSubStamps[stampId];
     int ssCount = subStampCounts[stampId];
+    bool valid = ssIndex < ssCount;
 
     int halfKernWidth = kernelWidth / 2;
     int halfSubStampWidth = subStampWidth / 2;
+    int winWidth = subStampWidth + kernelWidth - 1;
 
-    int xHalfSize = halfSubStampWidth + halfKernWidth;
-    int yHalfSize = halfSubStampWidth;
-    int pixelCount = (2 * xHalfSize + 1) * (2 * yHalfSize + 1);
-
-    float v = 0.0;
-
-    if (ssIndex < ssCount) {
-        int ssx = subStampCoords[stampId * maxSubStamps + ssIndex].x;
-        int ssy = subStampCoords[stampId * maxSubStamps + ssIndex].y;
-
-        int j = ssy + pixel / (2 * xHalfSize + 1) - yHalfSize;
-        int i = ssx + pixel % (2 * xHalfSize + 1) - xHalfSize;
+    int2 ss = valid ? subStampCoords[stampId * maxSubStamps + ssIndex] : (int2)(0, 0);
+    int firstX = ss.x - halfSubStampWidth - halfKernWidth;
+    int firstY = ss.y - halfSubStampWidth - halfKernWidth;
 
-        for (int y = -halfKernWidth; y <= halfKernWidth; y++) {
-            int imgIndex = i + (j + y) * width;
-            float imgV = img[imgIndex];
-            v += imgV * filterY[n * kernelWidth + halfKernWidth - y];
+    if (windowResident) {
+        for (int p = lid; p < winWidth * winWidth; p += localSize) {
+            window[p] = valid ? img[(firstX + p % winWidth) + (firstY + p / winWidth) * width] : 0.0f;
         }
     }
 
-    tmp[stampId * gaussCount * pixelCount + n * pixelCount + pixel] = v;
-}
+    global double *stampW = w + (size_t)stampId * wRows * wColumns;
 
-void kernel convStampX(global const float *tmp, global const double *filterX,
-                       global double *w, 
-                       const int kernelWidth, const int subStampWidth,
-                       const int wRows, const int wColumns,
-                       const int gaussCount) {
-    int pixel = get_global_id(0);
-    int n = get_global_id(1);
-    int stampId = get_global_id(2);
+    for (int n = 0; n < gaussCount; n++) {
+        int dx = (kernelXy[n].x / 2) * 2 - kernelXy[n].x;
+        int dy = (kernelXy[n].y / 2) * 2 - kernelXy[n].y;
+        bool subtractFirst = dx == 0 && dy == 0 && n > 0;
 
-    int halfKernWidth = kernelWidth / 2;
-    int halfSubStampWidth = subStampWidth / 2;
+        for (int firstRow = 0; firstRow < subStampWidth; firstRow += tmpRows) {
+            int rows = min(tmpRows, subStampWidth - firstRow);
 
-    int j = pixel / subStampWidth - halfSubStampWidth;
-    int i = pixel % subStampWidth - halfSubStampWidth;
+            // Also keeps the previous tile from reading tmp while it is rewritten
+            barrier(CLK_LOCAL_MEM_FENCE);
 
-    int subWidth = kernelWidth + subStampWidth - 1;
-    double w0 = 0.0f;
+            for (int p = lid; p < winWidth * rows; p += localSize) {
+                int i = p % winWidth;
+                int j = firstRow + p / winWidth;
 
-    int tmpPixelStride = (2 * (halfSubStampWidth + halfKernWidth) + 1) * (2 * halfSubStampWidth + 1);
-    int firstTmpId = stampId * gaussCount * tmpPixelStride + n * tmpPixelStride;
+                float v = 0.0;
+                for (int y = -halfKernWidth; y <= halfKernWidth; y++) {
+                    int row = j + halfKernWidth + y;
+                    float pix = windowResident ? window[i + row * winWidth] :
+                                valid ? (float)img[(firstX + i) + (firstY + row) * width] : 0.0f;
+                    v += pix * filterY[n * kernelWidth + halfKernWidth - y];
+                }
+                tmp[p] = v;
+            }
 
-    for(int x = -halfKernWidth; x <= halfKernWidth; x++) {
-        int index = (i + x) + subWidth / 2 + (j + halfSubStampWidth) * subWidth;
-        w0 += tmp[firstTmpId + index] * filterX[n * kernelWidth + halfKernWidth - x];
-    }
+            barrier(CLK_LOCAL_MEM_FENCE);
 
-    w[stampId * wRows * wColumns + n * wColumns + pixel] = w0;
-}
+            for (int p = lid; p < subStampWidth * rows; p += localSize) {
+                int i = p % subStampWidth;
+                int j = p / subStampWidth;
+                int pixel = firstRow * subStampWidth + p;
 
-void kernel convStampOdd(global const int2 *kernelXy,
-                         global double *w,
-                         const int wRows, const int wColumns) {
-    int pixel = get_global_id(0);
-    int n = get_global_id(1);
-    int stampId = get_global_id(2);
+                double v = 0.0;
+                for (int x = -halfKernWidth; x <= halfKernWidth; x++) {
+                    v += tmp[(i + halfKernWidth + x) + j * winWidth] * filterX[n * kernelWidth + halfKernWidth - x];
+                }
 
-    int x = kernelXy[n].x;
-    int y = kernelXy[n].y;
-    
-    int dx = (x / 2) * 2 - x;
-    int dy = (y / 2) * 2 - y;
+                if (subtractFirst) {
+                    v -= stampW[pixel];
+                }
 
-    // Not optimal, a lot of threads will do nothing
-    if (dx == 0 && dy == 0) {
-        w[stampId * wRows * wColumns + n * wColumns + pixel] -= w[stampId * wRows * wColumns + pixel];
+                stampW[n * wColumns + pixel] = v;
+            }
+        }
     }
 }
 
@@ -215,7 +214,7 @@ void kernel createQ(global const double *w,
 }
 
 void kernel createB(global const int2 *subStampCoords, global const int *currentSubStamps, global const int *subStampCounts,
-                    global const double *img, global const double *w,
+                    global const REAL *img, global const double *w,
                     global double *b,
                     const int wRows, const int wColumns, const int bCount,
                     const int subStampWidth, const int maxSubStamps,
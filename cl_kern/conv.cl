@@ -12,8 +12,9 @@
 #define MASK_SKIP_S (1 << 11)
 #define MASK_BAD_OUTPUT (1 << 12)
 
-void kernel createConvMask(global const double *img, global ushort *mask,
-                           const int w, const double threshHigh, const double threshLow) {
+// mask holds the rows from rowOffset on, img the rows of the launch.
+void kernel createConvMask(global const REAL *img, global ushort *mask,
+                           const int w, const int rowOffset, const double threshHigh, const double threshLow) {
   int x = get_global_id(0);
   int y = get_global_id(1);
 
@@ -25,17 +26,75 @@ void kernel createConvMask(global const double *img, global ushort *mask,
   m |= select(0, MASK_BAD_INPUT | MASK_SAT_PIXEL, t >= threshHigh);
   m |= select(0, MASK_BAD_INPUT | MASK_LOW_PIXEL, t <= threshLow);
 
-  mask[id] = m;
+  mask[id - rowOffset * w] = m;
 }
 
-void kernel conv(global const double *convKern, const int convWidth, const int xSteps,
-                 global const double *image, global double *outimg,
+// Output mask bits of a science pixel, the same as maskAfterConv sets.
+ushort scienceMask(const double t, const double threshHigh, const double threshLow) {
+  ushort m = 0;
+
+  m |= select(0, MASK_BAD_OUTPUT | MASK_BAD_INPUT | MASK_BAD_PIX_VAL, t == 0.0);
+  m |= select(0, MASK_BAD_OUTPUT | MASK_BAD_INPUT | MASK_SAT_PIXEL, t >= threshHigh);
+  m |= select(0, MASK_BAD_OUTPUT | MASK_BAD_INPUT | MASK_LOW_PIXEL, t <= threshLow);
+
+  return m;
+}
+
+// Stores the results of an interior pixel of conv or convTiled. With fuseSub
+// the science mask is added and the difference is written like sub does, the
+// convolved pixel is then only stored with writeConv.
+void storeConvPixel(const REAL acc, ushort newMask, const int bandId, const int imgId,
+                    global REAL *outimg, global ushort *outMask,
+                    global const REAL *sciImg, global REAL *diffImg, const int fuseSub, const int writeConv,
+                    const double threshHigh, const double threshLow, const double convFactor, const double finalFactor) {
+  if (fuseSub) {
+    REAL s = sciImg[imgId];
+    REAL d = 1e-30;
+
+    newMask |= scienceMask(s, threshHigh, threshLow);
+    if ((newMask & MASK_BAD_OUTPUT) == 0) {
+      d = (acc * (REAL)convFactor - s) * (REAL)finalFactor;
+    }
+
+    diffImg[bandId] = d;
+  }
+
+  if (writeConv) {
+    outimg[bandId] = acc;
+  }
+  outMask[imgId] = newMask;
+}
+
+// Stores a border pixel of conv or convTiled, see storeConvPixel.
+void storeConvBorder(const int bandId, const int imgId, global REAL *outimg, global ushort *outMask,
+                     global const REAL *sciImg, global REAL *diffImg, const int fuseSub, const int writeConv,
+                     const double threshHigh, const double threshLow) {
+  if (fuseSub) {
+    outMask[imgId] |= scienceMask(sciImg[imgId], threshHigh, threshLow);
+    diffImg[bandId] = 1e-30;
+  }
+
+  if (writeConv) {
+    outimg[bandId] = 1e-30;
+  }
+}
+
+// convMask, outimg and diffImg may hold only a band of rows starting at
+// rowOffset, image, sciImg and outMask the rows from imgRowOffset on. id is
+// always the pixel index in the full image. convKern starts
+// at kernel row firstYStep. sciImg and diffImg are only used with fuseSub.
+void kernel conv(global const REAL *convKern, const int convWidth, const int xSteps, const int firstYStep,
+                 global const REAL *image, global REAL *outimg,
                  global const ushort *convMask, global ushort *outMask, global const double *kernSolution,
-                 const int w, const int h, const int bgOrder, const int nBgComp, const double invKernMult) {
+                 const int w, const int h, const int rowOffset, const int imgRowOffset, const int bgOrder, const int nBgComp, const double invKernMult,
+                 global const REAL *sciImg, global REAL *diffImg, const int fuseSub, const int writeConv,
+                 const double threshHigh, const double threshLow, const double convFactor, const double finalFactor) {
   const int id = get_global_id(0);
-  double acc = 0.0;
+  REAL acc = 0.0;
   const int x = id % w;
   const int y = id / w;
+  const int bandId = id - rowOffset * w;
+  const int imgId = id - imgRowOffset * w;
 
   int halfConvWidth = convWidth / 2;
 
@@ -45,11 +104,11 @@ void kernel conv(global const double *convKern, const int convWidth, const int x
     int xS = (x - halfConvWidth) / convWidth;
     int yS = (y - halfConvWidth) / convWidth;
 
-    int convOffset = (xS + yS * xSteps) * convWidth * convWidth;
+    int convOffset = (xS + (yS - firstYStep) * xSteps) * convWidth * convWidth;
 
     int maskAcc = 0;
-    double aks = 0.0;
-    double uks = 0.0;
+    REAL aks = 0.0;
+    REAL uks = 0.0;
 
     for(int j = y - halfConvWidth; j <= y + halfConvWidth; j++) {
       int jk = y - j + halfConvWidth;
@@ -57,14 +116,15 @@ void kernel conv(global const double *convKern, const int convWidth, const int x
         int ik = x - i + halfConvWidth;
         int convIndex = ik + jk * convWidth;
         convIndex += convOffset;
-        int imgIndex = i + w * j;
+        int imgIndex = i + w * j - imgRowOffset * w;
+        int maskIndex = i + w * j - rowOffset * w;
 
-        double kk = convKern[convIndex];
+        REAL kk = convKern[convIndex];
         acc += kk * image[imgIndex];
-        maskAcc |= convMask[imgIndex];
+        maskAcc |= convMask[maskIndex];
         aks += fabs(kk);
 
-        if ((convMask[imgIndex] & MASK_BAD_INPUT) == 0) {
+        if ((convMask[maskIndex] & MASK_BAD_INPUT) == 0) {
           uks += fabs(kk);
         }
       }
@@ -73,11 +133,113 @@ void kernel conv(global const double *convKern, const int convWidth, const int x
     acc += getBackground(x, y, kernSolution, w, h, bgOrder, nBgComp);
     acc *= invKernMult;
 
-    outimg[id] = acc;
+    ushort newMask = convMask[bandId];
 
-    ushort newMask = convMask[id];
+    if ((convMask[bandId] & MASK_BAD_INPUT) != 0) {
+      newMask |= MASK_BAD_OUTPUT;
+    }
 
-    if ((convMask[id] & MASK_BAD_INPUT) != 0) {
+    if (maskAcc != 0) {
+      if ((uks / aks) < 0.99f) {
+        newMask |= MASK_BAD_OUTPUT | MASK_BAD_CONV;
+      }
+      else {
+        newMask |= MASK_OK_CONV;
+      }
+    }
+
+    storeConvPixel(acc, newMask, bandId, imgId, outimg, outMask, sciImg, diffImg, fuseSub, writeConv,
+                   threshHigh, threshLow, convFactor, finalFactor);
+  } else {
+    storeConvBorder(bandId, imgId, outimg, outMask, sciImg, diffImg, fuseSub, writeConv, threshHigh, threshLow);
+  }
+}
+
+// Same as conv but launched as a 2D range. Each work-group first loads its
+// tile of image and convMask plus a halfConvWidth apron into local memory, so
+// neighbouring pixels share the loads. Rows [rowStart, rowEnd) are computed.
+void kernel convTiled(global const REAL *convKern, const int convWidth, const int xSteps, const int firstYStep,
+                      global const REAL *image, global REAL *outimg,
+                      global const ushort *convMask, global ushort *outMask, global const double *kernSolution,
+                      local REAL *imgTile, local ushort *maskTile,
+                      const int w, const int h, const int rowOffset, const int imgRowOffset, const int rowEnd,
+                      const int bgOrder, const int nBgComp, const double invKernMult,
+                      global const REAL *sciImg, global REAL *diffImg, const int fuseSub, const int writeConv,
+                      const double threshHigh, const double threshLow, const double convFactor, const double finalFactor) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int lx = get_local_id(0);
+  const int ly = get_local_id(1);
+  const int tileW = get_local_size(0);
+  const int tileH = get_local_size(1);
+
+  const int halfConvWidth = convWidth / 2;
+  const int apronW = tileW + 2 * halfConvWidth;
+  const int apronH = tileH + 2 * halfConvWidth;
+  const int apronX = x - lx - halfConvWidth;
+  const int apronY = y - ly - halfConvWidth;
+  const int bufferEnd = min(rowEnd + halfConvWidth, h);
+
+  for(int j = ly; j < apronH; j += tileH) {
+    int gy = apronY + j;
+    for(int i = lx; i < apronW; i += tileW) {
+      int gx = apronX + i;
+      bool inside = gx >= 0 && gx < w && gy >= rowOffset && gy < bufferEnd;
+      int imgIndex = inside ? gx + (gy - imgRowOffset) * w : 0;
+      int maskIndex = inside ? gx + (gy - rowOffset) * w : 0;
+
+      imgTile[i + j * apronW] = inside ? image[imgIndex] : 0.0;
+      maskTile[i + j * apronW] = inside ? convMask[maskIndex] : 0;
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if(x >= w || y >= rowEnd) return;
+
+  const int bandId = x + (y - rowOffset) * w;
+  const int imgId = x + (y - imgRowOffset) * w;
+
+  if(x >= halfConvWidth && x < w - halfConvWidth && y >= halfConvWidth &&
+     y < h - halfConvWidth) {
+
+    int xS = (x - halfConvWidth) / convWidth;
+    int yS = (y - halfConvWidth) / convWidth;
+
+    global const REAL *kern = convKern + (xS + (yS - firstYStep) * xSteps) * convWidth * convWidth;
+
+    REAL acc = 0.0;
+    int maskAcc = 0;
+    REAL aks = 0.0;
+    REAL uks = 0.0;
+
+    // Window row jj of the tile is image row y - halfConvWidth + jj, the
+    // kernel is applied flipped like in conv.
+    for(int jj = 0; jj < convWidth; jj++) {
+      int jk = convWidth - 1 - jj;
+      int tileRow = (ly + jj) * apronW + lx;
+      for(int ii = 0; ii < convWidth; ii++) {
+        int ik = convWidth - 1 - ii;
+
+        REAL kk = kern[ik + jk * convWidth];
+        ushort m = maskTile[tileRow + ii];
+        acc += kk * imgTile[tileRow + ii];
+        maskAcc |= m;
+        aks += fabs(kk);
+
+        if ((m & MASK_BAD_INPUT) == 0) {
+          uks += fabs(kk);
+        }
+      }
+    }
+
+    acc += getBackground(x, y, kernSolution, w, h, bgOrder, nBgComp);
+    acc *= invKernMult;
+
+    ushort centerMask = maskTile[(lx + halfConvWidth) + (ly + halfConvWidth) * apronW];
+    ushort newMask = centerMask;
+
+    if ((centerMask & MASK_BAD_INPUT) != 0) {
       newMask |= MASK_BAD_OUTPUT;
     }
 
@@ -89,25 +251,159 @@ void kernel conv(global const double *convKern, const int convWidth, const int x
         newMask |= MASK_OK_CONV;
       }
     }
-    
-    outMask[id] = newMask;
+
+    storeConvPixel(acc, newMask, bandId, imgId, outimg, outMask, sciImg, diffImg, fuseSub, writeConv,
+                   threshHigh, threshLow, convFactor, finalFactor);
   } else {
+    storeConvBorder(bandId, imgId, outimg, outMask, sciImg, diffImg, fuseSub, writeConv, threshHigh, threshLow);
+  }
+}
+
+// Coefficient of kernel basis n > 0 at (xf, yf), see makeKernelCoeffs.
+double getKernelCoeff(global const double *kernSol, const int n, const int kernelOrder,
+                      const int kernXyCount, const double xf, const double yf) {
+  int k = 2 + (n - 1) * kernXyCount;
+  double c = 0.0;
+  double aX = 1.0;
+
+  for (int x = 0; x <= kernelOrder; x++) {
+    double aY = 1.0;
+
+    for (int y = 0; y <= kernelOrder - x; y++) {
+      c += kernSol[k++] * aX * aY;
+      aY *= yf;
+    }
+
+    aX *= xf;
+  }
+
+  return c;
+}
+
+// Vertical pass of the convolution with the separable basis n.
+void kernel convBasisY(global const REAL *image, global const double *filterY, global REAL *tmp,
+                       const int n, const int convWidth, const int w, const int h) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int halfConvWidth = convWidth / 2;
+
+  if (x >= w || y < halfConvWidth || y >= h - halfConvWidth) return;
+
+  global const double *f = filterY + n * convWidth;
+  REAL acc = 0.0;
+
+  for (int v = 0; v < convWidth; v++) {
+    acc += (REAL)f[v] * image[x + (y + halfConvWidth - v) * w];
+  }
+
+  tmp[x + y * w] = acc;
+}
+
+// Horizontal pass of the convolution with basis n. Basis 0 is stored in
+// basis0, the others are weighted with their coefficient at the pixel and
+// summed into outimg. Even bases with n > 0 have basis 0 subtracted, like
+// createKernelVector does.
+void kernel convBasisX(global const REAL *tmp, global const double *filterX, global const int2 *kernelXy,
+                       global const double *kernSol, global REAL *basis0, global REAL *outimg,
+                       const int n, const int convWidth, const int w, const int h,
+                       const int kernelOrder, const int kernXyCount) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int halfConvWidth = convWidth / 2;
+
+  if (x < halfConvWidth || x >= w - halfConvWidth || y < halfConvWidth || y >= h - halfConvWidth) return;
+
+  const int id = x + y * w;
+  global const double *f = filterX + n * convWidth;
+  REAL acc = 0.0;
+
+  for (int u = 0; u < convWidth; u++) {
+    acc += (REAL)f[u] * tmp[id + halfConvWidth - u];
+  }
+
+  if (n == 0) {
+    basis0[id] = acc;
+    return;
+  }
+
+  int kx = kernelXy[n].x;
+  int ky = kernelXy[n].y;
+  if ((kx / 2) * 2 == kx && (ky / 2) * 2 == ky) {
+    acc -= basis0[id];
+  }
+
+  double xf = (x - 0.5 * w) / (0.5 * w);
+  double yf = (y - 0.5 * h) / (0.5 * h);
+  outimg[id] += getKernelCoeff(kernSol, n, kernelOrder, kernXyCount, xf, yf) * acc;
+}
+
+// Adds basis 0 and the background to the summed bases. The mask is built as
+// in conv, but with the kernel at the image center for every pixel.
+void kernel convBasisFinal(global const REAL *basis0, global REAL *outimg,
+                           global const REAL *centerKern, const int convWidth,
+                           global const ushort *convMask, global ushort *outMask, global const double *kernSolution,
+                           const int w, const int h, const int bgOrder, const int nBgComp, const double invKernMult) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int halfConvWidth = convWidth / 2;
+
+  if (x >= w || y >= h) return;
+
+  const int id = x + y * w;
+
+  if (x < halfConvWidth || x >= w - halfConvWidth || y < halfConvWidth || y >= h - halfConvWidth) {
     outimg[id] = 1e-30;
+    return;
+  }
+
+  double acc = outimg[id] + kernSolution[1] * basis0[id];
+  acc += getBackground(x, y, kernSolution, w, h, bgOrder, nBgComp);
+  outimg[id] = acc * invKernMult;
+
+  int maskAcc = 0;
+  REAL aks = 0.0;
+  REAL uks = 0.0;
+
+  for (int jk = 0; jk < convWidth; jk++) {
+    int j = y + halfConvWidth - jk;
+    for (int ik = 0; ik < convWidth; ik++) {
+      int i = x + halfConvWidth - ik;
+      REAL kk = fabs(centerKern[ik + jk * convWidth]);
+      ushort m = convMask[i + j * w];
+
+      maskAcc |= m;
+      aks += kk;
+
+      if ((m & MASK_BAD_INPUT) == 0) {
+        uks += kk;
+      }
+    }
+  }
+
+  ushort newMask = convMask[id];
+
+  if ((convMask[id] & MASK_BAD_INPUT) != 0) {
+    newMask |= MASK_BAD_OUTPUT;
+  }
+
+  if (maskAcc != 0) {
+    if ((uks / aks) < 0.99f) {
+      newMask |= MASK_BAD_OUTPUT | MASK_BAD_CONV;
+    }
+    else {
+      newMask |= MASK_OK_CONV;
+    }
   }
+
+  outMask[id] = newMask;
 }
 
-void kernel maskAfterConv(global const double *img, global ushort *mask,
+void kernel maskAfterConv(global const REAL *img, global ushort *mask,
                           const int w, const double threshHigh, const double threshLow) {
   int x = get_global_id(0);
   int y = get_global_id(1);
 
   int id = x + y * w;
-  double t = img[id];
-  ushort m = 0;
-
-  m |= select(0, MASK_BAD_OUTPUT | MASK_BAD_INPUT | MASK_BAD_PIX_VAL, t == 0.0);
-  m |= select(0, MASK_BAD_OUTPUT | MASK_BAD_INPUT | MASK_SAT_PIXEL, t >= threshHigh);
-  m |= select(0, MASK_BAD_OUTPUT | MASK_BAD_INPUT | MASK_LOW_PIXEL, t <= threshLow);
 
-  mask[id] |= m;
+  mask[id] |= scienceMask(img[id], threshHigh, threshLow);
 }
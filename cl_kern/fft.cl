@@ -0,0 +1,209 @@
+#define MASK_BAD_CONV (1 << 4)
+#define MASK_OK_CONV (1 << 6)
+#define MASK_BAD_INPUT (1 << 7)
+#define MASK_BAD_OUTPUT (1 << 12)
+
+/*
+ * Overlap-save convolution. The image is cut into blocks of n x n pixels that
+ * overlap by convWidth - 1, each block yields (n - convWidth + 1)^2 output
+ * pixels. Blocks are stored one after another, n * n complex values each.
+ */
+
+int bitReverse(int i, const int logN) {
+  int r = 0;
+  for (int b = 0; b < logN; b++) {
+    r = (r << 1) | (i & 1);
+    i >>= 1;
+  }
+  return r;
+}
+
+// Radix-2 FFT of one row of length n = 2^logN per work-group of n / 2
+// work-items, in place. The inverse transform is not normalized.
+void kernel fftRows(global double2 *data, local double2 *buf, const int logN, const int inverse) {
+  const int n = 1 << logN;
+  const int halfN = n / 2;
+  const int lid = get_local_id(0);
+  global double2 *row = data + (size_t)get_group_id(0) * n;
+
+  buf[bitReverse(lid, logN)] = row[lid];
+  buf[bitReverse(lid + halfN, logN)] = row[lid + halfN];
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  const double sign = inverse ? 1.0 : -1.0;
+
+  for (int s = 1; s <= logN; s++) {
+    int half = 1 << (s - 1);
+    int k = lid % half;
+    int j = (lid / half) * (half << 1) + k;
+
+    double c;
+    double sn = sincos(sign * M_PI * k / half, &c);
+
+    double2 a = buf[j];
+    double2 b = buf[j + half];
+    double2 t = (double2)(c * b.x - sn * b.y, c * b.y + sn * b.x);
+
+    buf[j] = (double2)(a.x + t.x, a.y + t.y);
+    buf[j + half] = (double2)(a.x - t.x, a.y - t.y);
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  row[lid] = buf[lid];
+  row[lid + halfN] = buf[lid + halfN];
+}
+
+void kernel fftTranspose(global const double2 *in, global double2 *out, const int n) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const size_t block = (size_t)get_global_id(2) * n * n;
+
+  out[block + y + x * n] = in[block + x + y * n];
+}
+
+// Loads the image blocks of blockRows rows of blocks, starting at firstBlockRow.
+// Pixels outside the image are zero.
+void kernel fftLoadBlocks(global const REAL *image, global double2 *data,
+                          const int n, const int convWidth, const int blocksX, const int firstBlockRow,
+                          const int w, const int h) {
+  const int p = get_global_id(0);
+  const int q = get_global_id(1);
+  const int block = get_global_id(2);
+
+  const int halfConvWidth = convWidth / 2;
+  const int outSize = n - convWidth + 1;
+  const int bx = block % blocksX;
+  const int by = block / blocksX + firstBlockRow;
+
+  const int x = bx * outSize - halfConvWidth + p;
+  const int y = by * outSize - halfConvWidth + q;
+  const bool inside = x >= 0 && x < w && y >= 0 && y < h;
+
+  data[(size_t)block * n * n + p + q * n] = (double2)(inside ? image[x + y * w] : 0.0, 0.0);
+}
+
+// Multiplies every block with spectrum kernIndex of kernSpec, both in the
+// same layout.
+void kernel fftMultiply(global const double2 *data, global const double2 *kernSpec, global double2 *out,
+                        const int kernIndex, const int n) {
+  const int p = get_global_id(0);
+  const int q = get_global_id(1);
+  const size_t block = (size_t)get_global_id(2) * n * n;
+
+  double2 a = data[block + p + q * n];
+  double2 b = kernSpec[(size_t)kernIndex * n * n + p + q * n];
+
+  out[block + p + q * n] = (double2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+// Adds the valid part of the blocks convolved with the kernel of monomial
+// xf^xOrder * yf^yOrder, weighted with the monomial at the center of the
+// kernel tile like conv does.
+void kernel fftAccumulate(global const double2 *data, global REAL *outimg,
+                          const int n, const int convWidth, const int blocksX, const int firstBlockRow,
+                          const int w, const int h, const int xOrder, const int yOrder, const double norm) {
+  const int p = get_global_id(0);
+  const int q = get_global_id(1);
+  const int block = get_global_id(2);
+
+  const int halfConvWidth = convWidth / 2;
+  const int outSize = n - convWidth + 1;
+  const int bx = block % blocksX;
+  const int by = block / blocksX + firstBlockRow;
+
+  if (p >= outSize || q >= outSize) return;
+
+  const int x = bx * outSize + p;
+  const int y = by * outSize + q;
+
+  if (x < halfConvWidth || x >= w - halfConvWidth || y < halfConvWidth || y >= h - halfConvWidth) return;
+
+  int xc = ((x - halfConvWidth) / convWidth) * convWidth + 2 * halfConvWidth;
+  int yc = ((y - halfConvWidth) / convWidth) * convWidth + 2 * halfConvWidth;
+  double xf = (xc - 0.5 * w) / (0.5 * w);
+  double yf = (yc - 0.5 * h) / (0.5 * h);
+
+  double v = data[(size_t)block * n * n + (p + convWidth - 1) + (q + convWidth - 1) * n].x;
+  outimg[x + y * w] += pown(xf, xOrder) * pown(yf, yOrder) * v * norm;
+}
+
+void kernel dilateMaskRows(global const ushort *mask, global ushort *rowMask,
+                           const int convWidth, const int w, const int h) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int halfConvWidth = convWidth / 2;
+
+  if (x >= w || y >= h) return;
+
+  ushort m = 0;
+  for (int i = max(x - halfConvWidth, 0); i <= min(x + halfConvWidth, w - 1); i++) {
+    m |= mask[i + y * w];
+  }
+
+  rowMask[x + y * w] = m;
+}
+
+// Background, scaling and output mask of the FFT convolution, same result
+// as conv. The window is only weighted when a masked pixel is inside it.
+void kernel convFftFinal(global REAL *outimg, global const REAL *convKern, const int xSteps,
+                         global const ushort *convMask, global const ushort *rowMask, global ushort *outMask,
+                         global const double *kernSolution, const int convWidth,
+                         const int w, const int h, const int bgOrder, const int nBgComp, const double invKernMult) {
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const int halfConvWidth = convWidth / 2;
+
+  if (x >= w || y >= h) return;
+
+  const int id = x + y * w;
+
+  if (x < halfConvWidth || x >= w - halfConvWidth || y < halfConvWidth || y >= h - halfConvWidth) {
+    outimg[id] = 1e-30;
+    return;
+  }
+
+  double acc = outimg[id] + getBackground(x, y, kernSolution, w, h, bgOrder, nBgComp);
+  outimg[id] = acc * invKernMult;
+
+  int maskAcc = 0;
+  for (int j = y - halfConvWidth; j <= y + halfConvWidth; j++) {
+    maskAcc |= rowMask[x + j * w];
+  }
+
+  ushort newMask = convMask[id];
+
+  if ((convMask[id] & MASK_BAD_INPUT) != 0) {
+    newMask |= MASK_BAD_OUTPUT;
+  }
+
+  if (maskAcc != 0) {
+    int xS = (x - halfConvWidth) / convWidth;
+    int yS = (y - halfConvWidth) / convWidth;
+    global const REAL *kern = convKern + (xS + yS * xSteps) * convWidth * convWidth;
+
+    REAL aks = 0.0;
+    REAL uks = 0.0;
+
+    for (int j = y - halfConvWidth; j <= y + halfConvWidth; j++) {
+      int jk = y - j + halfConvWidth;
+      for (int i = x - halfConvWidth; i <= x + halfConvWidth; i++) {
+        int ik = x - i + halfConvWidth;
+        REAL kk = fabs(kern[ik + jk * convWidth]);
+
+        aks += kk;
+        if ((convMask[i + j * w] & MASK_BAD_INPUT) == 0) {
+          uks += kk;
+        }
+      }
+    }
+
+    if ((uks / aks) < 0.99f) {
+      newMask |= MASK_BAD_OUTPUT | MASK_BAD_CONV;
+    }
+    else {
+      newMask |= MASK_OK_CONV;
+    }
+  }
+
+  outMask[id] = newMask;
+}
@@ -12,7 +12,36 @@
 #define MASK_SKIP_S (1 << 11)
 #define MASK_BAD_OUTPUT (1 << 12)
 
-void kernel maskInput(global const double *tmplImg, global const double *sciImg, global ushort *mask,
+// Converts the big-endian pixels of a FITS image, as stored in the file, to
+// REAL. bitpix is the FITS BITPIX of the pixels.
+void kernel decodeImage(global const uchar *raw, global REAL *img, const int bitpix,
+                        const double bscale, const double bzero) {
+  const size_t id = get_global_id(0);
+  double v;
+
+  if (bitpix == 8) {
+    v = raw[id];
+  }
+  else if (bitpix == 16) {
+    ushort u = ((global const ushort *)raw)[id];
+    v = (short)((u >> 8) | (u << 8));
+  }
+  else if (bitpix == 32 || bitpix == -32) {
+    uint u = ((global const uint *)raw)[id];
+    u = (u >> 24) | ((u >> 8) & 0xff00) | ((u << 8) & 0xff0000) | (u << 24);
+    v = bitpix == 32 ? (double)(int)u : (double)as_float(u);
+  }
+  else {
+    ulong u = ((global const ulong *)raw)[id];
+    u = (u >> 56) | ((u >> 40) & 0xff00) | ((u >> 24) & 0xff0000) | ((u >> 8) & 0xff000000) |
+        ((u << 8) & 0xff00000000) | ((u << 24) & 0xff0000000000) | ((u << 40) & 0xff000000000000) | (u << 56);
+    v = bitpix == 64 ? (double)(long)u : as_double(u);
+  }
+
+  img[id] = v * bscale + bzero;
+}
+
+void kernel maskInput(global const REAL *tmplImg, global const REAL *sciImg, global ushort *mask,
                       const int w, const int h, const int borderSize,
                       const double threshHigh, const double threshLow) {
   const int id = get_global_id(0);
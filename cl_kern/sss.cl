@@ -78,7 +78,7 @@ double ran1(int *idum, long *ix1, long *ix2, long *ix3, double *r, int *iff) {
     return temp;
 }
 
-void kernel sampleStamp(global const double *img, global const ushort *mask, 
+void kernel sampleStamp(global const REAL *img, global const ushort *mask, 
                         global const int2 *stampsCoords, global const int2 *stampsSizes,
                         global double *samples, global int *sampleCounts,
                         const int w, const int nSamples) {
@@ -124,37 +124,12 @@ void kernel pad(global const double *buffer, global double *paddedBuffer,
         idx < n ? buffer[stamp * n + idx] : INFINITY;
 }
 
-static void exchangeDouble(global double *i, global double *j)
-{
-	double k;
-	k = *i;
-	*i = *j;
-	*j = k;
-}
-
-void kernel sortSamples(global double *paddedSamples, const int paddedNSamples, const int j, const int k){
-    int id = get_global_id(0);                        
-    
-    const int i = id % paddedNSamples;
-    const int stamp = id / paddedNSamples;
-    const int ixj=i^j; // Calculate indexing!
-    if ((ixj)>i)
-    {
-        if ((i&k)==0 && paddedSamples[id] > paddedSamples[stamp * paddedNSamples + ixj]) {
-        exchangeDouble(&paddedSamples[id], &paddedSamples[stamp * paddedNSamples + ixj]);
-        }
-        if ((i&k)!=0 && paddedSamples[id] < paddedSamples[stamp * paddedNSamples + ixj]) {
-        exchangeDouble(&paddedSamples[id], &paddedSamples[stamp * paddedNSamples + ixj]);
-        }
-    }
-}
-
 void kernel resetGoodPixelCounts(global int *goodPixelCounts) {
     int id = get_global_id(0);
     goodPixelCounts[id] = 0;
 }
 
-void kernel maskStamp(global const double *img, global ushort *mask, 
+void kernel maskStamp(global const REAL *img, global ushort *mask, 
                       global const int2 *stampCoords, 
                       global double *goodPixels, global int *goodPixelCounts,
                       const int fullStampWidth, const int w, const int h){
@@ -187,9 +162,9 @@ void kernel maskStamp(global const double *img, global ushort *mask,
 
 }
 
-void kernel createHistogram(global const double *img, global const ushort *mask,
+void kernel createHistogram(global const REAL *img, global const ushort *mask,
                             global const int2 *stampCoords, global const int2 *stampSizes,
-                            global const double *means, global const double *invStdDevs,
+                            global const double *means, global const double *stdDevs,
                             global const double *paddedSamples, global const int *sampleCounts,
                             global int *bins, global double *fwhms, global double *skyEsts,
                             const int width, const int stampCount,
@@ -210,7 +185,7 @@ void kernel createHistogram(global const double *img, global const ushort *mask,
     double midProc = 0.5;
 
     double mean = means[stampId];
-    double invStdDev = invStdDevs[stampId];
+    double invStdDev = 1.0 / stdDevs[stampId];
 
     double upProcSample = paddedSamples[stampId * paddedNSamples + (int)(upProc * sampleCount)];
     double midProcSample = paddedSamples[stampId * paddedNSamples + (int)(midProc * sampleCount)];
@@ -323,41 +298,60 @@ void kernel createHistogram(global const double *img, global const ushort *mask,
     skyEsts[stampId] = skyEst;
 }
 
-double checkSStamp(global const double *img, global ushort *mask,
-                   const double skyEst, const double fwhm, const long imgW,
-                   const int2 sstampCoords, const int hSStampWidth,
-                   const int2 stampCoords, const int2 stampSize,
-                   const double threshHigh, const double threshKernFit,
-                   const ushort badMask, const ushort badPixelMask) {
-    double retVal = 0.0;
-    int stamp = get_global_id(0);
+// Work-group reductions used by findSubStamps, the local size must be a
+// power of two. The first barrier also publishes the mask writes made since
+// the last barrier.
+int groupMinInt(const int v, local int *buf) {
+    int lid = get_local_id(0);
+    buf[lid] = v;
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s) buf[lid] = min(buf[lid], buf[lid + s]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
 
-    int startX = max(sstampCoords.x - hSStampWidth, stampCoords.x);
-    int startY = max(sstampCoords.y - hSStampWidth, stampCoords.y);
-    int endX   = min(sstampCoords.x + hSStampWidth, stampCoords.x + stampSize.x - 1);
-    int endY   = min(sstampCoords.y + hSStampWidth, stampCoords.y + stampSize.y - 1);
-    
-    for(int y = startY; y <= endY; y++) {
-        for(int x = startX; x <= endX; x++) {
-            
-            int absCoords = x + y * imgW;
-            if ((mask[absCoords] & badMask) > 0) {
-                return 0.0;
-            }
+    int r = buf[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return r;
+}
 
-            double imgValue = img[absCoords];
-            if(imgValue > threshHigh) {
-                mask[absCoords] |= badPixelMask;
-                return 0.0;
-            }
-            
-            double kernFit = (imgValue - skyEst) / fwhm;
-            if((imgValue - skyEst) / fwhm > threshKernFit) {
-                retVal += imgValue;
+double groupSum(const double v, local double *buf) {
+    int lid = get_local_id(0);
+    buf[lid] = v;
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s) buf[lid] += buf[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    double r = buf[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return r;
+}
+
+// Largest value, the lowest index wins ties
+int groupArgMax(const double v, const int index, local double *values, local int *indices) {
+    int lid = get_local_id(0);
+    values[lid] = v;
+    indices[lid] = index;
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            double other = values[lid + s];
+            if (other > values[lid] || (other == values[lid] && indices[lid + s] < indices[lid])) {
+                values[lid] = other;
+                indices[lid] = indices[lid + s];
             }
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    return retVal;
+
+    int r = indices[0];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return r;
 }
 
 void sortSubStamps(const int substampCount, local int2 *coords, local double *values)
@@ -378,7 +372,13 @@ void sortSubStamps(const int substampCount, local int2 *coords, local double *va
     }
 }
 
-void kernel findSubStamps(global const double* img, global ushort *mask, 
+/*
+ * One work-group per stamp. The stamp is scanned in raster order one chunk
+ * of local size pixels at a time, the first candidate of a chunk is found
+ * with a reduction. Its window maximum and the substamp check are reduced
+ * over the window, so the substamps are the same as with a serial scan.
+ */
+void kernel findSubStamps(global const REAL* img, global ushort *mask, 
                           global const int2 *stampsCoords, global const int2 *stampsSizes,
                           global const double *skyEsts, global const double *fwhms,
                           global int2 *sstampsCoords, global double *sstampsValues,
@@ -386,9 +386,11 @@ void kernel findSubStamps(global const double* img, global ushort *mask,
                           const double threshHigh, const double threshKernFit,
                           const int imgW, const int fStampWidth, const int hSStampWidth,
                           const int maxSStamps, const int maxStamps, const ushort badMask, const ushort badPixelMask, const ushort skipMask,
-                          local int2 *localSubStampCoords, local double *localSubStampValues) {
-    int stamp      = get_global_id(0);
-    int localStamp = get_local_id(0);
+                          local int2 *localSubStampCoords, local double *localSubStampValues,
+                          local double *scratchValues, local int *scratchIndices) {
+    int stamp = get_group_id(0);
+    int lid = get_local_id(0);
+    int localSize = get_local_size(0);
     if (stamp >= maxStamps) return;
 
     double skyEst = skyEsts[stamp];
@@ -399,145 +401,144 @@ void kernel findSubStamps(global const double* img, global ushort *mask,
     
     int2 stampCoords = stampsCoords[stamp];
     int2 stampSize =  stampsSizes[stamp];
+    int pixelCount = fStampWidth * fStampWidth;
 
     int sstampCounter = 0;
     while(sstampCounter < maxSStamps) {
         double lowestPSFLim = max(floor, skyEst + (threshHigh - skyEst) * dfrac);
-        for(int y = 0; y < fStampWidth; y++) {
-            int absy = y + stampCoords.y;
-            for(int x = 0; x < fStampWidth; x++) {
-                int absx = x + stampCoords.x;
-                int absCoords  = absx + (absy * imgW);
-                
-                if ((mask[absCoords] & badMask) > 0) {
-                    continue;
+
+        int start = 0;
+        while(start < pixelCount && sstampCounter < maxSStamps) {
+            // The skip and bad pixel bits of the last candidate must be
+            // visible before the scan reads the mask again
+            barrier(CLK_GLOBAL_MEM_FENCE);
+
+            int p = start + lid;
+            int candidate = INT_MAX;
+
+            if(p < pixelCount) {
+                int absCoords = (p % fStampWidth + stampCoords.x) + (p / fStampWidth + stampCoords.y) * imgW;
+
+                if ((mask[absCoords] & badMask) == 0) {
+                    double imgValue = img[absCoords];
+                    if(imgValue > threshHigh) {
+                        mask[absCoords] |= badPixelMask;
+                    }
+                    else if((imgValue - skyEst) * (1.0 / fwhm) >= threshKernFit && imgValue > lowestPSFLim) {
+                        candidate = p;
+                    }
                 }
+            }
 
-                double imgValue = img[absCoords];
-                if(imgValue > threshHigh) {
-                    mask[absCoords] |= badPixelMask;
+            candidate = groupMinInt(candidate, scratchIndices);
+            if(candidate == INT_MAX) {
+                start += localSize;
+                continue;
+            }
+            start = candidate + 1;
+
+            // Brightest good pixel around the candidate
+            int absx = candidate % fStampWidth + stampCoords.x;
+            int absy = candidate / fStampWidth + stampCoords.y;
+            int startX = max(absx - hSStampWidth, stampCoords.x);
+            int startY = max(absy - hSStampWidth, stampCoords.y);
+            int endX   = min(absx + hSStampWidth, stampCoords.x + fStampWidth - 1);
+            int endY   = min(absy + hSStampWidth, stampCoords.y + fStampWidth - 1);
+            int winW = endX - startX + 1;
+
+            double maxVal = 0.0;
+            int maxIndex = INT_MAX;
+            for(int i = lid; i < winW * (endY - startY + 1); i += localSize) {
+                int kCoords = (startX + i % winW) + (startY + i / winW) * imgW;
+                if ((mask[kCoords] & badMask) > 0) {
                     continue;
                 }
 
-                if((imgValue - skyEst) * (1.0 / fwhm) < threshKernFit) {
+                double kImgValue = img[kCoords];
+                if(kImgValue >= threshHigh) {
+                    mask[kCoords] |= badPixelMask;
+                    continue;
+                }
+                if((kImgValue - skyEst) * (1.0 / fwhm) < threshKernFit) {
                     continue;
                 }
 
-                if(imgValue > lowestPSFLim) {  // good candidate found
-                    double maxVal = 0;
-                    int2  maxCoords;
-                    maxCoords.x = (int)absx;
-                    maxCoords.y = (int)absy;
-                    int startX = max(absx - hSStampWidth, stampCoords.x);
-                    int startY = max(absy - hSStampWidth, stampCoords.y);
-                    int endX   = min(absx + hSStampWidth, stampCoords.x + fStampWidth - 1);
-                    int endY   = min(absy + hSStampWidth, stampCoords.y + fStampWidth - 1);
-                    
-                    for(int ky = startY; ky <= endY; ky++) {
-                        for(int kx = startX; kx <= endX; kx++) {
-                            
-                            int kCoords = kx + (ky * imgW);
-                            double kImgValue = img[kCoords];
-                            if ((mask[kCoords] & badMask) > 0) {
-                                continue;
-                            }
-
-                            if(kImgValue >= threshHigh) {
-                                mask[kCoords] |= badPixelMask;
-                                continue;
-                            }
-                            if((kImgValue - skyEst) * (1.0 / fwhm) < threshKernFit) {
-                                continue;
-                            }
-
-                            if(kImgValue > maxVal) {
-                                maxVal = kImgValue;
-                                maxCoords.x = (int)kx;
-                                maxCoords.y = (int)ky;
-                            }
-                        }
-                    }
-                    
-                    maxVal = checkSStamp(img, mask, skyEst, fwhm, imgW,
-                                         maxCoords, hSStampWidth,
-                                         stampCoords, stampSize,
-                                         threshHigh, threshKernFit,
-                                         badMask, badPixelMask);
-                    
-                    if(maxVal == 0.0) continue;
-                
-                    localSubStampCoords[localStamp * maxSStamps + sstampCounter] = maxCoords;
-                    localSubStampValues[localStamp * maxSStamps + sstampCounter] = maxVal;
-                    sstampCounter++;
-    
-                    int startX2 = max(maxCoords.x - hSStampWidth, stampCoords.x);
-                    int startY2 = max(maxCoords.y - hSStampWidth, stampCoords.y);
-                    int endX2 = min(maxCoords.x + hSStampWidth, stampCoords.x + stampSize.x - 1);
-                    int endY2 = min(maxCoords.y + hSStampWidth, stampCoords.y + stampSize.y - 1);
-
-                    for(int y = startY2; y <= endY2; y++) {
-                        for(int x = startX2; x <= endX2; x++) {
-                            mask[x + y*imgW] |= skipMask;
-                        }
+                if(kImgValue > maxVal) {
+                    maxVal = kImgValue;
+                    maxIndex = kCoords;
+                }
+            }
+
+            maxIndex = groupArgMax(maxVal, maxIndex, scratchValues, scratchIndices);
+            int2 maxCoords = maxIndex == INT_MAX ? (int2)(absx, absy) : (int2)(maxIndex % imgW, maxIndex / imgW);
+
+            // Check the substamp, it is rejected by its first bad pixel
+            int startX2 = max(maxCoords.x - hSStampWidth, stampCoords.x);
+            int startY2 = max(maxCoords.y - hSStampWidth, stampCoords.y);
+            int endX2 = min(maxCoords.x + hSStampWidth, stampCoords.x + stampSize.x - 1);
+            int endY2 = min(maxCoords.y + hSStampWidth, stampCoords.y + stampSize.y - 1);
+            int winW2 = endX2 - startX2 + 1;
+            int winSize2 = winW2 * (endY2 - startY2 + 1);
+
+            double sum = 0.0;
+            int firstBad = INT_MAX;
+            for(int i = lid; i < winSize2; i += localSize) {
+                int absCoords = (startX2 + i % winW2) + (startY2 + i / winW2) * imgW;
+                double imgValue = img[absCoords];
+
+                if((mask[absCoords] & badMask) > 0 || imgValue > threshHigh) {
+                    firstBad = min(firstBad, i);
+                }
+                else if((imgValue - skyEst) / fwhm > threshKernFit) {
+                    sum += imgValue;
+                }
+            }
+
+            firstBad = groupMinInt(firstBad, scratchIndices);
+            if(firstBad != INT_MAX) {
+                if(lid == 0) {
+                    int absCoords = (startX2 + firstBad % winW2) + (startY2 + firstBad / winW2) * imgW;
+                    if((mask[absCoords] & badMask) == 0) {
+                        mask[absCoords] |= badPixelMask;
                     }
                 }
-                if(sstampCounter >= maxSStamps) break;
+                continue;
+            }
+
+            sum = groupSum(sum, scratchValues);
+            if(sum == 0.0) continue;
+
+            if(lid == 0) {
+                localSubStampCoords[sstampCounter] = maxCoords;
+                localSubStampValues[sstampCounter] = sum;
+            }
+            sstampCounter++;
+
+            for(int i = lid; i < winSize2; i += localSize) {
+                mask[(startX2 + i % winW2) + (startY2 + i / winW2) * imgW] |= skipMask;
             }
-            if(sstampCounter >= maxSStamps) break;
         }
+
         if(lowestPSFLim == floor) break;
         dfrac -= 0.2;
     }
-        
-    sortSubStamps(sstampCounter, 
-        &localSubStampCoords[localStamp*maxSStamps], 
-        &localSubStampValues[localStamp*maxSStamps]);
-
-    sstampsCounts[stamp] = min(sstampCounter, maxSStamps / 2);
-    for(int i = 0; i < sstampCounter; i++) {
-        sstampsCoords[stamp * maxSStamps + i] = localSubStampCoords[localStamp*maxSStamps + i];
-        sstampsValues[stamp * maxSStamps + i] = localSubStampValues[localStamp*maxSStamps + i];
-    }
-    for (int i = sstampCounter; i<maxSStamps; i++) {
-        sstampsCoords[stamp * maxSStamps + i] = (int2)(INT_MAX, INT_MAX);
-        sstampsValues[stamp * maxSStamps + i] = -INFINITY;
-    }
-}
 
-void kernel markStampsToKeep(global const int *sstampCounts, global int *keepIndeces, global int *keepCounter){
-    int stamp = get_global_id(0);
-    if (sstampCounts[stamp] > 0) {
-        keepIndeces[atomic_inc(keepCounter)] = stamp;
+    if(lid == 0) {
+        sortSubStamps(sstampCounter, localSubStampCoords, localSubStampValues);
+        sstampsCounts[stamp] = min(sstampCounter, maxSStamps / 2);
     }
-}
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-void kernel padMarks(global int *keepIndeces, global const int *keepCounter) {
-    int stamp = get_global_id(0);
-    if (stamp >= *keepCounter) {
-        keepIndeces[stamp] = INT_MAX;
+    for(int i = lid; i < maxSStamps; i += localSize) {
+        bool found = i < sstampCounter;
+        sstampsCoords[stamp * maxSStamps + i] = found ? localSubStampCoords[i] : (int2)(INT_MAX, INT_MAX);
+        sstampsValues[stamp * maxSStamps + i] = found ? localSubStampValues[i] : -INFINITY;
     }
 }
 
-void exchangeInt(global int *i, global int *j) {
-	int k;
-	k = *i;
-	*i = *j;
-	*j = k;
-}
-
-void kernel sortMarks(global int *keepIndeces, const int j, const int k) {
-    int i = get_global_id(0);
-
-    const int ixj=i^j; // Calculate indexing!
-    if ((ixj)>i)
-    {
-        if ((i&k)==0 && keepIndeces[i] > keepIndeces[ixj]) {
-        exchangeInt(&keepIndeces[i], &keepIndeces[ixj]);
-        }
-        if ((i&k)!=0 && keepIndeces[i] < keepIndeces[ixj]) {
-        exchangeInt(&keepIndeces[i], &keepIndeces[ixj]);
-        }
-    }
+void kernel markStampsToKeep(global const int *sstampCounts, global int *keepFlags){
+    int stamp = get_global_id(0);
+    keepFlags[stamp] = sstampCounts[stamp] > 0;
 }
 
 void kernel removeEmptyStamps(global const int2 *stampCoords, global const int2 *stampSizes,
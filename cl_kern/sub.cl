@@ -12,22 +12,113 @@
 #define MASK_SKIP_S (1 << 11)
 #define MASK_BAD_OUTPUT (1 << 12)
 
-void kernel sub(global const double *S, global const double *I,
-                global const ushort *mask, global double *D,
-                const int convWidth, const int w, const int h,
+// I and D may hold only a band of rows starting at rowOffset, S and mask the
+// rows from imgRowOffset on.
+void kernel sub(global const REAL *S, global const REAL *I,
+                global const ushort *mask, global REAL *D,
+                const int convWidth, const int w, const int h, const int rowOffset, const int imgRowOffset,
                 const double convFactor, const double finalFactor) {
   const int id = get_global_id(0);
   const int x = id % w;
   const int y = id / w;
+  const int bandId = id - rowOffset * w;
+  const int imgId = id - imgRowOffset * w;
 
   int halfConvWidth = convWidth / 2;
-  double d = 1e-30;
+  REAL d = 1e-30;
 
   if(x >= halfConvWidth && x < w - halfConvWidth && y >= halfConvWidth && y < h - halfConvWidth) {
-    if ((mask[id] & MASK_BAD_OUTPUT) == 0) {
-      d = (I[id] * convFactor - S[id]) * finalFactor;
+    if ((mask[imgId] & MASK_BAD_OUTPUT) == 0) {
+      d = (I[bandId] * (REAL)convFactor - S[imgId]) * (REAL)finalFactor;
     }
   }
 
-  D[id] = d;
-}
\ No newline at end of file
+  D[bandId] = d;
+}
+
+// Noise of the difference image for Poisson pixels with unit gain, the
+// variance of the convolved image is approximated by its value.
+void kernel noise(global const REAL *S, global const REAL *I,
+                  global const ushort *mask, global REAL *N,
+                  const int convWidth, const int w, const int h, const int rowOffset,
+                  const double convFactor, const double finalFactor) {
+  const int id = get_global_id(0);
+  const int x = id % w;
+  const int y = id / w;
+  const int bandId = id - rowOffset * w;
+
+  int halfConvWidth = convWidth / 2;
+  REAL n = 1e-30;
+
+  if(x >= halfConvWidth && x < w - halfConvWidth && y >= halfConvWidth && y < h - halfConvWidth) {
+    if ((mask[bandId] & MASK_BAD_OUTPUT) == 0) {
+      n = sqrt(fabs(S[bandId]) + fabs(I[bandId] * (REAL)convFactor)) * fabs((REAL)finalFactor);
+    }
+  }
+
+  N[bandId] = n;
+}
+
+#define DIFF_STATS_LOCAL_SIZE 64
+
+// Count, sum and sum of squares of the good difference pixels in [lo, hi],
+// and the count of bad output pixels, per work-group. The global offset is
+// the first pixel of the rows, every work-item strides over them.
+void kernel diffStats(global const REAL *D, global const ushort *mask, global double *partials,
+                      const int count, const int convWidth, const int w, const int h, const int rowOffset,
+                      const double lo, const double hi) {
+  const int lid = get_local_id(0);
+  const int halfConvWidth = convWidth / 2;
+
+  local double n[DIFF_STATS_LOCAL_SIZE];
+  local double s[DIFF_STATS_LOCAL_SIZE];
+  local double s2[DIFF_STATS_LOCAL_SIZE];
+  local double bad[DIFF_STATS_LOCAL_SIZE];
+
+  double ln = 0.0, ls = 0.0, ls2 = 0.0, lbad = 0.0;
+
+  for (int i = get_global_id(0) - get_global_offset(0); i < count; i += get_global_size(0)) {
+    const int id = i + get_global_offset(0);
+    const int x = id % w;
+    const int y = id / w;
+    const int bandId = id - rowOffset * w;
+
+    if (x < halfConvWidth || x >= w - halfConvWidth || y < halfConvWidth || y >= h - halfConvWidth) continue;
+
+    if ((mask[bandId] & MASK_BAD_OUTPUT) != 0) {
+      lbad += 1.0;
+      continue;
+    }
+
+    double d = D[bandId];
+    if (d >= lo && d <= hi) {
+      ln += 1.0;
+      ls += d;
+      ls2 += d * d;
+    }
+  }
+
+  n[lid] = ln;
+  s[lid] = ls;
+  s2[lid] = ls2;
+  bad[lid] = lbad;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int stride = DIFF_STATS_LOCAL_SIZE / 2; stride > 0; stride >>= 1) {
+    if (lid < stride) {
+      n[lid] += n[lid + stride];
+      s[lid] += s[lid + stride];
+      s2[lid] += s2[lid + stride];
+      bad[lid] += bad[lid + stride];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0) {
+    global double *p = partials + 4 * get_group_id(0);
+    p[0] = n[0];
+    p[1] = s[0];
+    p[2] = s2[0];
+    p[3] = bad[0];
+  }
+}
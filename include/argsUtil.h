@@ -3,10 +3,12 @@
 #include <array>
 #include <CL/opencl.hpp>
 #include <string>
+#include <vector>
 
 struct Arguments {
   std::string templateName;
   std::string scienceName;
+  std::string scienceList;  // list file or directory of science images, batch mode
   std::string outName = "diff.fits";
 
   std::string inputPath = "res/";
@@ -49,6 +51,21 @@ struct Arguments {
 
   bool verbose = false;
   bool verboseTime = false;
+  bool profile = false;  // OpenCL event profiling report
+  bool dumpStamps = false;  // copy W, Q and B of the stamps to the host after every fill, for debugging
+  bool multiDevice = false;  // split conv and sub across all devices of a platform
+  bool fuseSub = false;  // sub done by the direct convolution kernel
+  bool basisConv = false;  // convolve once per separable kernel basis instead of per kernel tile
+  std::string convMethod = "auto";  // auto, direct or fft
+  bool verifyConv = false;  // compare the FFT convolution with the direct one
+  bool singlePrecision = false;  // images, convolution and subtraction in float
+  std::string outCompression = "";  // tile compression of the outputs, rice or gzip
+  bool outConv = true;  // products written, see -out
+  bool outDiff = true;
+  bool outNoise = false;
+  bool outMask = false;
+  bool diffStats = false;  // clipped statistics of the difference image, reduced on the device
+  int stripRows = 0;  // conv and sub outputs in strips of this many rows written as they finish, 0 for whole frames; inputs stay resident
 };
 
 const char* getCmdOption(const char** begin, const char** end, const std::string& option);
@@ -56,3 +73,5 @@ const char* getCmdOption(const char** begin, const char** end, const std::string
 bool cmdOptionExists(const char** begin, const char** end, const std::string& option);
 
 void getArguments(const int argc, const char* argv[], Arguments& args);
+
+std::vector<std::string> getScienceNames(const Arguments& args);
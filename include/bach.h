@@ -1,8 +1,12 @@
 #pragma once
 
 #include <filesystem>
+#include <future>
+#include <optional>
 
 #include "datatypeUtil.h"
+#include "fitsUtil.h"
+#include "profUtil.h"
 
 struct ClStampsData {
     cl::Buffer stampCoords; // (x, y) coordinates
@@ -22,16 +26,57 @@ struct ClStampsData {
     int stampCount;
 };
 
+// Rows of the image handled by one device in multi-device mode. The band
+// buffers hold rows [haloStart, haloEnd), the device computes [rowStart, rowEnd).
+struct ClRowBand {
+    cl::CommandQueue queue;
+    int rowStart;
+    int rowEnd;
+    int haloStart;
+    int haloEnd;
+
+    cl::Buffer tImg;
+    cl::Buffer sImg;
+    cl::Buffer convMask;
+    cl::Buffer mask;
+    cl::Buffer convImg;
+    cl::Buffer kernels;
+    cl::Buffer diffImg; // Only set when sub is fused into the convolution
+};
+
+// Subtraction done by the convolution kernel, see enqueueConv
+struct FusedSub {
+    cl::Buffer sImg;
+    cl::Buffer diffImg;
+    double convFactor;
+    double finalFactor;
+    bool writeConv; // Also store the convolved image
+};
+
+// Image whose pixels are read on a worker thread, see startImageRead
+struct PendingImage {
+    std::optional<RawImage> raw;
+    cl::Buffer staging; // Pinned, FITS pixels as stored in the file
+    void *pixels;
+    std::future<Image> read;
+};
+
 struct ClData {
     cl::Device &device;
     cl::Context &context;
     cl::Program &program;
-    cl::CommandQueue &queue;
+    cl::CommandQueue &queue; // In-order, commands are chained with event wait-lists
+    Profiler &profiler;
+
+    // One queue per device in multi-device mode, the first is queue
+    std::vector<cl::CommandQueue> deviceQueues;
+    std::vector<ClRowBand> bands;
 
     cl::Buffer tImgBuf;
     cl::Buffer sImgBuf;
     cl::Buffer maskBuf;
     cl::Buffer convImg;
+    cl::Buffer diffImg; // Only set when sub is fused into conv
 
     struct {
         cl::Buffer xy;
@@ -41,10 +86,6 @@ struct ClData {
         cl::Buffer solution;
     } kernel;
 
-    struct {
-        cl::Buffer yConvTmp;
-    } cmv;
-
     struct {
         cl::Buffer xy;
     } bg;
@@ -63,14 +104,18 @@ struct ClData {
     ClStampsData sci;
 };
 
-void init(Image &templateImg, Image &scienceImg, ClData& clData, const Arguments& args);
+void initTemplate(PendingImage &pendingTemplate, Image &templateImg, ClData& clData, const Arguments& args);
+void initScience(const Image &templateImg, PendingImage &pendingScience, Image &scienceImg, ClData& clData, const Arguments& args);
 void sss(const std::pair<cl_int, cl_int> &axis, std::vector<Stamp> &templateStamps, std::vector<Stamp> &sciStamps, Arguments& args, ClData& clData);
 void cmv(const std::pair<cl_int, cl_int> &axis, std::vector<Stamp> &templateStamps, std::vector<Stamp> &sciStamps, const Kernel &convolutionKernel, ClData &clData, const Arguments& args);
 bool cd(Image &templateImg, Image &scienceImg, std::vector<Stamp> &templateStamps, std::vector<Stamp> &sciStamps, ClData &clData, const Arguments& args);
 void ksc(std::vector<Stamp> &templateStamps, Kernel &convolutionKernel, const Image &sImg, const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf,
          ClData &clData, const ClStampsData &stampData, const Arguments& args);
-double conv(const std::pair<cl_int, cl_int> &imgSize, Image &convImg, Kernel &convolutionKernel, bool convTemplate,
+double conv(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, Kernel &convolutionKernel, bool convTemplate,
             ClData &clData, const Arguments& args);
-void sub(const std::pair<cl_int, cl_int> &imgSize, Image &diffImg, bool convTemplate, double kernSum,
-         const ClData &clData, const Arguments& args);
-void fin(const Image &convImg, const Image &diffImg, const Arguments& args);
+void sub(const std::pair<cl_int, cl_int> &imgSize, OutputImage &diffImg, OutputImage &noiseImg, MaskImage &maskImg,
+         bool convTemplate, double kernSum, const ClData &clData, const Arguments& args);
+void convSub(const std::pair<cl_int, cl_int> &imgSize, const OutputImage &convImg, const OutputImage &diffImg, Kernel &convolutionKernel,
+             bool convTemplate, ClData &clData, const Arguments& args);
+void fin(std::future<void> &convWrite, const OutputImage &diffImg, const OutputImage &noiseImg, const MaskImage &maskImg,
+         const Arguments& args);
@@ -13,46 +13,90 @@
 #include "datatypeUtil.h"
 
 /* Utils */
-void maskInput(const std::pair<cl_int, cl_int> &axis, const ClData& clData, const Arguments& args);
-void sigmaClip(const cl::Buffer &data, int dataOffset, int dataCount, double *mean, double *stdDev, int maxIter, const ClData &clData, const Arguments& args);
-
-void calcStats(const std::pair<cl_int, cl_int> &axis, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData);
-
-void ludcmp(const cl::Buffer &matrix, int matrixSize, int stampCount, const cl::Buffer &index, const cl::Buffer &vv, const ClData &clData);
-void lubksb(const cl::Buffer &matrix, int matrixSize, int stampCount, const cl::Buffer &index, const cl::Buffer &result, const ClData &clData);
-int ludcmp(std::vector<std::vector<double>>& matrix, const int matrixSize,
-           std::vector<int>& index, double& rowInter, const Arguments& args);
-void lubksb(std::vector<std::vector<double>>& matrix, const int matrixSize,
-            const std::vector<int>& index, std::vector<double>& result);
-double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, const std::pair<cl_int, cl_int> &imgSize, const int x, const int y, const Arguments& args, const ClData &clData);
+cl::Event maskInput(const std::pair<cl_int, cl_int> &axis, const ClData& clData, const Arguments& args, const std::vector<cl::Event> &waitEvents = {});
+cl::Event sigmaClip(const cl::Buffer &data, int dataOffset, int dataCount, const cl::Buffer &means, const cl::Buffer &stdDevs, int resultIndex,
+                    int maxIter, const ClData &clData, const Arguments& args, const std::vector<cl::Event> &waitEvents = {});
+void sigmaClip(const cl::Buffer &data, int dataOffset, int dataCount, double *mean, double *stdDev, int maxIter, const ClData &clData, const Arguments& args,
+               const std::vector<cl::Event> &waitEvents = {});
+
+cl::Event sortSegments(const cl::Buffer &data, int segmentLength, int segmentCount, const ClData &clData,
+                       const std::vector<cl::Event> &waitEvents = {});
+cl::Event exclusiveScan(const cl::Buffer &in, const cl::Buffer &out, int n, const cl::Buffer &total, const ClData &clData,
+                        const std::vector<cl::Event> &waitEvents = {});
+cl::Event compactIndices(const cl::Buffer &flags, int n, const cl::Buffer &indices, const cl::Buffer &count, const ClData &clData,
+                         const std::vector<cl::Event> &waitEvents = {});
+
+cl::Event calcStats(const std::pair<cl_int, cl_int> &axis, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData);
+
+cl::Event solveSymmetric(const cl::Buffer &matrix, const cl::Buffer &result, int matrixSize, int systemCount, const cl::Buffer &scratch,
+                         const ClData &clData, const std::vector<cl::Event> &waitEvents = {});
+double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, const std::pair<cl_int, cl_int> &imgSize, const int x, const int y, const Arguments& args, const ClData &clData,
+                  const std::vector<cl::Event> &waitEvents = {});
 double makeKernel(Kernel& kern, const std::pair<cl_int, cl_int> &imgSize, const int x,
                   const int y, const Arguments& args);
 
+size_t realSize(const Arguments& args);
+cl::Event writeRealBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t count, const double *data, const Arguments& args,
+                          const std::vector<cl::Event> &waitEvents = {});
+cl::Event readRealBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t offset, size_t count, double *data, const Arguments& args,
+                         const std::vector<cl::Event> &waitEvents = {});
+cl::Event readFloatBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t offset, size_t count, cl_float *data,
+                          const ClData &clData, const Arguments& args, const std::vector<cl::Event> &waitEvents = {});
+cl::Event fillRealBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t count, double value, const Arguments& args);
+PendingImage startImageRead(const Image &img, const ClData &clData, const Arguments& args);
+void waitImageRead(PendingImage &pending, Image &img, const ClData &clData);
+cl::Event uploadImage(const PendingImage &pending, const Image &img, const cl::Buffer &imgBuf, const ClData &clData, const Arguments& args);
+
 /* SSS */
-void createStamps(std::vector<Stamp>& stamps, const int w, const int h, ClStampsData& stampsData, const ClData& clData, const Arguments& args);
-cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData);
+cl::Event createStamps(std::vector<Stamp>& stamps, const int w, const int h, ClStampsData& stampsData, const ClData& clData, const Arguments& args);
+cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData,
+                   const std::vector<cl::Event> &waitEvents = {});
 void removeEmptyStamps(const Arguments& args, ClStampsData& stampsData, const ClData& clData);
 void identifySStamps(const std::pair<cl_int, cl_int> &axis, const Arguments& args, ClData& clData);
-void resetSStampSkipMask(const int w, const int h, const ClData& clData);
+cl::Event resetSStampSkipMask(const int w, const int h, const ClData& clData);
 void readFinalStamps(std::vector<Stamp>& stamps, const ClStampsData& stampsData, const ClData& clData, const Arguments& args);
 
 /* CMV */
 void initFillStamps(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis, const cl::Buffer& tImgBuf, const cl::Buffer& sImgBuf,
-               const Kernel& k, ClData& clData, ClStampsData& stampData, const Arguments& args);
+               const Kernel& k, ClData& clData, ClStampsData& stampData, const Arguments& args, const std::vector<cl::Event> &waitEvents = {});
 void fillStamps(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis, const cl::Buffer& tImgBuf, const cl::Buffer& sImgBuf,
-               int stampOffset, int stampCount, const Kernel& k, const ClData& clData, const ClStampsData& stampData, const Arguments& args);
+               int stampOffset, int stampCount, const Kernel& k, const ClData& clData, const ClStampsData& stampData, const Arguments& args,
+               const std::vector<cl::Event> &waitEvents = {});
+
+/* Conv && Sub */
+cl::Event enqueueConv(cl::CommandQueue &queue, const std::vector<cl::Event> &waitEvents, const cl::Buffer &kernBuf, int xSteps, int firstYStep,
+                      const cl::Buffer &img, const cl::Buffer &outImg, const cl::Buffer &convMask, const cl::Buffer &outMask,
+                      const std::pair<cl_int, cl_int> &imgSize, int rowOffset, int imgRowOffset, int rowStart, int rowEnd, double invKernMult,
+                      const ClData& clData, const Arguments& args, const std::optional<FusedSub> &fused = std::nullopt);
+void finishConv(const cl::Event &finalEvent, const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, bool maskAfter,
+                const std::vector<cl::Event> &hostEvents, const ClData& clData, const Arguments& args);
+void convBasis(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, const std::vector<double> &centerKernel, double invKernMult,
+               ClData& clData, const Arguments& args);
+int chooseFftSize(const std::pair<cl_int, cl_int> &imgSize, const ClData& clData, const Arguments& args);
+void convFft(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, const Kernel &convolutionKernel,
+             const std::vector<cl_double> &convKernels, int xSteps, int fftSize, double invKernMult,
+             ClData& clData, const Arguments& args);
+void createRowBands(const std::pair<cl_int, cl_int> &imgSize, ClData& clData, const Arguments& args);
+void convRowBands(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, const std::vector<cl_double> &convKernels, int xSteps,
+                  double invKernMult, double convFactor, double finalFactor, ClData& clData, const Arguments& args);
+void subRowBands(const std::pair<cl_int, cl_int> &imgSize, const std::vector<ClRowBand> &bands, OutputImage &diffImg,
+                 OutputImage &noiseImg, MaskImage &maskImg, double convFactor, double finalFactor,
+                 const ClData& clData, const Arguments& args);
+void diffStats(const std::pair<cl_int, cl_int> &imgSize, const std::vector<ClRowBand> &bands, const std::vector<cl::Buffer> &diffBufs,
+               const ClData& clData, const Arguments& args);
+void convSubStrips(const std::pair<cl_int, cl_int> &imgSize, const OutputImage &convImg, const OutputImage &diffImg, Kernel &convolutionKernel,
+                   double invKernMult, double convFactor, double finalFactor, ClData& clData, const Arguments& args);
 
 /* CD && KSC */
 double testFit(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis, const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, ClData& clData, ClStampsData& stampData, const Arguments& args);
-void createMatrix(const cl::Buffer &matrix, const cl::Buffer &weights, const ClData &clData, const ClStampsData &stampData, const std::pair<cl_int, cl_int>& imgSize, const Arguments& args);
-std::pair<std::vector<std::vector<double>>, std::vector<std::vector<double>>>
-createMatrix(const std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int>& imgSize, const Arguments& args);
-void createScProd(const cl::Buffer &res, const cl::Buffer &weights, const cl::Buffer &img, const std::pair<cl_int, cl_int>& imgSize, const ClData &clData, const ClStampsData &stampData, const Arguments& args);
-std::vector<double> createScProd(const std::vector<Stamp>& stamps, const Image& img,
-                                 const std::vector<std::vector<double>>& weight, const Arguments& args);
-void calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::pair<cl_int, cl_int> &axis,
-              const cl::Buffer &model, const cl::Buffer &kernSol, const cl::Buffer &sigma,
-              const ClStampsData &stampData, const ClData &clData, const Arguments& args);
+cl::Event createMatrix(const cl::Buffer &matrix, const cl::Buffer &weights, const ClData &clData, const ClStampsData &stampData, const std::pair<cl_int, cl_int>& imgSize, const Arguments& args,
+                       const std::vector<cl::Event> &waitEvents = {});
+cl::Event createScProd(const cl::Buffer &res, const cl::Buffer &weights, const cl::Buffer &img, const std::pair<cl_int, cl_int>& imgSize, const ClData &clData, const ClStampsData &stampData, const Arguments& args,
+                       const std::vector<cl::Event> &waitEvents = {});
+cl::Event calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::pair<cl_int, cl_int> &axis,
+                   const cl::Buffer &model, const cl::Buffer &kernSol, const cl::Buffer &sigma,
+                   const ClStampsData &stampData, const ClData &clData, const Arguments& args,
+                   const std::vector<cl::Event> &waitEvents = {});
 void fitKernel(Kernel& k, std::vector<Stamp>& stamps, const Image &sImg, const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf,
                ClData &clData, const ClStampsData &stampData, const Arguments& args);
 bool checkFitSolution(const Kernel& k, std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis, const ClData &clData, const ClStampsData &stampData,
@@ -8,27 +8,56 @@ cl::Platform getDefaultPlatform();
 
 cl::Device getDefaultDevice(const cl::Platform &platform);
 
+cl::Platform getMultiDevicePlatform();
+
+std::vector<cl::Device> getAllDevices(const cl::Platform &platform);
+
 void printVerboseClInfo(const cl::Platform &platform, const cl::Device &device);
 
 std::string getKernelFunc(const std::string &fileName, const std::filesystem::path& rootPath);
 
+std::string programCacheKey(const std::vector<cl::Device> &devices, const std::string &options, const std::string &source);
+
+bool loadCachedProgram(const cl::Context &context, const std::vector<cl::Device> &devices, const std::filesystem::path &cacheFile,
+                       const std::string &options, cl::Program &program);
+
+void saveCachedProgram(const cl::Program &program, const std::filesystem::path &cacheFile);
+
 template <typename... Args>
-cl::Program loadBuildPrograms(const cl::Context &context, const cl::Device &defaultDevice,
-                                const std::filesystem::path &rootPath, Args... names) {
+cl::Program loadBuildPrograms(const cl::Context &context, const std::vector<cl::Device> &devices,
+                                const std::filesystem::path &rootPath, const std::string &buildOptions, Args... names) {
+  const std::string options = "-cl-fp32-correctly-rounded-divide-sqrt " + buildOptions;
+
   cl::Program::Sources sources;
+  std::string allSources{};
   for(auto n : {names...}) {
     std::string code = getKernelFunc(n, rootPath / "cl_kern");
+    allSources += code;
 
     sources.push_back({code.c_str(), code.length()});
   }
 
-  cl::Program program(context, sources);
-  if(program.build(defaultDevice, "-cl-fp32-correctly-rounded-divide-sqrt") != CL_SUCCESS) {
-    std::cout << " Error building: "
-              << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(defaultDevice)
-              << "\n";
+  // Reuse the binaries from an earlier run if the devices, drivers, options
+  // and sources are all the same.
+  std::filesystem::path cacheFile =
+      rootPath / "cl_cache" / (programCacheKey(devices, options, allSources) + ".bin");
+
+  cl::Program program{};
+  if(loadCachedProgram(context, devices, cacheFile, options, program)) {
+    return program;
+  }
+
+  program = cl::Program(context, sources);
+  if(program.build(devices, options.c_str()) != CL_SUCCESS) {
+    for(const cl::Device &device : devices) {
+      std::cout << " Error building: "
+                << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)
+                << "\n";
+    }
     std::exit(1);
   }
 
+  saveCachedProgram(program, cacheFile);
+
   return program;
 }
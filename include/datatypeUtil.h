@@ -11,6 +11,32 @@
 
 #include "argsUtil.h"
 
+// Dense row-major matrix in a single allocation. m[row][column] indexes it
+// like a nested vector, but the rows are contiguous, so a whole matrix is
+// copied to or from the device with one transfer.
+template <typename T>
+class Matrix {
+ public:
+  Matrix() = default;
+  Matrix(size_t rows, size_t columns, const T &value = T{})
+      : rowCount{rows}, columnCount{columns}, values(rows * columns, value) {}
+
+  T *operator[](size_t row) { return values.data() + row * columnCount; }
+  const T *operator[](size_t row) const { return values.data() + row * columnCount; }
+
+  size_t rows() const { return rowCount; }
+  size_t columns() const { return columnCount; }
+  size_t size() const { return values.size(); }
+
+  T *data() { return values.data(); }
+  const T *data() const { return values.data(); }
+
+ private:
+  size_t rowCount{};
+  size_t columnCount{};
+  std::vector<T> values{};
+};
+
 struct kernelStats {
   cl_int gauss;
   cl_int x;
@@ -18,7 +44,7 @@ struct kernelStats {
 };
 
 struct Kernel {
-  std::vector<std::vector<double>> kernVec{};
+  Matrix<double> kernVec{};
 
   /*
    * filterX and filterY is basically a convolution kernel, we probably can
@@ -29,8 +55,8 @@ struct Kernel {
    */
 
   std::vector<double> currKernel{};
-  std::vector<std::vector<double>> filterX{};
-  std::vector<std::vector<double>> filterY{};
+  Matrix<double> filterX{};
+  Matrix<double> filterY{};
   std::vector<kernelStats> stats{};
   std::vector<double> solution{};
 
@@ -49,16 +75,21 @@ struct Kernel {
      * a Vec3 in a kernel.
      */
     if(args.verbose) std::cout << "Creating kernel vectors..." << std::endl;
-    int i = 0;
     for(int gauss = 0; gauss < cl_int(args.dg.size()); gauss++) {
       for(int x = 0; x <= args.dg[gauss]; x++) {
         for(int y = 0; y <= args.dg[gauss] - x; y++) {
           stats.push_back({gauss, x, y});
-          resetKernelHelper(i, args);
-          i++;
         }
       }
     }
+
+    filterX = Matrix<double>(stats.size(), args.fKernelWidth);
+    filterY = Matrix<double>(stats.size(), args.fKernelWidth);
+    kernVec = Matrix<double>(stats.size(), args.fKernelWidth * args.fKernelWidth);
+
+    for(int i = 0; i < cl_int(stats.size()); i++) {
+      resetKernelHelper(i, args);
+    }
   }
 
  private:
@@ -68,23 +99,20 @@ struct Kernel {
      * TODO: Make into a clKernel, look at hotpants for c indexing instead.
      */
 
-    std::vector<double> temp(args.fKernelWidth * args.fKernelWidth, 0.0);
+    double *temp = kernVec[n];
     double sumX = 0.0, sumY = 0.0;
     // UNSURE: Don't really know why dx,dy are a thing
     cl_int dx = (stats[n].x / 2) * 2 - stats[n].x;
     cl_int dy = (stats[n].y / 2) * 2 - stats[n].y;
 
-    filterX.emplace_back();
-    filterY.emplace_back();
-
     // Calculate Equation (2.4)
     for(int i = 0; i < args.fKernelWidth; i++) {
       double x = double(i - args.hKernelWidth);
       double qe = std::exp(-x * x * args.bg[stats[n].gauss]);
-      filterX[n].push_back(qe * pow(x, stats[n].x));
-      filterY[n].push_back(qe * pow(x, stats[n].y));
-      sumX += filterX[n].back();
-      sumY += filterY[n].back();
+      filterX[n][i] = qe * pow(x, stats[n].x);
+      filterY[n][i] = qe * pow(x, stats[n].y);
+      sumX += filterX[n][i];
+      sumY += filterY[n][i];
     }
 
     sumX = 1. / sumX;
@@ -114,7 +142,6 @@ struct Kernel {
         }
       }
     }
-    kernVec.push_back(temp);
   }
 };
 
@@ -128,8 +155,8 @@ struct SubStamp {
 
 struct Stamp {
   std::vector<SubStamp> subStamps{};
-  std::vector<std::vector<double>> W{};
-  std::vector<std::vector<double>> Q{};
+  Matrix<double> W{};  // host copies, only filled with -sd
+  Matrix<double> Q{};
   std::vector<double> B{};
 
   Stamp(){};
@@ -137,32 +164,34 @@ struct Stamp {
       : subStamps{subStamps} {}
 };
 
-struct Image {
+// Input images are double, outputs are FLOAT_IMG and converted on the device
+template <typename T>
+struct BasicImage {
   std::string name;
   std::string path;
   std::pair<cl_int, cl_int> axis;
 
-  std::valarray<cl_double> data{};
+  std::valarray<T> data{};
 
  public:
-  Image(const std::string &n, std::pair<cl_int, cl_int> a = {0L, 0L},
-        const std::string p = "res/")
+  BasicImage(const std::string &n, std::pair<cl_int, cl_int> a = {0L, 0L},
+             const std::string p = "res/")
       : name{n},
         path{p},
         axis{a},
         data(this->size()) {}
 
-  Image(const std::string &n, size_t dataCount,
-        const std::pair<cl_int, cl_int> &a, const std::string &p = "res/")
+  BasicImage(const std::string &n, size_t dataCount,
+             const std::pair<cl_int, cl_int> &a, const std::string &p = "res/")
       : name{n},
         path{p},
         axis{a},
         data(dataCount) {}
 
-  const cl_double* operator&() const {
+  const T* operator&() const {
     return &data[0]; 
   }
-  cl_double* operator&() {
+  T* operator&() {
     return &data[0];
   }
 
@@ -180,6 +209,10 @@ struct Image {
   std::string getOutFile() const { return "!" + path + name; }
 };
 
+using Image = BasicImage<cl_double>;
+using OutputImage = BasicImage<cl_float>;
+using MaskImage = BasicImage<cl_ushort>;
+
 enum ImageMasks
 {
   NONE = 0,
@@ -1,9 +1,46 @@
 #pragma once
 
 #include <CCfits/CCfits>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <valarray>
+
 #include "argsUtil.h"
 #include "datatypeUtil.h"
 
+// Where and how the pixels of an uncompressed primary image are stored in its file
+struct RawImage {
+  int bitpix;
+  double bscale;
+  double bzero;
+  long long dataOffset;
+
+  size_t pixelSize() const { return std::abs(bitpix) / 8; }
+};
+
+// False when cfitsio is not built thread-safe, the FITS functions below then
+// serialize every cfitsio call
+bool fitsReentrant();
+
 void readImage(Image& input, const Arguments& args);
 
-void writeImage(const Image& img, const Arguments& args);
+std::optional<RawImage> openRawImage(Image& input, const Arguments& args);
+
+void readRawPixels(const Image& input, const RawImage& raw, void* dst);
+
+// Output file, closed when it goes out of scope
+struct FitsFileCloser {
+  void operator()(fitsfile* fits) const;
+};
+using FitsFile = std::unique_ptr<fitsfile, FitsFileCloser>;
+
+// FLOAT_IMG of the size of img, tile-compressed with args.outCompression
+FitsFile createImageFile(const OutputImage& img, const Arguments& args);
+
+void writeImageRows(fitsfile* fits, const OutputImage& img, const std::valarray<cl_float>& rows, int firstRow);
+
+void writeImage(const OutputImage& img, const Arguments& args);
+
+// USHORT_IMG, e.g. the output mask
+void writeImage(const MaskImage& img, const Arguments& args);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <CL/opencl.hpp>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "argsUtil.h"
+
+using ProfClock = std::chrono::steady_clock;
+
+struct KernelRecord {
+  std::string stage;
+  std::string name;
+  cl::Event event;
+};
+
+struct HostRecord {
+  std::string stage;
+  std::string name;
+  double ms;
+};
+
+struct StageRecord {
+  std::string name;
+  double startMs;
+  double endMs;
+};
+
+struct Profiler {
+  bool enabled = false;
+
+  std::string currentStage{"Ini"};
+  ProfClock::time_point startTime{ProfClock::now()};
+  ProfClock::time_point stageStart{ProfClock::now()};
+
+  std::vector<KernelRecord> kernels{};
+  std::vector<HostRecord> hosts{};
+  std::vector<StageRecord> stages{};
+
+  /*
+   * Events are only stored here, the profiling info is queried when the
+   * report is written since the commands may not have finished yet.
+   */
+  void record(const std::string &name, const cl::Event &event) {
+    if(enabled) kernels.push_back({currentStage, name, event});
+  }
+
+  void recordHost(const std::string &name, ProfClock::time_point start) {
+    if(enabled) hosts.push_back({currentStage, name, msSince(start)});
+  }
+
+  void beginStage(const std::string &name) {
+    currentStage = name;
+    stageStart = ProfClock::now();
+  }
+
+  // Returns the wall time of the stage in ms.
+  double endStage() {
+    ProfClock::time_point now = ProfClock::now();
+    stages.push_back({currentStage, toMs(stageStart - startTime), toMs(now - startTime)});
+    return toMs(now - stageStart);
+  }
+
+  double totalMs() const { return msSince(startTime); }
+
+  static ProfClock::time_point now() { return ProfClock::now(); }
+
+ private:
+  static double toMs(ProfClock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  }
+
+  static double msSince(ProfClock::time_point start) { return toMs(ProfClock::now() - start); }
+};
+
+void writeProfile(const Profiler &profiler, const Arguments &args);
@@ -1,6 +1,8 @@
 #include "argsUtil.h"
 
 #include <algorithm>
+#include <filesystem>
+#include <fstream>
 #include <stdexcept>
 #include <utility>
 #include <sstream>
@@ -49,6 +51,91 @@ void getArguments(const int argc, const char* argv[], Arguments& args) {
     args.verboseTime = true;
   }
 
+  if(cmdOptionExists(argv, argv + argc, "-p")) {
+    args.profile = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-sd")) {
+    args.dumpStamps = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-md")) {
+    args.multiDevice = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-fs")) {
+    args.fuseSub = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-cb")) {
+    args.basisConv = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-cm")) {
+    args.convMethod = getCmdOption(argv, argv + argc, "-cm");
+    if(args.convMethod != "auto" && args.convMethod != "direct" && args.convMethod != "fft") {
+      throw std::invalid_argument("Convolution method must be auto, direct or fft!");
+    }
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-cv")) {
+    args.verifyConv = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-sp")) {
+    args.singlePrecision = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-oc")) {
+    args.outCompression = getCmdOption(argv, argv + argc, "-oc");
+    if(args.outCompression != "rice" && args.outCompression != "gzip") {
+      throw std::invalid_argument("Output compression must be rice or gzip!");
+    }
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-out")) {
+    args.outConv = args.outDiff = args.outNoise = args.outMask = false;
+
+    std::stringstream sstr{getCmdOption(argv, argv + argc, "-out")};
+    std::string product;
+    while(std::getline(sstr, product, ',')) {
+      if(product == "conv") args.outConv = true;
+      else if(product == "diff") args.outDiff = true;
+      else if(product == "noise") args.outNoise = true;
+      else if(product == "mask") args.outMask = true;
+      else if(product != "none") {
+        throw std::invalid_argument("Outputs must be a comma separated list of conv, diff, noise and mask, or none!");
+      }
+    }
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-ds")) {
+    args.diffStats = true;
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-sr")) {
+    std::stringstream sstr{getCmdOption(argv, argv + argc, "-sr")};
+    sstr >> args.stripRows;
+    if(args.stripRows <= 0) {
+      throw std::invalid_argument("Strip rows must be positive!");
+    }
+    if(args.outNoise || args.outMask || args.diffStats) {
+      throw std::invalid_argument("Noise, mask and difference statistics are not available with strips!");
+    }
+  }
+
+  if(cmdOptionExists(argv, argv + argc, "-kw")) {
+    std::stringstream sstr{getCmdOption(argv, argv + argc, "-kw")};
+    sstr >> args.hKernelWidth;
+    if(sstr.fail() || args.hKernelWidth <= 0) {
+      throw std::invalid_argument("Half kernel width must be a positive integer!");
+    }
+    if(args.hKernelWidth > args.hSStampWidth) {
+      throw std::invalid_argument("Half kernel width must not exceed the half substamp width (" + std::to_string(args.hSStampWidth) + ")!");
+    }
+    args.fKernelWidth = 2 * args.hKernelWidth + 1;
+  }
+
   if(cmdOptionExists(argv, argv + argc, "-t")) {
     args.templateName = getCmdOption(argv, argv + argc, "-t");
   } else {
@@ -56,10 +143,63 @@ void getArguments(const int argc, const char* argv[], Arguments& args) {
     return;
   }
 
+  if(cmdOptionExists(argv, argv + argc, "-sl")) {
+    args.scienceList = getCmdOption(argv, argv + argc, "-sl");
+  }
+
   if(cmdOptionExists(argv, argv + argc, "-s")) {
+    if(!args.scienceList.empty()) {
+      throw std::invalid_argument("A science file and a science list cannot both be given!");
+    }
     args.scienceName = getCmdOption(argv, argv + argc, "-s");
-  } else {
+  } else if(args.scienceList.empty()) {
     throw std::invalid_argument("Science file input is required!");
     return;
   }
+}
+
+std::vector<std::string> getScienceNames(const Arguments& args) {
+  /* Returns the paths of all science images to subtract. Batch mode takes
+   * either a directory, where all FITS files are used, or a list file with
+   * one image per line. Relative names are relative to the input path.
+   */
+  namespace fs = std::filesystem;
+
+  if(args.scienceList.empty()) {
+    return {(fs::path(args.inputPath) / args.scienceName).string()};
+  }
+
+  std::vector<std::string> names{};
+  fs::path listPath{args.scienceList};
+
+  if(fs::is_directory(listPath)) {
+    for(const fs::directory_entry& entry : fs::directory_iterator(listPath)) {
+      std::string ext = entry.path().extension().string();
+      if(entry.is_regular_file() && (ext == ".fits" || ext == ".fit" || ext == ".fts")) {
+        names.push_back(entry.path().string());
+      }
+    }
+    std::sort(names.begin(), names.end());
+  } else {
+    std::ifstream listFile{listPath};
+    if(!listFile) {
+      throw std::invalid_argument("Unable to open science list '" + args.scienceList + "'");
+    }
+
+    std::string line;
+    while(std::getline(listFile, line)) {
+      line.erase(0, line.find_first_not_of(" \t\r"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if(line.empty() || line[0] == '#') continue;
+
+      fs::path name{line};
+      names.push_back((name.is_absolute() ? name : fs::path(args.inputPath) / name).string());
+    }
+  }
+
+  if(names.empty()) {
+    throw std::invalid_argument("No science images found in '" + args.scienceList + "'");
+  }
+
+  return names;
 }
\ No newline at end of file
@@ -12,10 +12,18 @@
 
 #include "bach.h"
 
-void init(Image &templateImg, Image &scienceImg, ClData& clData, const Arguments& args) {
-  // Read input images
-  readImage(templateImg, args);
-  readImage(scienceImg, args);
+void initTemplate(PendingImage &pendingTemplate, Image &templateImg, ClData& clData, const Arguments& args) {
+  // Upload the template, kept on the device for all science images
+  waitImageRead(pendingTemplate, templateImg, clData);
+
+  int pixelCount = templateImg.axis.first * templateImg.axis.second;
+
+  clData.tImgBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * pixelCount);
+  uploadImage(pendingTemplate, templateImg, clData.tImgBuf, clData, args);
+}
+
+void initScience(const Image &templateImg, PendingImage &pendingScience, Image &scienceImg, ClData& clData, const Arguments& args) {
+  waitImageRead(pendingScience, scienceImg, clData);
 
   if(templateImg.axis != scienceImg.axis) {
     std::cout << "Template image and science image must be the same size!"
@@ -25,15 +33,17 @@ void init(Image &templateImg, Image &scienceImg, ClData& clData, const Arguments
 
   int pixelCount = templateImg.axis.first * templateImg.axis.second;
 
-  // Upload buffers
-  clData.tImgBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * pixelCount);
-  clData.sImgBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * pixelCount);
-  clData.maskBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * pixelCount);
-  
-  clData.queue.enqueueWriteBuffer(clData.tImgBuf, CL_TRUE, 0, sizeof(cl_double) * pixelCount, &templateImg);
-  clData.queue.enqueueWriteBuffer(clData.sImgBuf, CL_TRUE, 0, sizeof(cl_double) * pixelCount, &scienceImg);
+  // Science and mask buffers are reused by every science image
+  if(clData.sImgBuf() == nullptr) {
+    clData.sImgBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * pixelCount);
+    clData.maskBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * pixelCount);
+  }
+
+  // The image outlives the upload, so the host does not need to wait for it
+  std::vector<cl::Event> writeEvents{uploadImage(pendingScience, scienceImg, clData.sImgBuf, clData, args)};
 
-  maskInput(templateImg.axis, clData, args);
+  // The mask depends on both images, so it is rebuilt for every science image
+  maskInput(templateImg.axis, clData, args, writeEvents);
 }
 
 void sss(const std::pair<cl_int, cl_int> &axis, std::vector<Stamp> &templateStamps, std::vector<Stamp> &sciStamps, Arguments& args, ClData& clData) {
@@ -52,6 +62,11 @@ void sss(const std::pair<cl_int, cl_int> &axis, std::vector<Stamp> &templateStam
     args.stampsx = int(axis.first / args.fStampWidth);
     args.stampsy = int(axis.second / args.fStampWidth);
 
+    if(args.stampsx < 1 || args.stampsy < 1) {
+      std::cout << "The image is too small for one stamp with this kernel width" << std::endl;
+      std::exit(1);
+    }
+
     if(args.verbose)
         std::cout << "Too many stamps requested, using " << args.stampsx << "x"
                   << args.stampsy << " stamps instead." << std::endl;
@@ -181,23 +196,20 @@ void cmv(const std::pair<cl_int, cl_int> &axis, std::vector<Stamp> &templateStam
   cl::Event filterEvent = filterFunc(filterEargs, kernelGauss, clData.kernel.xy,
                                      kernelBg, clData.kernel.filterX, clData.kernel.filterY,
                                      args.fKernelWidth);
-  filterEvent.wait();
+  clData.profiler.record("createKernelFilter", filterEvent);
 
   // Create kernel vector
   clData.kernel.vec = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * clData.gaussCount * args.fKernelWidth * args.fKernelWidth);
 
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int>
       vecFunc(clData.program, "createKernelVector");
-  cl::EnqueueArgs vecEargs(clData.queue, cl::NDRange(args.fKernelWidth, args.fKernelWidth, clData.gaussCount));
+  cl::EnqueueArgs vecEargs(clData.queue, filterEvent, cl::NDRange(args.fKernelWidth, args.fKernelWidth, clData.gaussCount));
   cl::Event vecEvent = vecFunc(vecEargs, clData.kernel.xy,
                                clData.kernel.filterX, clData.kernel.filterY,
                                clData.kernel.vec, args.fKernelWidth);
-
-  vecEvent.wait();
-  
-  clData.cmv.yConvTmp = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_float) * std::max(templateStamps.size(), sciStamps.size()) * clData.gaussCount * (2 * (args.hSStampWidth + args.hKernelWidth) + 1) * (2 * args.hSStampWidth + 1));
+  clData.profiler.record("createKernelVector", vecEvent);
   
-  initFillStamps(templateStamps, axis, clData.tImgBuf, clData.sImgBuf, convolutionKernel, clData, clData.tmpl, args);
+  initFillStamps(templateStamps, axis, clData.tImgBuf, clData.sImgBuf, convolutionKernel, clData, clData.tmpl, args, {vecEvent});
 
   initFillStamps(sciStamps, axis, clData.sImgBuf, clData.tImgBuf, convolutionKernel, clData, clData.sci, args);
 }
@@ -245,7 +257,7 @@ void ksc(std::vector<Stamp> &templateStamps, Kernel &convolutionKernel, const Im
   fitKernel(convolutionKernel, templateStamps, sImg, tImgBuf, sImgBuf, clData, stampData, args);
 }
 
-double conv(const std::pair<cl_int, cl_int> &imgSize, Image &convImg, Kernel &convolutionKernel, bool convTemplate,
+double conv(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, Kernel &convolutionKernel, bool convTemplate,
             ClData &clData, const Arguments& args) {
   std::cout << "\nConvolving..." << std::endl;
   
@@ -253,6 +265,29 @@ double conv(const std::pair<cl_int, cl_int> &imgSize, Image &convImg, Kernel &co
   bool scaleConv = args.normalizeTemplate && convTemplate ||
                    !args.normalizeTemplate && !convTemplate;
 
+  // Set again if the direct convolution also subtracts
+  clData.diffImg = cl::Buffer();
+
+  // Used to normalize the result since the kernel sum is not always 1.
+  // Leaves the kernel at the image center in currKernel.
+  auto kernelsStart = Profiler::now();
+  double kernSum =
+      makeKernel(convolutionKernel, imgSize,
+                 imgSize.first / 2, imgSize.second / 2, args);
+  double invKernSum = 1.0 / kernSum;
+
+  if(args.verbose) {
+    std::cout << "Sum of kernel at (" << imgSize.first / 2 << ","
+              << imgSize.second / 2 << "): " << kernSum << std::endl;
+  }
+
+  if(args.basisConv) {
+    clData.profiler.recordHost("makeKernel", kernelsStart);
+    convBasis(imgSize, convImg, convolutionKernel.currKernel, scaleConv ? invKernSum : 1.0, clData, args);
+
+    return kernSum;
+  }
+
   // Convolution kernels generated beforehand since we only need on per
   // kernelsize.
   std::vector<cl_double> convKernels{};
@@ -270,78 +305,117 @@ double conv(const std::pair<cl_int, cl_int> &imgSize, Image &convImg, Kernel &co
                          convolutionKernel.currKernel.end());
     }
   }
+  clData.profiler.recordHost("makeKernel", kernelsStart);
 
-  // Used to normalize the result since the kernel sum is not always 1.
-  double kernSum =
-      makeKernel(convolutionKernel, imgSize,
-                 imgSize.first / 2, imgSize.second / 2, args);
-  double invKernSum = 1.0 / kernSum;
+  if(int fftSize = chooseFftSize(imgSize, clData, args); fftSize > 0) {
+    convFft(imgSize, convImg, convolutionKernel, convKernels, xSteps, fftSize, scaleConv ? invKernSum : 1.0, clData, args);
 
-  if(args.verbose) {
-    std::cout << "Sum of kernel at (" << imgSize.first / 2 << ","
-              << imgSize.second / 2 << "): " << kernSum << std::endl;
+    return kernSum;
+  }
+
+  if(clData.deviceQueues.size() > 1) {
+    if(clData.bands.empty() || clData.bands.back().rowEnd != h) {
+      createRowBands(imgSize, clData, args);
+    }
+    convRowBands(imgSize, convImg, convKernels, xSteps, scaleConv ? invKernSum : 1.0,
+                 scaleConv ? kernSum : 1.0, scaleConv ? -invKernSum : 1.0, clData, args);
+
+    return kernSum;
+  }
+
+  // The fused subtraction only stores the convolved image when it is used
+  // afterwards, otherwise convImg is a placeholder.
+  std::optional<FusedSub> fused{};
+  if(args.fuseSub) {
+    clData.diffImg = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * w * h);
+    fused = FusedSub{clData.sImgBuf, clData.diffImg, scaleConv ? kernSum : 1.0, scaleConv ? -invKernSum : 1.0,
+                     args.outConv || args.outNoise};
   }
+  const bool writeConv = !fused || fused->writeConv;
 
   // Declare all the buffers which will be need in opencl operations.  
   cl::Buffer convMaskBuf(clData.context, CL_MEM_READ_ONLY, sizeof(cl_ushort) * w * h);
-  cl::Buffer kernBuf(clData.context, CL_MEM_READ_ONLY, sizeof(cl_double) * convKernels.size());
-  clData.convImg = cl::Buffer(clData.context, CL_MEM_WRITE_ONLY, sizeof(cl_double) * w * h);
+  cl::Buffer kernBuf(clData.context, CL_MEM_READ_ONLY, realSize(args) * convKernels.size());
+  clData.convImg = cl::Buffer(clData.context, CL_MEM_WRITE_ONLY, realSize(args) * (writeConv ? w * h : 1));
 
   // Write necessary data for convolution
-  clData.queue.enqueueWriteBuffer(kernBuf, CL_TRUE, 0, sizeof(cl_double) * convKernels.size(), convKernels.data());
+  std::vector<cl::Event> convWaitEvents(2);
+  convWaitEvents[0] = writeRealBuffer(clData.queue, kernBuf, convKernels.size(), convKernels.data(), args);
   
   // Create convolution mask
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_double, cl_double> createMaskFunc(clData.program, "createConvMask");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double> createMaskFunc(clData.program, "createConvMask");
   cl::EnqueueArgs createMaskEargs(clData.queue, cl::NDRange(w, h));
-  cl::Event createMaskEvent = createMaskFunc(createMaskEargs, clData.tImgBuf, convMaskBuf, w, args.threshHigh, args.threshLow);
-
-  createMaskEvent.wait();
+  convWaitEvents[1] = createMaskFunc(createMaskEargs, clData.tImgBuf, convMaskBuf, w, 0, args.threshHigh, args.threshLow);
+  clData.profiler.record("createConvMask", convWaitEvents[1]);
 
   // Convolve
-  cl::KernelFunctor<cl::Buffer, cl_int, cl_int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
-                    cl_int, cl_int, cl_int, cl_int, cl_double> convFunc(clData.program, "conv");
-  cl::EnqueueArgs eargs(clData.queue, cl::NDRange(w * h));
-  cl::Event convEvent = convFunc(eargs, kernBuf, args.fKernelWidth, xSteps, clData.tImgBuf, clData.convImg, convMaskBuf, clData.maskBuf, clData.kernel.solution,
-                                 w, h, args.backgroundOrder, (args.nPSF - 1) * triNum(args.kernelOrder + 1) + 1, scaleConv ? invKernSum : 1.0);
-  convEvent.wait();
-
-  // Transfer convoluted image back to CPU
-  clData.queue.enqueueReadBuffer(clData.convImg, CL_TRUE, 0, sizeof(cl_double) * w * h, &convImg);
-
-  // Mask after convolve
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_double, cl_double> maskAfterFunc(clData.program, "maskAfterConv");
-  cl::EnqueueArgs maskAfterEargs(clData.queue, cl::NDRange(w, h));
-  cl::Event maskAfterEvent = maskAfterFunc(maskAfterEargs, clData.sImgBuf, clData.maskBuf, w, args.threshHigh, args.threshLow);
+  cl::Event convEvent = enqueueConv(clData.queue, convWaitEvents, kernBuf, xSteps, 0, clData.tImgBuf, clData.convImg, convMaskBuf, clData.maskBuf,
+                                    imgSize, 0, 0, 0, h, scaleConv ? invKernSum : 1.0, clData, args, fused);
 
-  maskAfterEvent.wait();
+  // The fused kernel masks after convolve itself, convKernels is owned by this function
+  finishConv(convEvent, imgSize, convImg, !fused, {convWaitEvents[0]}, clData, args);
 
   return kernSum;
 }
 
-void sub(const std::pair<cl_int, cl_int> &imgSize, Image &diffImg, bool convTemplate, double kernSum,
-         const ClData &clData, const Arguments& args) {
+void sub(const std::pair<cl_int, cl_int> &imgSize, OutputImage &diffImg, OutputImage &noiseImg, MaskImage &maskImg,
+         bool convTemplate, double kernSum, const ClData &clData, const Arguments& args) {
   std::cout << "\nSubtracting images..." << std::endl;
 
   const auto [w, h] = imgSize;
   bool scaleConv = args.normalizeTemplate && convTemplate ||
                    !args.normalizeTemplate && !convTemplate;
 
-  cl::Buffer diffImgBuf(clData.context, CL_MEM_WRITE_ONLY, sizeof(cl_double) * w * h);
-  
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int,
-                    cl_double, cl_double> subFunc(clData.program, "sub");
-  cl::EnqueueArgs eargs(clData.queue, cl::NDRange(w * h));
-  cl::Event subEvent = subFunc(eargs, clData.sImgBuf, clData.convImg, clData.maskBuf, diffImgBuf, args.fKernelWidth, w, h,
-                               scaleConv ? kernSum : 1.0, scaleConv ? -(1.0 / kernSum) : 1.0);
-  subEvent.wait();
-
-  // Read data from subtraction
-  clData.queue.enqueueReadBuffer(diffImgBuf, CL_TRUE, 0, sizeof(cl_double) * w * h, &diffImg);
+  // A single device works on the whole frame as one band
+  std::vector<ClRowBand> frame{};
+  if(clData.bands.empty()) {
+    ClRowBand band{};
+    band.queue = clData.queue;
+    band.rowStart = 0;
+    band.rowEnd = h;
+    band.haloStart = 0;
+    band.haloEnd = h;
+    band.sImg = clData.sImgBuf;
+    band.mask = clData.maskBuf;
+    band.convImg = clData.convImg;
+    band.diffImg = clData.diffImg;
+    frame.push_back(band);
+  }
+
+  subRowBands(imgSize, clData.bands.empty() ? frame : clData.bands, diffImg, noiseImg, maskImg,
+              scaleConv ? kernSum : 1.0, scaleConv ? -(1.0 / kernSum) : 1.0, clData, args);
+}
+
+void convSub(const std::pair<cl_int, cl_int> &imgSize, const OutputImage &convImg, const OutputImage &diffImg, Kernel &convolutionKernel,
+             bool convTemplate, ClData &clData, const Arguments& args) {
+  std::cout << "\nConvolving and subtracting in strips..." << std::endl;
+
+  bool scaleConv = args.normalizeTemplate && convTemplate ||
+                   !args.normalizeTemplate && !convTemplate;
+
+  // Used to normalize the result since the kernel sum is not always 1.
+  auto kernelsStart = Profiler::now();
+  double kernSum =
+      makeKernel(convolutionKernel, imgSize,
+                 imgSize.first / 2, imgSize.second / 2, args);
+  clData.profiler.recordHost("makeKernel", kernelsStart);
+
+  if(args.verbose) {
+    std::cout << "Sum of kernel at (" << imgSize.first / 2 << ","
+              << imgSize.second / 2 << "): " << kernSum << std::endl;
+  }
+
+  convSubStrips(imgSize, convImg, diffImg, convolutionKernel, scaleConv ? 1.0 / kernSum : 1.0,
+                scaleConv ? kernSum : 1.0, scaleConv ? -(1.0 / kernSum) : 1.0, clData, args);
 }
 
-void fin(const Image &convImg, const Image &diffImg, const Arguments& args) {
+void fin(std::future<void> &convWrite, const OutputImage &diffImg, const OutputImage &noiseImg, const MaskImage &maskImg,
+         const Arguments& args) {
   std::cout << "\nWriting output..." << std::endl;
 
-  writeImage(convImg, args);  
-  writeImage(diffImg, args);
+  // One output file is written at a time
+  if(convWrite.valid()) convWrite.get();
+  if(args.outDiff) writeImage(diffImg, args);
+  if(args.outNoise) writeImage(noiseImg, args);
+  if(args.outMask) writeImage(maskImg, args);
 }
@@ -1,103 +1,156 @@
 #include "bachUtil.h"
 #include "mathUtil.h"
+#include <bit>
 #include <numeric>
 #include <algorithm>
 
-void maskInput(const std::pair<cl_int, cl_int> &axis, const ClData& clData, const Arguments& args) {
+cl::Event maskInput(const std::pair<cl_int, cl_int> &axis, const ClData& clData, const Arguments& args, const std::vector<cl::Event> &waitEvents) {
   // Create mask from input data
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_double, cl_double> maskFunc(clData.program, "maskInput");
-  cl::EnqueueArgs maskEargs(clData.queue, cl::NDRange(axis.first * axis.second));
+  cl::EnqueueArgs maskEargs(clData.queue, waitEvents, cl::NDRange(axis.first * axis.second));
   cl::Event maskEvent = maskFunc(maskEargs, clData.tImgBuf, clData.sImgBuf, clData.maskBuf,
                                  axis.first, axis.second, args.hSStampWidth + args.hKernelWidth,
                                  args.threshHigh, args.threshLow);
-  maskEvent.wait();
+  clData.profiler.record("maskInput", maskEvent);
 
   // Spread mask
   int spreadWidth = static_cast<int>(args.hKernelWidth * args.inSpreadMaskFactor);
   cl::KernelFunctor<cl::Buffer, cl_int, cl_int, cl_int> spreadFunc(clData.program, "spreadMask");
-  cl::EnqueueArgs spreadEargs(clData.queue, cl::NDRange(axis.first, axis.second));
+  cl::EnqueueArgs spreadEargs(clData.queue, maskEvent, cl::NDRange(axis.first, axis.second));
   cl::Event spreadEvent = spreadFunc(spreadEargs, clData.maskBuf,
                                      axis.first, axis.second,
                                      spreadWidth);
-  spreadEvent.wait();
+  clData.profiler.record("spreadMask", spreadEvent);
+
+  return spreadEvent;
 }
 
-void sigmaClip(const cl::Buffer &data, int dataOffset, int dataCount, double *mean, double *stdDev, int maxIter, const ClData &clData, const Arguments& args) {
+cl::Event sigmaClip(const cl::Buffer &data, int dataOffset, int dataCount, const cl::Buffer &means, const cl::Buffer &stdDevs, int resultIndex,
+                    int maxIter, const ClData &clData, const Arguments& args, const std::vector<cl::Event> &waitEvents) {
+  /* Enqueues every iteration at once, the kernels check on the device if the
+   * clip has converged. Nothing is read back, the mean and standard
+   * deviation are left at resultIndex of means and stdDevs.
+   */
+  constexpr int localSize = 32;
+  cl::Event event{};
+
   if(dataCount == 0) {
     std::cout << "Cannot send in empty vector to Sigma Clip" << std::endl;
-    *mean = 0.0;
-    *stdDev = 1e10;
-    return;
+    clData.queue.enqueueFillBuffer(means, 0.0, sizeof(cl_double) * resultIndex, sizeof(cl_double), &waitEvents);
+    clData.queue.enqueueFillBuffer(stdDevs, 1e10, sizeof(cl_double) * resultIndex, sizeof(cl_double), nullptr, &event);
+    return event;
   }
 
-  constexpr int localSize = 32;
   int reduceCount = (dataCount + localSize - 1) / localSize;
 
-  std::vector<cl_double> sumVec(reduceCount);
-  std::vector<cl_double> sum2Vec(reduceCount);
-
   cl::Buffer intMask(clData.context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * dataCount);
-  cl::Buffer clipCountBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int));
+  cl::Buffer state(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * 3);
   cl::Buffer sumBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * reduceCount);
   cl::Buffer sum2Buf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * reduceCount);
 
-  cl::KernelFunctor<cl::Buffer> initMaskFunc(clData.program, "sigmaClipInitMask");
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int> calcFunc(clData.program, "sigmaClipCalc");
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_double, cl_double, cl_double> maskFunc(clData.program, "sigmaClipMask");
-  
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> initMaskFunc(clData.program, "sigmaClipInitMask");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl::Buffer> calcFunc(clData.program, "sigmaClipCalc");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl::Buffer, cl::Buffer, cl_int, cl::Buffer> statsFunc(clData.program, "sigmaClipStats");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_double> maskFunc(clData.program, "sigmaClipMask");
+  cl::KernelFunctor<cl::Buffer> updateFunc(clData.program, "sigmaClipUpdate");
+
+  // The queue is in-order, so only the first command needs the wait-list
+  cl::EnqueueArgs initMaskEargs(clData.queue, waitEvents, cl::NDRange(dataOffset), cl::NDRange(dataCount), cl::NullRange);
   cl::EnqueueArgs calcEargs(clData.queue, cl::NDRange(dataOffset), cl::NDRange(reduceCount * localSize), cl::NDRange(localSize));
+  cl::EnqueueArgs statsEargs(clData.queue, cl::NDRange(localSize), cl::NDRange(localSize));
   cl::EnqueueArgs maskEargs(clData.queue, cl::NDRange(dataOffset), cl::NDRange(dataCount), cl::NullRange);
+  cl::EnqueueArgs updateEargs(clData.queue, cl::NDRange(1));
 
   // Zero mask
-  cl::Event initMaskEvent = initMaskFunc(maskEargs, intMask);
-  initMaskEvent.wait();
-
-  size_t currNPoints = 0;
-  size_t prevNPoints = dataCount;
-
-  // Do three times or a stable solution has been found.
-  for (int i = 0; (i < maxIter) && (currNPoints != prevNPoints); i++) {
-    if (prevNPoints <= 1) {
-      std::cout << "prevNPoints is: " << prevNPoints << "Needs to be greater than 1" << std::endl;
-      *mean = 0.0;
-      *stdDev = 1e10;
-      return;
-    }
+  event = initMaskFunc(initMaskEargs, intMask, state, dataCount);
+  clData.profiler.record("sigmaClipInitMask", event);
 
-    currNPoints = prevNPoints;
-        
-    // Calculate mean and standard deviation    
-    cl::Event calcEvent = calcFunc(calcEargs, sumBuf, sum2Buf, data, intMask, dataCount);
-    calcEvent.wait();
-    
-    // Can be optimized to use a tree structure instead of reducing on CPU
-    clData.queue.enqueueReadBuffer(sumBuf, CL_TRUE, 0, sizeof(cl_double) * sumVec.size(), sumVec.data());    
-    clData.queue.enqueueReadBuffer(sum2Buf, CL_TRUE, 0, sizeof(cl_double) * sum2Vec.size(), sum2Vec.data());
+  for(int i = 0; i < maxIter; i++) {
+    // Calculate mean and standard deviation
+    event = calcFunc(calcEargs, sumBuf, sum2Buf, data, intMask, dataCount, state);
+    clData.profiler.record("sigmaClipCalc", event);
 
-    double sum = std::accumulate(sumVec.begin(), sumVec.end(), 0.0);
-    double sum2 = std::accumulate(sum2Vec.begin(), sum2Vec.end(), 0.0);
+    event = statsFunc(statsEargs, sumBuf, sum2Buf, reduceCount, means, stdDevs, resultIndex, state);
+    clData.profiler.record("sigmaClipStats", event);
 
-    double tempMean = sum / prevNPoints;
-    double tempStdDev = std::sqrt((sum2 - prevNPoints * tempMean * tempMean) / (prevNPoints - 1));
-    
-    double invStdDev = 1.0 / tempStdDev;
+    // Mask bad values
+    event = maskFunc(maskEargs, intMask, state, data, means, stdDevs, resultIndex, args.sigClipAlpha);
+    clData.profiler.record("sigmaClipMask", event);
 
-    cl_int clipCount = 0;
-    clData.queue.enqueueWriteBuffer(clipCountBuf, CL_TRUE, 0, sizeof(cl_int), &clipCount);
+    event = updateFunc(updateEargs, state);
+    clData.profiler.record("sigmaClipUpdate", event);
+  }
 
-    // Mask bad values
-    cl::Event maskEvent = maskFunc(maskEargs, intMask, clipCountBuf, data, invStdDev, tempMean, args.sigClipAlpha);
-    maskEvent.wait();
+  return event;
+}
+
+void sigmaClip(const cl::Buffer &data, int dataOffset, int dataCount, double *mean, double *stdDev, int maxIter, const ClData &clData, const Arguments& args,
+               const std::vector<cl::Event> &waitEvents) {
+  cl::Buffer meanBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double));
+  cl::Buffer stdDevBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double));
 
-    clData.queue.enqueueReadBuffer(clipCountBuf, CL_TRUE, 0, sizeof(cl_int), &clipCount);
+  cl::Event clipEvent = sigmaClip(data, dataOffset, dataCount, meanBuf, stdDevBuf, 0, maxIter, clData, args, waitEvents);
 
-    prevNPoints = currNPoints - clipCount;
-    *mean = tempMean;
-    *stdDev = tempStdDev;
+  // One read once the clip has converged
+  std::vector<cl::Event> readWaitEvents{clipEvent};
+  clData.queue.enqueueReadBuffer(meanBuf, CL_FALSE, 0, sizeof(cl_double), mean, &readWaitEvents);
+  clData.queue.enqueueReadBuffer(stdDevBuf, CL_TRUE, 0, sizeof(cl_double), stdDev);
+}
+
+cl::Event sortSegments(const cl::Buffer &data, int segmentLength, int segmentCount, const ClData &clData,
+                       const std::vector<cl::Event> &waitEvents) {
+  // segmentLength is a power of two, a segment is sorted in local memory
+  if(sizeof(cl_double) * segmentLength > clData.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+    std::cout << "Cannot sort segments of " << segmentLength << " values in local memory" << std::endl;
+    std::exit(1);
   }
+
+  cl::KernelFunctor<cl::Buffer, cl::LocalSpaceArg, cl_int> sortFunc(clData.program, "bitonicSortSegments");
+  size_t maxLocalSize = sortFunc.getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clData.device);
+  size_t localSize = std::max<size_t>(std::min<size_t>(segmentLength / 2, maxLocalSize), 1);
+
+  cl::EnqueueArgs eargs(clData.queue, waitEvents, cl::NDRange(localSize * segmentCount), cl::NDRange(localSize));
+  cl::Event event = sortFunc(eargs, data, cl::Local(sizeof(cl_double) * segmentLength), segmentLength);
+  clData.profiler.record("bitonicSortSegments", event);
+
+  return event;
+}
+
+static size_t scanLocalSize(const cl::Kernel &kernel, const ClData &clData) {
+  // The work-group scan needs a power of two
+  static constexpr size_t maxScanSize = 256;
+  return std::bit_floor(std::min(maxScanSize, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clData.device)));
+}
+
+cl::Event exclusiveScan(const cl::Buffer &in, const cl::Buffer &out, int n, const cl::Buffer &total, const ClData &clData,
+                        const std::vector<cl::Event> &waitEvents) {
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl::Buffer, cl::LocalSpaceArg> scanFunc(clData.program, "exclusiveScan");
+  size_t localSize = scanLocalSize(scanFunc.getKernel(), clData);
+
+  cl::EnqueueArgs eargs(clData.queue, waitEvents, cl::NDRange(localSize), cl::NDRange(localSize));
+  cl::Event event = scanFunc(eargs, in, out, n, total, cl::Local(sizeof(cl_int) * localSize));
+  clData.profiler.record("exclusiveScan", event);
+
+  return event;
+}
+
+cl::Event compactIndices(const cl::Buffer &flags, int n, const cl::Buffer &indices, const cl::Buffer &count, const ClData &clData,
+                         const std::vector<cl::Event> &waitEvents) {
+  // Stable, the indices keep their order. The flags are 0 or 1, so their
+  // scan is the position of each index and their total the count.
+  // The positions are released by OpenCL once the scatter is done.
+  cl::Buffer positions(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * std::max(n, 1));
+  cl::Event scanEvent = exclusiveScan(flags, positions, n, count, clData, waitEvents);
+
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int> scatterFunc(clData.program, "scatterIndices");
+  cl::EnqueueArgs eargs(clData.queue, scanEvent, cl::NDRange(std::max(n, 1)));
+  cl::Event event = scatterFunc(eargs, flags, positions, indices, n);
+  clData.profiler.record("scatterIndices", event);
+
+  return event;
 }
 
-void calcStats(const std::pair<cl_int, cl_int> &axis, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData) {
+cl::Event calcStats(const std::pair<cl_int, cl_int> &axis, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData) {
   /* Heavily taken from HOTPANTS which itself copied it from Gary Bernstein
    * Calculates important values of stamps for futher calculations.
    */
@@ -129,223 +182,102 @@ void calcStats(const std::pair<cl_int, cl_int> &axis, const Arguments& args, con
   cl::Buffer goodPixelCounts{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * nStamps};
 
   cl::Buffer bins{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * 256 * nStamps};
-  cl::Buffer means{clData.context, CL_MEM_READ_ONLY, sizeof(cl_double) * nStamps};
-  cl::Buffer invStdDevs{clData.context, CL_MEM_READ_ONLY, sizeof(cl_double) * nStamps};
+  cl::Buffer means{clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * nStamps};
+  cl::Buffer stdDevs{clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * nStamps};
   cl::Buffer binSizes{clData.context, CL_MEM_READ_ONLY, sizeof(cl_double) * nStamps};
   cl::Buffer lowerBinVals{clData.context, CL_MEM_READ_ONLY, sizeof(cl_double) * nStamps};
 
-  cl::EnqueueArgs eargsSample{clData.queue, cl::NDRange{nStamps}};
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int>
   sampleStampFunc(clData.program, "sampleStamp");
   
-  cl::EnqueueArgs eargsPadSamples{clData.queue, cl::NDRange{paddedNSamples, nStamps}};
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int>
   padFunc(clData.program, "pad");
 
-  cl::EnqueueArgs eargsSortSamples{clData.queue, cl::NDRange(paddedNSamples * nStamps)};
-  cl::KernelFunctor<cl::Buffer, cl_int, cl_int, cl_int>
-  sortSamplesFunc(clData.program, "sortSamples");
-
   cl::EnqueueArgs eargsResetGoodPixelCounts{clData.queue, cl::NDRange{nStamps}};
   cl::KernelFunctor<cl::Buffer>
   resetGoodPixelCountsFunc(clData.program, "resetGoodPixelCounts");
 
-  cl::EnqueueArgs eargsMask{clData.queue, cl::NDRange(nPix, nStamps)};
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int>
   maskFunc(clData.program, "maskStamp");
 
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_double>
+  clipFunc(clData.program, "sigmaClipSegments");
+
   static constexpr int histogramLocalSize = 4;
-  cl::EnqueueArgs eargsHistogram(clData.queue, cl::NDRange(roundUpToMultiple(nStamps, histogramLocalSize)), cl::NDRange(histogramLocalSize));
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int,cl_double, cl_double>
   histogramFunc(clData.program, "createHistogram");
   
+  cl::EnqueueArgs eargsSample{clData.queue, cl::NDRange{nStamps}};
   cl::Event sampleEvent =
     sampleStampFunc(eargsSample, imgBuf, clData.maskBuf,
                     stampsData.stampCoords, stampsData.stampSizes,
                     samples, sampleCounts, imgW, nSamples);
-  sampleEvent.wait();
+  clData.profiler.record("sampleStamp", sampleEvent);
 
   cl::Event resetEvent = 
     resetGoodPixelCountsFunc(eargsResetGoodPixelCounts, goodPixelCounts);
-  resetEvent.wait();
+  clData.profiler.record("resetGoodPixelCounts", resetEvent);
 
+  cl::EnqueueArgs eargsPadSamples{clData.queue, sampleEvent, cl::NDRange{paddedNSamples, nStamps}};
   cl::Event padEvent =
     padFunc(eargsPadSamples, samples, paddedSamples, 
             nSamples, paddedNSamples);
-  padEvent.wait();
+  clData.profiler.record("pad", padEvent);
 
-  cl::Event sortEvent;
-  for (cl_int k=2;k<=paddedNSamples;k=2*k) // Outer loop, double size for each step
-  {
-    for (cl_int j=k>>1;j>0;j=j>>1)  // Inner loop, half size for each step
-    {
-      sortEvent = sortSamplesFunc(eargsSortSamples, paddedSamples, paddedNSamples, j, k);
-      sortEvent.wait();
-    }
-  }
+  cl::Event sortEvent = sortSegments(paddedSamples, paddedNSamples, nStamps, clData, {padEvent});
 
+  cl::EnqueueArgs eargsMask{clData.queue, resetEvent, cl::NDRange(nPix, nStamps)};
   cl::Event maskEvent =
     maskFunc(eargsMask, imgBuf, clData.maskBuf,
              stampsData.stampCoords,
              goodPixels, goodPixelCounts,
              args.fStampWidth, imgW, imgH);
-  maskEvent.wait();
-  
-  std::vector<cl_int>    cpuGoodPixelCounts(nStamps);  
-  std::vector<cl_double> cpuMeans(nStamps);
-  std::vector<cl_double> cpuInvStdDevs(nStamps);
-
-  clData.queue.enqueueReadBuffer(goodPixelCounts, CL_TRUE, 0, sizeof(cl_int) * cpuGoodPixelCounts.size(), &cpuGoodPixelCounts[0]);
+  clData.profiler.record("maskStamp", maskEvent);
   
-  for (size_t stampIdx{0}; stampIdx < nStamps; stampIdx++)
-  {
-    int goodPixelCount{cpuGoodPixelCounts[stampIdx]};
-
-    // sigma clip of maskedStamp to get mean and sd.  
-    double mean, stdDev, invStdDev;
-    sigmaClip(goodPixels, stampIdx*nPix, goodPixelCount, &mean, &stdDev, 3, clData, args);
-    invStdDev = 1.0 / stdDev;
-    
-    cpuMeans[stampIdx] = mean;
-    cpuInvStdDevs[stampIdx] = invStdDev;
-  }
-  
-  clData.queue.enqueueWriteBuffer(means, CL_TRUE, 0, sizeof(cl_double) * nStamps, &cpuMeans[0]);
-  clData.queue.enqueueWriteBuffer(invStdDevs, CL_TRUE, 0, sizeof(cl_double) * nStamps, &cpuInvStdDevs[0]);
-
+  // Sigma clip of each masked stamp to get mean and sd, one work-group per stamp
+  static constexpr int clipLocalSize = 32;
+  cl::Buffer clipMask{clData.context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * nPix * nStamps};
+  cl::EnqueueArgs eargsClip{clData.queue, maskEvent, cl::NDRange(nStamps * clipLocalSize), cl::NDRange(clipLocalSize)};
+  cl::Event clipEvent =
+    clipFunc(eargsClip, goodPixels, goodPixelCounts, nPix, clipMask, means, stdDevs, 3, args.sigClipAlpha);
+  clData.profiler.record("sigmaClipSegments", clipEvent);
+
+  std::vector<cl::Event> histogramWaitEvents{sortEvent, clipEvent};
+  cl::EnqueueArgs eargsHistogram(clData.queue, histogramWaitEvents, cl::NDRange(roundUpToMultiple(nStamps, histogramLocalSize)), cl::NDRange(histogramLocalSize));
   cl::Event histogramEvent =
     histogramFunc(eargsHistogram, imgBuf, clData.maskBuf,
                   stampsData.stampCoords, stampsData.stampSizes,
-                  means, invStdDevs, paddedSamples, sampleCounts,
+                  means, stdDevs, paddedSamples, sampleCounts,
                   bins, stampsData.stats.fwhms, stampsData.stats.skyEsts,
                   axis.first, nStamps, nSamples, paddedNSamples,
                   args.iqRange, args.sigClipAlpha);
+  clData.profiler.record("createHistogram", histogramEvent);
 
-  histogramEvent.wait();
+  return histogramEvent;
 }
 
-void ludcmp(const cl::Buffer &matrix, int matrixSize, int stampCount, const cl::Buffer &index, const cl::Buffer &vv, const ClData &clData) {
-  // Find big values
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> bigFunc(clData.program, "ludcmpBig");
-  cl::EnqueueArgs bigEargs(clData.queue, cl::NDRange(matrixSize, stampCount));
-  cl::Event bigEvent = bigFunc(bigEargs, matrix, vv, matrixSize);
+cl::Event solveSymmetric(const cl::Buffer &matrix, const cl::Buffer &result, int matrixSize, int systemCount, const cl::Buffer &scratch,
+                         const ClData &clData, const std::vector<cl::Event> &waitEvents) {
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl::LocalSpaceArg, cl::LocalSpaceArg> func(clData.program, "solveSymmetric");
 
-  bigEvent.wait();
+  // The pivot search needs a power of two, small systems get a small group
+  static constexpr size_t maxSolveSize = 256;
+  size_t maxLocalSize = func.getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clData.device);
+  size_t localSize = std::bit_floor(std::min({maxSolveSize, maxLocalSize, std::bit_ceil(static_cast<size_t>(matrixSize))}));
 
-  // Rest of LU-decomposition
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int> restFunc(clData.program, "ludcmpRest");
-  cl::EnqueueArgs restEargs(clData.queue, cl::NDRange(stampCount));
-  cl::Event restEvent = restFunc(restEargs, vv, matrix, index, matrixSize);
+  cl::EnqueueArgs eargs(clData.queue, waitEvents, cl::NDRange(localSize * systemCount), cl::NDRange(localSize));
+  cl::Event event = func(eargs, matrix, result, scratch, matrixSize,
+                         cl::Local(sizeof(cl_double) * localSize), cl::Local(sizeof(cl_int) * localSize));
+  clData.profiler.record("solveSymmetric", event);
 
-  restEvent.wait();
+  return event;
 }
 
-void lubksb(const cl::Buffer &matrix, int matrixSize, int stampCount, const cl::Buffer &index, const cl::Buffer &result, const ClData &clData) {
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int> func(clData.program, "lubksb");
-  cl::EnqueueArgs eargs(clData.queue, cl::NDRange(stampCount));
-  cl::Event event = func(eargs, matrix, index, result, matrixSize);
-
-  event.wait();
-}
-
-int ludcmp(std::vector<std::vector<double>>& matrix, int matrixSize,
-           std::vector<int>& index, double& d, const Arguments& args) {
-  std::vector<double> vv(matrixSize + 1, 0.0);
-  int maxI{};
-  double temp2{};
-
-  d = 1.0;
-
-  // Calculate vv
-  for(int i = 1; i <= matrixSize; i++) {
-    double big = 0.0;
-    for(int j = 1; j <= matrixSize; j++) {
-      temp2 = fabs(matrix[i][j]);
-      if(temp2 > big) big = temp2;
-    }
-    if(big == 0.0) {
-      if(args.verbose)
-        std::cout << " Numerical Recipies run error" << std::endl;
-      return 1;
-    }
-    vv[i] = 1.0 / big;
-  }
-
-  // Do the rest
-  for(int j = 1; j <= matrixSize; j++) {
-    for(int i = 1; i < j; i++) {
-      double sum = matrix[i][j];
-      for(int k = 1; k < i; k++) {
-        sum -= matrix[i][k] * matrix[k][j];
-      }
-      matrix[i][j] = sum;
-    }
-    double big = 0.0;
-    for(int i = j; i <= matrixSize; i++) {
-      double sum = matrix[i][j];
-      for(int k = 1; k < j; k++) {
-        sum -= matrix[i][k] * matrix[k][j];
-      }
-      matrix[i][j] = sum;
-      double dum = vv[i] * fabs(sum);
-      if(dum >= big) {
-        big = dum;
-        maxI = i;
-      }
-    }
-    if(j != maxI) {
-      for(int k = 1; k <= matrixSize; k++) {
-        double dum = matrix[maxI][k];
-        matrix[maxI][k] = matrix[j][k];
-        matrix[j][k] = dum;
-      }
-      d = -d;
-      vv[maxI] = vv[j];
-    }
-    index[j] = maxI;
-    matrix[j][j] = matrix[j][j] == 0.0 ? 1.0e-20 : matrix[j][j];
-    if(j != matrixSize) {
-      double dum = 1.0 / matrix[j][j];
-      for(int i = j + 1; i <= matrixSize; i++) {
-        matrix[i][j] *= dum;
-      }
-    }
-  }
-
-  return 0;
-}
-
-void lubksb(std::vector<std::vector<double>>& matrix, const int matrixSize,
-            const std::vector<int>& index, std::vector<double>& result) {
-  int ii{};
-
-  for(int i = 1; i <= matrixSize; i++) {
-    int ip = index[i];
-    double sum = result[ip];
-    result[ip] = result[i];
-    if(ii) {
-      for(int j = ii; j <= i - 1; j++) {
-        sum -= matrix[i][j] * result[j];
-      }
-    } else if(sum) {
-      ii = i;
-    }
-    result[i] = sum;
-  }
-
-  for(int i = matrixSize; i >= 1; i--) {
-    double sum = result[i];
-    for(int j = i + 1; j <= matrixSize; j++) {
-      sum -= matrix[i][j] * result[j];
-    }
-    result[i] = sum / matrix[i][i];
-  }
-}
-
-double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, const std::pair<cl_int, cl_int> &imgSize, const int x, const int y, const Arguments& args, const ClData &clData) {
+double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, const std::pair<cl_int, cl_int> &imgSize, const int x, const int y, const Arguments& args, const ClData &clData,
+                  const std::vector<cl::Event> &waitEvents) {
   double hWidth = 0.5 * imgSize.first;
   double hHeight = 0.5 * imgSize.second;
 
@@ -362,25 +294,22 @@ double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, cons
   // Create coefficients
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int,
                     cl_double, cl_double> coeffFunc(clData.program, "makeKernelCoeffs");
-  cl::EnqueueArgs coeffEargs(clData.queue, cl::NDRange(args.nPSF));
+  cl::EnqueueArgs coeffEargs(clData.queue, waitEvents, cl::NDRange(args.nPSF));
   cl::Event coeffEvent = coeffFunc(coeffEargs, kernSolution, kernCoeffs, args.kernelOrder,
                                    triNum(args.kernelOrder + 1), xf, yf);
-
-  coeffEvent.wait();
+  clData.profiler.record("makeKernelCoeffs", coeffEvent);
 
   // Create kernel
   static constexpr int kernelLocalSize = 16;
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl_int, cl_int> kernelFunc(clData.program, "makeKernel");
-  cl::EnqueueArgs kernelEargs(clData.queue, cl::NDRange(roundUpToMultiple(args.fKernelWidth * args.fKernelWidth, kernelLocalSize)), cl::NDRange(kernelLocalSize));
+  cl::EnqueueArgs kernelEargs(clData.queue, coeffEvent, cl::NDRange(roundUpToMultiple(args.fKernelWidth * args.fKernelWidth, kernelLocalSize)), cl::NDRange(kernelLocalSize));
   cl::Event kernelEvent = kernelFunc(kernelEargs, kernCoeffs, clData.kernel.vec, kernel, cl::Local(kernelLocalSize * sizeof(cl_double)), args.nPSF, args.fKernelWidth);
-  
-  kernelEvent.wait();
+  clData.profiler.record("makeKernel", kernelEvent);
 
   // Sum kernel
-  cl::Event copyEvent{};
-  clData.queue.enqueueCopyBuffer(kernel, kernelSum, 0, 0, sizeof(cl_double) * args.fKernelWidth * args.fKernelWidth, nullptr, &copyEvent);
-
-  copyEvent.wait();
+  std::vector<cl::Event> copyWaitEvents{kernelEvent};
+  cl::Event sumEvent{};
+  clData.queue.enqueueCopyBuffer(kernel, kernelSum, 0, 0, sizeof(cl_double) * args.fKernelWidth * args.fKernelWidth, &copyWaitEvents, &sumEvent);
 
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl_int> sumFunc(clData.program, "sumKernel");
   int sumCount = args.fKernelWidth * args.fKernelWidth;
@@ -389,10 +318,9 @@ double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, cons
   cl::Buffer* dst = &kernelSum2;
 
   while (sumCount > 1) {
-    cl::EnqueueArgs sumEargs(clData.queue, cl::NDRange(roundUpToMultiple(sumCount, localCount)), cl::NDRange(localCount));
-    cl::Event sumEvent = sumFunc(sumEargs, *src, *dst, cl::Local(localCount * sizeof(cl_double)), sumCount);
-    
-    sumEvent.wait();
+    cl::EnqueueArgs sumEargs(clData.queue, sumEvent, cl::NDRange(roundUpToMultiple(sumCount, localCount)), cl::NDRange(localCount));
+    sumEvent = sumFunc(sumEargs, *src, *dst, cl::Local(localCount * sizeof(cl_double)), sumCount);
+    clData.profiler.record("sumKernel", sumEvent);
 
     sumCount = (sumCount + localCount - 1) / localCount;
     std::swap(src, dst);
@@ -400,7 +328,8 @@ double makeKernel(const cl::Buffer &kernel, const cl::Buffer &kernSolution, cons
 
   // Transfer sum to CPU
   cl_double sumKernel = 0.0;
-  clData.queue.enqueueReadBuffer(*src, CL_TRUE, 0, sizeof(cl_double), &sumKernel);
+  std::vector<cl::Event> readWaitEvents{sumEvent};
+  clData.queue.enqueueReadBuffer(*src, CL_TRUE, 0, sizeof(cl_double), &sumKernel, &readWaitEvents);
 
   return sumKernel;
 }
@@ -445,3 +374,129 @@ double makeKernel(Kernel& kern, const std::pair<cl_int, cl_int> &imgSize, const
 
   return sumKernel;
 }
+
+size_t realSize(const Arguments& args) {
+  // Size of one pixel in the image buffers, see REAL in bach.cl
+  return args.singlePrecision ? sizeof(cl_float) : sizeof(cl_double);
+}
+
+cl::Event writeRealBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t count, const double *data, const Arguments& args,
+                          const std::vector<cl::Event> &waitEvents) {
+  /*
+   * Host images are always double. In double precision the upload does not
+   * block, data has to outlive it. In single precision the converted copy
+   * only lives here, so the upload blocks.
+   */
+  cl::Event event{};
+  if(!args.singlePrecision) {
+    queue.enqueueWriteBuffer(buf, CL_FALSE, 0, sizeof(cl_double) * count, data, &waitEvents, &event);
+    return event;
+  }
+
+  std::vector<cl_float> converted(data, data + count);
+  queue.enqueueWriteBuffer(buf, CL_TRUE, 0, sizeof(cl_float) * count, converted.data(), &waitEvents, &event);
+  return event;
+}
+
+cl::Event readRealBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t offset, size_t count, double *data, const Arguments& args,
+                         const std::vector<cl::Event> &waitEvents) {
+  // Offset and count are in pixels. Blocks in single precision, see writeRealBuffer.
+  cl::Event event{};
+  if(!args.singlePrecision) {
+    queue.enqueueReadBuffer(buf, CL_FALSE, sizeof(cl_double) * offset, sizeof(cl_double) * count, data, &waitEvents, &event);
+    return event;
+  }
+
+  std::vector<cl_float> staging(count);
+  queue.enqueueReadBuffer(buf, CL_TRUE, sizeof(cl_float) * offset, sizeof(cl_float) * count, staging.data(), &waitEvents, &event);
+  std::copy(staging.begin(), staging.end(), data);
+  return event;
+}
+
+cl::Event readFloatBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t offset, size_t count, cl_float *data,
+                          const ClData &clData, const Arguments& args, const std::vector<cl::Event> &waitEvents) {
+  // Offset and count are in pixels. Double images are converted on the device,
+  // which halves the transfer and leaves no conversion to the FITS writer.
+  cl::Event event{};
+  if(args.singlePrecision) {
+    queue.enqueueReadBuffer(buf, CL_FALSE, sizeof(cl_float) * offset, sizeof(cl_float) * count, data, &waitEvents, &event);
+    return event;
+  }
+
+  // The scratch buffer is released by OpenCL once the read is done
+  cl::Buffer floatBuf(clData.context, CL_MEM_WRITE_ONLY, sizeof(cl_float) * count);
+
+  cl::CommandQueue convertQueue = queue;
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> toFloatFunc(clData.program, "toFloat");
+  cl::EnqueueArgs eargs(convertQueue, waitEvents, cl::NDRange(count));
+  cl::Event convertEvent = toFloatFunc(eargs, buf, floatBuf, offset);
+  clData.profiler.record("toFloat", convertEvent);
+
+  std::vector<cl::Event> readWaitEvents{convertEvent};
+  queue.enqueueReadBuffer(floatBuf, CL_FALSE, 0, sizeof(cl_float) * count, data, &readWaitEvents, &event);
+  return event;
+}
+
+cl::Event fillRealBuffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t count, double value, const Arguments& args) {
+  cl::Event event{};
+  if(args.singlePrecision) {
+    queue.enqueueFillBuffer(buf, cl_float(value), 0, sizeof(cl_float) * count, nullptr, &event);
+  }
+  else {
+    queue.enqueueFillBuffer(buf, cl_double(value), 0, sizeof(cl_double) * count, nullptr, &event);
+  }
+  return event;
+}
+
+PendingImage startImageRead(const Image &img, const ClData &clData, const Arguments& args) {
+  /* Reads the header right away and starts reading the pixels on a worker
+   * thread, raw pixels straight into pinned memory. waitImageRead waits
+   * for them and uploadImage uploads them.
+   */
+  PendingImage pending{std::nullopt, cl::Buffer{}, nullptr, {}};
+  Image header{img};
+  pending.raw = openRawImage(header, args);
+
+  // The worker gets its own copies, the caller may be gone when it finishes
+  if(!pending.raw) {
+    pending.read = std::async(std::launch::async, [header, args]() mutable {
+      readImage(header, args);
+      return header;
+    });
+    return pending;
+  }
+
+  const size_t bytes = pending.raw->pixelSize() * header.size();
+  pending.staging = cl::Buffer(clData.context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes);
+  pending.pixels = clData.queue.enqueueMapBuffer(pending.staging, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, bytes);
+  pending.read = std::async(std::launch::async, [header, raw = *pending.raw, pixels = pending.pixels] {
+    readRawPixels(header, raw, pixels);
+    return header;
+  });
+
+  return pending;
+}
+
+void waitImageRead(PendingImage &pending, Image &img, const ClData &clData) {
+  // Rethrows the errors of the worker thread
+  auto readStart = Profiler::now();
+  img = pending.read.get();
+  clData.profiler.recordHost("waitImageRead", readStart);
+}
+
+cl::Event uploadImage(const PendingImage &pending, const Image &img, const cl::Buffer &imgBuf, const ClData &clData, const Arguments& args) {
+  if(!pending.raw) {
+    return writeRealBuffer(clData.queue, imgBuf, img.size(), &img, args);
+  }
+
+  cl::Event unmapEvent{};
+  clData.queue.enqueueUnmapMemObject(pending.staging, pending.pixels, nullptr, &unmapEvent);
+
+  // The staging buffer is released by OpenCL once the decode is done
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_double, cl_double> decodeFunc(clData.program, "decodeImage");
+  cl::EnqueueArgs decodeEargs(clData.queue, unmapEvent, cl::NDRange(img.size()));
+  cl::Event decodeEvent = decodeFunc(decodeEargs, pending.staging, imgBuf, pending.raw->bitpix, pending.raw->bscale, pending.raw->bzero);
+  clData.profiler.record("decodeImage", decodeEvent);
+
+  return decodeEvent;
+}
@@ -9,10 +9,7 @@ double testFit(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis
   const int nKernSolComp = args.nPSF * nComp2 + nBGComp + 1;
   cl_int meritsCount = 0;
 
-  std::vector<int> index1(nKernSolComp);  // Internal between ludcmp and lubksb.
-
   // Create buffers
-  cl::Buffer index(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * nKernSolComp * stamps.size());
   cl::Buffer vv(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * std::max<int>(matSize + 1, (args.nPSF + 2) * stamps.size()));
   cl::Buffer testVec(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * clData.bCount * stamps.size());
   cl::Buffer testMat(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * clData.qCount * clData.qCount * stamps.size());
@@ -22,49 +19,50 @@ double testFit(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis
   cl::Buffer testKernSol(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * nKernSolComp);
   cl::Buffer meritsCounter(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int));
 
-  clData.queue.enqueueWriteBuffer(meritsCounter, CL_TRUE, 0, sizeof(cl_int), &meritsCount);
+  clData.queue.enqueueFillBuffer(meritsCounter, meritsCount, 0, sizeof(cl_int));
 
   // Create test vec
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> testVecFunc(clData.program, "createTestVec");
   cl::EnqueueArgs testVecEargs(clData.queue, cl::NDRange(clData.bCount, stamps.size()));
   cl::Event testVecEvent = testVecFunc(testVecEargs, stampData.b, testVec, clData.bCount);
+  clData.profiler.record("createTestVec", testVecEvent);
 
   // Create test mat
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> testMatFunc(clData.program, "createTestMat");
   cl::EnqueueArgs testMatEargs(clData.queue, cl::NDRange(clData.qCount, clData.qCount, stamps.size()));
   cl::Event testMatEvent = testMatFunc(testMatEargs, stampData.q, testMat, clData.qCount);
+  clData.profiler.record("createTestMat", testMatEvent);
 
-  testVecEvent.wait();
-  testMatEvent.wait();
-
-  // LU-solve
-  ludcmp(testMat, args.nPSF + 2, stamps.size(), index, vv, clData);
-  lubksb(testMat, args.nPSF + 2, stamps.size(), index, testVec, clData);
+  // Solve every stamp
+  std::vector<cl::Event> solveWaitEvents{testMatEvent, testVecEvent};
+  cl::Event testSolveEvent = solveSymmetric(testMat, testVec, args.nPSF + 2, stamps.size(), vv, clData, solveWaitEvents);
 
   // Save kernel sums
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> kernelSumFunc(clData.program, "saveKernelSums");
-  cl::EnqueueArgs kernelSumEargs(clData.queue, cl::NDRange(stamps.size()));
+  cl::EnqueueArgs kernelSumEargs(clData.queue, testSolveEvent, cl::NDRange(stamps.size()));
   cl::Event kernelSumEvent = kernelSumFunc(kernelSumEargs, testVec, kernelSums, args.nPSF + 2);
-
-  kernelSumEvent.wait();
+  clData.profiler.record("saveKernelSums", kernelSumEvent);
 
   double kernelMean, kernelStdev;
-  sigmaClip(kernelSums, 0, stamps.size(), &kernelMean, &kernelStdev, 10, clData, args);
+  sigmaClip(kernelSums, 0, stamps.size(), &kernelMean, &kernelStdev, 10, clData, args, {kernelSumEvent});
 
-  // Fit stamps, generate test stamps
+  // Fit stamps, generate test stamps. The compaction keeps the stamp order.
   cl_int testStampCount = 0;
-  
+
+  cl::Buffer testStampFlags(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * stamps.size());
   cl::Buffer testStampCountBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int));
   cl::Buffer testStampIndices(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * stamps.size());
-  clData.queue.enqueueWriteBuffer(testStampCountBuf, CL_TRUE, 0, sizeof(cl_int), &testStampCount);
 
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer,
-                    cl_double, cl_double, cl_double, cl_int> testStampFunc(clData.program, "genCdTestStamps");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_double, cl_double, cl_double, cl_int> testStampFunc(clData.program, "genCdTestStamps");
   cl::EnqueueArgs testStampEargs(clData.queue, cl::NDRange(roundUpToMultiple(stamps.size(), 8)), cl::NDRange(8));
-  cl::Event testStampEvent = testStampFunc(testStampEargs, kernelSums, testStampIndices, testStampCountBuf,
-                                           kernelMean, kernelStdev, args.sigKernFit, stamps.size());
+  cl::Event testStampFlagEvent = testStampFunc(testStampEargs, kernelSums, testStampFlags,
+                                               kernelMean, kernelStdev, args.sigKernFit, stamps.size());
+  clData.profiler.record("genCdTestStamps", testStampFlagEvent);
+
+  cl::Event testStampEvent = compactIndices(testStampFlags, stamps.size(), testStampIndices, testStampCountBuf, clData, {testStampFlagEvent});
 
-  clData.queue.enqueueReadBuffer(testStampCountBuf, CL_TRUE, 0, sizeof(cl_int), &testStampCount);
+  std::vector<cl::Event> testStampWaitEvents{testStampEvent};
+  clData.queue.enqueueReadBuffer(testStampCountBuf, CL_TRUE, 0, sizeof(cl_int), &testStampCount, &testStampWaitEvents);
 
   if (testStampCount == 0) {
     return 666;
@@ -81,92 +79,45 @@ double testFit(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis
   testStampData.b = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * testStampCount * clData.bCount);
   testStampData.stampCount = testStampCount;
 
-  std::vector<cl::Event> testEvents{};
-
-  // Copy sub-stamp coordinates
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int> copySsCoordsFunc(clData.program, "copyTestSubStampsCoords");
-  cl::EnqueueArgs copySsCoordsEargs(clData.queue, cl::NDRange(2 * args.maxKSStamps, testStampCount));
-  testEvents.push_back(copySsCoordsFunc(copySsCoordsEargs, stampData.subStampCoords, testStampIndices, testStampData.subStampCoords, 2 * args.maxKSStamps));
-
-  // Copy substamp counts
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> copySsCountsFunc(clData.program, "copyTestSubStampsCounts");
-  cl::EnqueueArgs copySsCountsEargs(clData.queue, cl::NDRange(testStampCount));
-  testEvents.push_back(copySsCountsFunc(copySsCountsEargs, stampData.currentSubStamps, stampData.subStampCounts, testStampIndices,
-                                        testStampData.currentSubStamps, testStampData.subStampCounts));
-
-  // Copy W
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int> copyWFunc(clData.program, "copyTestStampsW");
-  cl::EnqueueArgs copyWEargs(clData.queue, cl::NDRange(clData.wColumns, clData.wRows, testStampCount));
-  testEvents.push_back(copyWFunc(copyWEargs, stampData.w, testStampIndices, testStampData.w, clData.wRows, clData.wColumns));
-
-  // Copy Q
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int> copyQFunc(clData.program, "copyTestStampsQ");
-  cl::EnqueueArgs copyQEargs(clData.queue, cl::NDRange(clData.qCount, clData.qCount, testStampCount));
-  testEvents.push_back(copyQFunc(copyQEargs, stampData.q, testStampIndices, testStampData.q, clData.qCount));
-
-  // Copy B
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int> copyBFunc(clData.program, "copyTestStampsB");
-  cl::EnqueueArgs copyBEargs(clData.queue, cl::NDRange(clData.bCount, testStampCount));
-  testEvents.push_back(copyBFunc(copyBEargs, stampData.b, testStampIndices, testStampData.b, clData.bCount));
-
-  cl::Event::waitForEvents(testEvents);
+  // Gather the test stamps
+  static constexpr int gatherLocalSize = 64;
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl_int, cl_int, cl_int, cl_int> gatherFunc(clData.program, "gatherTestStamps");
+  cl::EnqueueArgs gatherEargs(clData.queue, testStampEvent, cl::NDRange(gatherLocalSize, testStampCount), cl::NDRange(gatherLocalSize, 1));
+  cl::Event gatherEvent = gatherFunc(gatherEargs, testStampIndices,
+                                     stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts,
+                                     stampData.w, stampData.q, stampData.b,
+                                     testStampData.subStampCoords, testStampData.currentSubStamps, testStampData.subStampCounts,
+                                     testStampData.w, testStampData.q, testStampData.b,
+                                     2 * args.maxKSStamps, clData.wColumns * clData.wRows, clData.qCount * clData.qCount, clData.bCount);
+  clData.profiler.record("gatherTestStamps", gatherEvent);
 
   // Do fit
-  createMatrix(matrix, weights, clData, testStampData, axis, args);
-  createScProd(testKernSol, weights, sImgBuf, axis, clData, testStampData, args);
+  cl::Event matrixEvent = createMatrix(matrix, weights, clData, testStampData, axis, args, {gatherEvent});
+  cl::Event prodEvent = createScProd(testKernSol, weights, sImgBuf, axis, clData, testStampData, args, {matrixEvent});
 
-  // TEMP: parallel matrix solver is currently very slow, so temporarly use CPU version
-#if true
-  // TEMP: transfer matrix back to CPU
-  std::vector<cl_double> matrixCpu2((matSize + 1) * (matSize + 1));
-  clData.queue.enqueueReadBuffer(matrix, CL_TRUE, 0, sizeof(cl_double) * matrixCpu2.size(), matrixCpu2.data());
-
-  std::vector<std::vector<cl_double>> matrixCpu(matSize + 1, std::vector<cl_double>(matSize + 1));
-
-  for (int i = 0; i < matSize + 1; i++) {
-    for (int j = 0; j < matSize + 1; j++) {
-      matrixCpu[i][j] = matrixCpu2[i * (matSize + 1) + j];
-    }
-  }
-
-  // TEMP: transfer kernel solution back to CPU
-  std::vector<cl_double> testKernSolCpu(nKernSolComp);
-  clData.queue.enqueueReadBuffer(testKernSol, CL_TRUE, 0, sizeof(cl_double) * testKernSolCpu.size(), testKernSolCpu.data());
-
-  double d;
-  ludcmp(matrixCpu, matSize, index1, d, args);
-  lubksb(matrixCpu, matSize, index1, testKernSolCpu);
-
-  // TEMP: transfer back to GPU
-  clData.queue.enqueueWriteBuffer(testKernSol, CL_TRUE, 0, sizeof(cl_double) * testKernSolCpu.size(), testKernSolCpu.data());
-#else
-  ludcmp(matrix, matSize + 1, 1, index, vv, clData);
-  lubksb(matrix, matSize + 1, 1, index, testKernSol, clData);
-  
-  // TEMP: transfer kernel solution back (again) to CPU
-  std::vector<cl_double> testKernSolCpu(nKernSolComp);
-  clData.queue.enqueueReadBuffer(testKernSol, CL_TRUE, 0, sizeof(cl_double) * testKernSolCpu.size(), testKernSolCpu.data());
-#endif
+  cl::Event solutionEvent = solveSymmetric(matrix, testKernSol, matSize + 1, 1, vv, clData, {prodEvent});
   
   cl::Buffer kernel(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * args.fKernelWidth * args.fKernelWidth);
-  kernelMean = makeKernel(kernel, testKernSol, axis, 0, 0, args, clData);
+  kernelMean = makeKernel(kernel, testKernSol, axis, 0, 0, args, clData, {solutionEvent});
 
   // Calc merit value
   cl::Buffer model(clData.context, CL_MEM_READ_WRITE, sizeof(cl_float) * testStampCount * args.fSStampWidth * args.fSStampWidth);
   cl::Buffer merits(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * testStampCount);
-  calcSigs(tImgBuf, sImgBuf, axis, model, testKernSol, merits, testStampData, clData, args);
+  cl::Event sigsEvent = calcSigs(tImgBuf, sImgBuf, axis, model, testKernSol, merits, testStampData, clData, args, {solutionEvent});
 
   // Remove bad merits
   static constexpr int badLocalSize = 16;
   cl::Buffer cleanMerits(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * testStampCount);
 
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl_int> badMeritsFunc(clData.program, "removeBadSigs");
-  cl::EnqueueArgs badMeritsEargs(clData.queue, cl::NDRange(roundUpToMultiple(testStampCount, badLocalSize)), cl::NDRange(badLocalSize));
+  cl::EnqueueArgs badMeritsEargs(clData.queue, sigsEvent, cl::NDRange(roundUpToMultiple(testStampCount, badLocalSize)), cl::NDRange(badLocalSize));
   cl::Event badMeritsEvent = badMeritsFunc(badMeritsEargs, merits, cleanMerits, meritsCounter, cl::Local(badLocalSize * sizeof(cl_double)), testStampCount);
+  clData.profiler.record("removeBadSigs", badMeritsEvent);
 
-  badMeritsEvent.wait();
-
-  clData.queue.enqueueReadBuffer(meritsCounter, CL_TRUE, 0, sizeof(cl_int), &meritsCount);
+  std::vector<cl::Event> meritsWaitEvents{badMeritsEvent};
+  clData.queue.enqueueReadBuffer(meritsCounter, CL_TRUE, 0, sizeof(cl_int), &meritsCount, &meritsWaitEvents);
 
   if (meritsCount == 0) {
     return 666;
@@ -174,139 +125,54 @@ double testFit(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis
 
   double meritMean;
   double meritStdDev;
-  sigmaClip(cleanMerits, 0, meritsCount, &meritMean, &meritStdDev, 10, clData, args);
+  sigmaClip(cleanMerits, 0, meritsCount, &meritMean, &meritStdDev, 10, clData, args, {badMeritsEvent});
 
   double normMeritMean = meritMean / kernelMean;
   return normMeritMean;
 }
 
-void createMatrix(const cl::Buffer &matrix, const cl::Buffer &weights, const ClData &clData, const ClStampsData &stampData, const std::pair<cl_int, cl_int>& imgSize, const Arguments& args) {
+cl::Event createMatrix(const cl::Buffer &matrix, const cl::Buffer &weights, const ClData &clData, const ClStampsData &stampData, const std::pair<cl_int, cl_int>& imgSize, const Arguments& args,
+                       const std::vector<cl::Event> &waitEvents) {
   const int nComp1 = args.nPSF - 1;
   const int nComp2 = triNum(args.kernelOrder + 1);
   const int nComp = nComp1 * nComp2;
   const int nBGVectors = triNum(args.backgroundOrder + 1);
   const int matSize = nComp + nBGVectors + 1;
 
-  const int pixStamp = args.fSStampWidth * args.fSStampWidth;
-
   // Create weights
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int> weightFunc(clData.program, "createMatrixWeights");
-  cl::EnqueueArgs weightEargs(clData.queue, cl::NDRange(nComp2, stampData.stampCount));
+  cl::EnqueueArgs weightEargs(clData.queue, waitEvents, cl::NDRange(nComp2, stampData.stampCount));
   cl::Event weightEvent = weightFunc(weightEargs, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts, clData.cd.kernelXy,
                                      weights, imgSize.first, imgSize.second, 2 * args.maxKSStamps, nComp2);
+  clData.profiler.record("createMatrixWeights", weightEvent);
 
-  weightEvent.wait();
-
-  // Create matrix
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
-                    cl_int, cl_int, cl_int, cl_int, cl_int,
-                    cl_int, cl_int, cl_int> matrixFunc(clData.program, "createMatrix");
-  cl::EnqueueArgs matrixEargs(clData.queue, cl::NDRange(matSize + 1, matSize + 1));
-  cl::Event matrixEvent = matrixFunc(matrixEargs, weights, stampData.w, stampData.q, matrix,
-                                     stampData.stampCount, matSize + 1, pixStamp, nComp1, nComp2,
-                                     clData.wRows, clData.wColumns, clData.qCount);
-
-  matrixEvent.wait();
-}
-
-std::pair<std::vector<std::vector<double>>, std::vector<std::vector<double>>>
-createMatrix(const std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int>& imgSize, const Arguments& args) {
-  const int nComp1 = args.nPSF - 1;
-  const int nComp2 = triNum(args.kernelOrder + 1);
-  const int nComp = nComp1 * nComp2;
-  const int nBGVectors = triNum(args.backgroundOrder + 1);
-  const int matSize = nComp + nBGVectors + 1;
-
-  const int pixStamp = args.fSStampWidth * args.fSStampWidth;
-  const float hPixX = 0.5 * imgSize.first;
-  const float hPixY = 0.5 * imgSize.second;
-
-  std::vector<std::vector<double>> matrix(
-      matSize + 1, std::vector<double>(matSize + 1, 0.0));
-  std::vector<std::vector<double>> weight(stamps.size(),
-                                          std::vector<double>(nComp2, 0.0));
-
-  for(size_t st = 0; st < stamps.size(); st++) {
-    const Stamp& s = stamps[st];
-    if(s.subStamps.empty()) continue;
-
-    auto [ssx, ssy] = s.subStamps[0].imageCoords;
-
-    double fx = (ssx - hPixX) / hPixX;
-    double fy = (ssy - hPixY) / hPixY;
-
-    double a1 = 1.0;
-    for(int k = 0, i = 0; i <= int(args.kernelOrder); i++) {
-      double a2 = 1.0;
-      for(int j = 0; j <= int(args.kernelOrder) - i; j++) {
-        weight[st][k++] = a1 * a2;
-        a2 *= fy;
-      }
-      a1 *= fx;
-    }
-
-    for(int i = 0; i < nComp; i++) {
-      int i1 = i / nComp2;
-      int i2 = i - i1 * nComp2;
-      for(int j = 0; j <= i; j++) {
-        int j1 = j / nComp2;
-        int j2 = j - j1 * nComp2;
-
-        matrix[i + 2][j + 2] +=
-            weight[st][i2] * weight[st][j2] * s.Q[i1 + 2][j1 + 2];
-      }
-    }
-
-    matrix[1][1] += s.Q[1][1];
-    for(int i = 0; i < nComp; i++) {
-      int i1 = i / nComp2;
-      int i2 = i - i1 * nComp2;
-      matrix[i + 2][1] += weight[st][i2] * s.Q[i1 + 2][1];
-    }
-
-    for(int iBG = 0; iBG < nBGVectors; iBG++) {
-      int i = nComp + iBG + 1;
-      int iVecBG = nComp1 + iBG + 1;
-      for(int i1 = 1; i1 < nComp1 + 1; i1++) {
-        double p0 = 0.0;
-
-        for(int k = 0; k < pixStamp; k++) {
-          p0 += s.W[i1][k] * s.W[iVecBG][k];
-        }
+  // Gram matrix of every stamp
+  static constexpr int gramTile = 16;  // GRAM_TILE in cd.cl
+  const int gramTiles = (clData.wRows + gramTile - 1) / gramTile;
+  const int gramTilePairs = triNum(gramTiles);
 
-        for(int i2 = 0; i2 < nComp2; i2++) {
-          int jj = (i1 - 1) * nComp2 + i2 + 1;
-          matrix[i + 1][jj + 1] += p0 * weight[st][i2];
-        }
-      }
+  cl::Buffer gram(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * clData.wRows * clData.wRows * stampData.stampCount);
 
-      double p0 = 0.0;
-      for(int k = 0; k < pixStamp; k++) {
-        p0 += s.W[0][k] * s.W[iVecBG][k];
-      }
-      matrix[i + 1][1] += p0;
-
-      for(int jBG = 0; jBG <= iBG; jBG++) {
-        double q = 0.0;
-        for(int k = 0; k < pixStamp; k++) {
-          q += s.W[iVecBG][k] * s.W[nComp1 + jBG + 1][k];
-        }
-        matrix[i + 1][nComp + jBG + 2] += q;
-      }
-    }
-  }
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int> gramFunc(clData.program, "createStampGram");
+  cl::EnqueueArgs gramEargs(clData.queue, waitEvents, cl::NDRange(gramTile, gramTile, gramTilePairs * stampData.stampCount), cl::NDRange(gramTile, gramTile, 1));
+  cl::Event gramEvent = gramFunc(gramEargs, stampData.w, gram, clData.wRows, clData.wColumns, gramTiles);
+  clData.profiler.record("createStampGram", gramEvent);
 
-  for(int i = 0; i < matSize; i++) {
-    for(int j = 0; j <= i; j++) {
-      matrix[j + 1][i + 1] = matrix[i + 1][j + 1];
-    }
-  }
-
-  return std::make_pair(matrix, weight);
+  // Create matrix
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl_int, cl_int, cl_int, cl_int, cl_int> matrixFunc(clData.program, "createMatrix");
+  std::vector<cl::Event> matrixWaitEvents{weightEvent, gramEvent};
+  cl::EnqueueArgs matrixEargs(clData.queue, matrixWaitEvents, cl::NDRange(matSize + 1, matSize + 1));
+  cl::Event matrixEvent = matrixFunc(matrixEargs, weights, gram, matrix,
+                                     stampData.stampCount, matSize + 1, nComp1, nComp2, clData.wRows);
+  clData.profiler.record("createMatrix", matrixEvent);
+
+  return matrixEvent;
 }
 
-void createScProd(const cl::Buffer &res, const cl::Buffer &weights, const cl::Buffer &img, const std::pair<cl_int, cl_int>& imgSize, const ClData &clData, const ClStampsData &stampData, const Arguments& args) {
+cl::Event createScProd(const cl::Buffer &res, const cl::Buffer &weights, const cl::Buffer &img, const std::pair<cl_int, cl_int>& imgSize, const ClData &clData, const ClStampsData &stampData, const Arguments& args,
+                       const std::vector<cl::Event> &waitEvents) {
   const int nComp1 = args.nPSF - 1;
   const int nComp2 = triNum(args.kernelOrder + 1);
   const int nBgComp = triNum(args.backgroundOrder + 1);
@@ -316,64 +182,20 @@ void createScProd(const cl::Buffer &res, const cl::Buffer &weights, const cl::Bu
                     cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int, cl_int,
                     cl_int, cl_int, cl_int, cl_int, cl_int> prodFunc(clData.program, "createScProd");
-  cl::EnqueueArgs prodEargs(clData.queue, cl::NDRange(nKernSolComp));
+  cl::EnqueueArgs prodEargs(clData.queue, waitEvents, cl::NDRange(nKernSolComp));
   cl::Event prodEvent = prodFunc(prodEargs, img, weights, stampData.b, stampData.w,
                                  stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts, res,
                                  imgSize.first, stampData.stampCount, nComp1, nComp2, nBgComp,
                                  clData.bCount, clData.wRows, clData.wColumns, args.fSStampWidth, 2 * args.maxKSStamps);
+  clData.profiler.record("createScProd", prodEvent);
 
-  prodEvent.wait();
+  return prodEvent;
 }
 
-std::vector<double> createScProd(const std::vector<Stamp>& stamps, const Image& img,
-                                 const std::vector<std::vector<double>>& weight, const Arguments& args) {
-  const int nComp1 = args.nPSF - 1;
-  const int nComp2 = triNum(args.kernelOrder + 1);
-  const int nBGComp = triNum(args.backgroundOrder + 1);
-  const int nKernSolComp = args.nPSF * nComp2 + nBGComp + 1;
-
-  std::vector<double> res(nKernSolComp, 0.0);
-
-  int sI = 0;
-  for(auto& s : stamps) {
-    if(s.subStamps.empty()) {
-      sI++;
-      continue;
-    }
-    auto [ssx, ssy] = s.subStamps[0].imageCoords;
-
-    double p0 = s.B[1];
-    res[1] += p0;
-
-    for(int i = 1; i < nComp1 + 1; i++) {
-      p0 = s.B[i + 1];
-      for(int j = 0; j < nComp2; j++) {
-        int indx = (i - 1) * nComp2 + j + 1;
-        res[indx + 1] += p0 * weight[sI][j];
-      }
-    }
-
-    for(int bgIndex = 0; bgIndex < nBGComp; bgIndex++) {
-      double q = 0.0;
-      for(int x = -args.hSStampWidth; x <= args.hSStampWidth; x++) {
-        for(int y = -args.hSStampWidth; y <= args.hSStampWidth; y++) {
-          int index = x + args.hSStampWidth +
-                      args.fSStampWidth * (y + args.hSStampWidth);
-          q += s.W[nComp1 + bgIndex + 1][index] *
-               img[x + ssx + (y + ssy) * img.axis.first];
-        }
-      }
-      res[nComp1 * nComp2 + bgIndex + 2] += q;
-    }
-
-    sI++;
-  }
-  return res;
-}
-
-void calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::pair<cl_int, cl_int> &axis,
-              const cl::Buffer &model, const cl::Buffer &kernSol, const cl::Buffer &sigma,
-              const ClStampsData &stampData, const ClData &clData, const Arguments& args) {
+cl::Event calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::pair<cl_int, cl_int> &axis,
+                   const cl::Buffer &model, const cl::Buffer &kernSol, const cl::Buffer &sigma,
+                   const ClStampsData &stampData, const ClData &clData, const Arguments& args,
+                   const std::vector<cl::Event> &waitEvents) {
   static constexpr int localSize = 32;
 
   int reduceCount = (args.fSStampWidth * args.fSStampWidth + localSize - 1) / localSize;
@@ -389,35 +211,34 @@ void calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::p
   // Create bg
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int, cl_int> bgFunc(clData.program, "calcSigBg");
-  cl::EnqueueArgs bgEargs(clData.queue, cl::NDRange(stampCount));
+  cl::EnqueueArgs bgEargs(clData.queue, waitEvents, cl::NDRange(stampCount));
   cl::Event bgEvent = bgFunc(bgEargs, kernSol, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts, bg,
                              2 * args.maxKSStamps, axis.first, axis.second, args.backgroundOrder,
                              (args.nPSF - 1) * triNum(args.kernelOrder + 1) + 1);
+  clData.profiler.record("calcSigBg", bgEvent);
 
   // Create model
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int, cl_int,
                     cl_int, cl_int, cl_int> modelFunc(clData.program, "makeModel");
-  cl::EnqueueArgs modelEargs(clData.queue, cl::NDRange(args.fSStampWidth * args.fSStampWidth, stampCount));
+  cl::EnqueueArgs modelEargs(clData.queue, waitEvents, cl::NDRange(args.fSStampWidth * args.fSStampWidth, stampCount));
   cl::Event modelEvent = modelFunc(modelEargs, stampData.w, kernSol, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts,
                                    model, args.nPSF, args.kernelOrder, clData.wRows, clData.wColumns, 2 * args.maxKSStamps,
                                    axis.first, axis.second, args.fSStampWidth * args.fSStampWidth);
-
-  bgEvent.wait();
-  modelEvent.wait();
+  clData.profiler.record("makeModel", modelEvent);
 
   // Create sigmas
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg,
                     cl_int, cl_int, cl_int, cl_int, cl_int> sigmaFunc(clData.program, "calcSig");
-  cl::EnqueueArgs sigmaEargs(clData.queue, cl::NDRange(reduceCount * localSize, stampCount), cl::NDRange(localSize, 1));
+  std::vector<cl::Event> sigmaWaitEvents{bgEvent, modelEvent};
+  cl::EnqueueArgs sigmaEargs(clData.queue, sigmaWaitEvents, cl::NDRange(reduceCount * localSize, stampCount), cl::NDRange(localSize, 1));
   cl::Event sigmaEvent = sigmaFunc(sigmaEargs, model, bg, tImgBuf, sImgBuf,
                                    stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts,
                                    sigTemp1, sigCount1, clData.maskBuf, cl::Local(localSize * sizeof(cl_double)), axis.first, args.fSStampWidth,
                                    2 * args.maxKSStamps, args.fSStampWidth * args.fSStampWidth, reduceCount);
-
-  sigmaEvent.wait();
+  clData.profiler.record("calcSig", sigmaEvent);
 
   // Reduce
   bool isFirst = true;
@@ -430,13 +251,13 @@ void calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::p
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg,
                     cl_int, cl_int> reduceFunc(clData.program, "reduceSig");
 
+  cl::Event reduceEvent = sigmaEvent;
   while (count > 1 || isFirst) {
     int nextCount = (count + localSize - 1) / localSize;
 
-    cl::EnqueueArgs reduceEargs(clData.queue, cl::NDRange(roundUpToMultiple(count, localSize), stampCount), cl::NDRange(localSize, 1));
-    cl::Event reduceEvent = reduceFunc(reduceEargs, *sigIn, *sigCountIn, *sigOut, *sigCountOut, cl::Local(localSize * sizeof(cl_double)), count, nextCount);
-
-    reduceEvent.wait();
+    cl::EnqueueArgs reduceEargs(clData.queue, reduceEvent, cl::NDRange(roundUpToMultiple(count, localSize), stampCount), cl::NDRange(localSize, 1));
+    reduceEvent = reduceFunc(reduceEargs, *sigIn, *sigCountIn, *sigOut, *sigCountOut, cl::Local(localSize * sizeof(cl_double)), count, nextCount);
+    clData.profiler.record("reduceSig", reduceEvent);
 
     count = nextCount;
     std::swap(sigIn, sigOut);
@@ -446,10 +267,11 @@ void calcSigs(const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf, const std::p
   }
 
   // Copy buffer
+  std::vector<cl::Event> copyWaitEvents{reduceEvent};
   cl::Event copyEvent{};
-  clData.queue.enqueueCopyBuffer(*sigIn, sigma, 0, 0, sizeof(cl_double) * stampCount, nullptr, &copyEvent);
+  clData.queue.enqueueCopyBuffer(*sigIn, sigma, 0, 0, sizeof(cl_double) * stampCount, &copyWaitEvents, &copyEvent);
 
-  copyEvent.wait();
+  return copyEvent;
 }
 
 void fitKernel(Kernel& k, std::vector<Stamp>& stamps, const Image &sImg, const cl::Buffer &tImgBuf, const cl::Buffer &sImgBuf,
@@ -464,11 +286,8 @@ void fitKernel(Kernel& k, std::vector<Stamp>& stamps, const Image &sImg, const c
   cl::Buffer fitMatrix(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * (matSize + 1) * (matSize + 1));
   cl::Buffer weights(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * nComp2 * stampData.stampCount);
   clData.kernel.solution = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * nKernSolComp);
-  cl::Buffer index(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * (matSize + 1));
   cl::Buffer vv(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * (matSize + 1));
 
-  std::vector<int> index0(matSize, 0);
-
   int iteration = 0;
   bool check{};
 
@@ -479,63 +298,15 @@ void fitKernel(Kernel& k, std::vector<Stamp>& stamps, const Image &sImg, const c
     }
     
     // Create matrix
-#if false
-    createMatrix(fitMatrix, weights, clData, stampData, axis, args);
-    createScProd(solution, weights, sImgBuf, axis, clData, stampData, args);
-    
-    // TEMP: transfer back to CPU
-    std::vector<std::vector<double>> fittingMatrixCpu(matSize + 1, std::vector<double>(matSize + 1));
-    std::vector<cl_double> solutionCpu(nKernSolComp);
-    std::vector<cl_double> fittingMatrixTemp((matSize + 1) * (matSize + 1));
-
-    clData.queue.enqueueReadBuffer(fitMatrix, CL_TRUE, 0, sizeof(cl_double) * fittingMatrixTemp.size(), fittingMatrixTemp.data());
-    clData.queue.enqueueReadBuffer(solution, CL_TRUE, 0, sizeof(cl_double) * solutionCpu.size(), solutionCpu.data());
-    
-    for (int i = 0; i <= matSize; i++) {
-      for (int j = 0; j <= matSize; j++) {
-        fittingMatrixCpu[i][j] = fittingMatrixTemp[i * (matSize + 1) + j];
-      }
-    }
-#else
-    auto [fittingMatrix0, weight0] = createMatrix(stamps, sImg.axis, args);
-    std::vector<double> solution0 = createScProd(stamps, sImg, weight0, args);
-
-    std::vector<std::vector<double>> fittingMatrixCpu = std::move(fittingMatrix0);
-    std::vector<double> solutionCpu = std::move(solution0);
-#endif
-
-    // LU solve
-#if false
-    // TEMP: transfer matrix to GPU
-    std::vector<cl_double> flatFitMatrix{};
-
-    for (auto& row : fittingMatrixCpu) {
-      for (double value : row) {
-        flatFitMatrix.push_back(value);
-      }
-    }
-
-    clData.queue.enqueueWriteBuffer(fitMatrix, CL_TRUE, 0, sizeof(cl_double) * flatFitMatrix.size(), flatFitMatrix.data());
-
-    // TEMP: transfer solution to GPU
-    clData.queue.enqueueWriteBuffer(solution, CL_TRUE, 0, sizeof(cl_double) * solutionCpu.size(), solutionCpu.data());
+    cl::Event matrixEvent = createMatrix(fitMatrix, weights, clData, stampData, sImg.axis, args);
+    cl::Event prodEvent = createScProd(clData.kernel.solution, weights, sImgBuf, sImg.axis, clData, stampData, args, {matrixEvent});
 
-    ludcmp(fitMatrix, matSize + 1, 1, index, vv, clData);
-    lubksb(fitMatrix, matSize + 1, 1, index, solution, clData);
+    cl::Event solveEvent = solveSymmetric(fitMatrix, clData.kernel.solution, matSize + 1, 1, vv, clData, {prodEvent});
 
-    // TEMP: transfer solution back to CPU
-    clData.queue.enqueueReadBuffer(solution, CL_TRUE, 0, sizeof(cl_double) * solutionCpu.size(), solutionCpu.data());
-
-#else
-    double d{};
-    ludcmp(fittingMatrixCpu, matSize, index0, d, args);
-    lubksb(fittingMatrixCpu, matSize, index0, solutionCpu);
-#endif
-
-    k.solution = solutionCpu;
-    
-    // TEMP: transfer kernel solution to GPU
-    clData.queue.enqueueWriteBuffer(clData.kernel.solution, CL_TRUE, 0, sizeof(cl_double) * solutionCpu.size(), solutionCpu.data());
+    // The host copy is used to build the convolution kernels
+    k.solution.resize(nKernSolComp);
+    std::vector<cl::Event> solutionWaitEvents{solveEvent};
+    clData.queue.enqueueReadBuffer(clData.kernel.solution, CL_TRUE, 0, sizeof(cl_double) * k.solution.size(), k.solution.data(), &solutionWaitEvents);
 
     check = checkFitSolution(k, stamps, sImg.axis, clData, stampData, tImgBuf, sImgBuf, clData.kernel.solution, args);
 
@@ -555,26 +326,29 @@ bool checkFitSolution(const Kernel& k, std::vector<Stamp>& stamps, const std::pa
   cl::Buffer invalidatedSubStampsBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * stampData.stampCount);
   cl::Buffer chi2Counter(clData.context, CL_MEM_READ_WRITE, sizeof(cl_int));
 
-  clData.queue.enqueueWriteBuffer(chi2Counter, CL_TRUE, 0, sizeof(cl_int), &chi2Count);
+  cl::Event chi2ZeroEvent{};
+  clData.queue.enqueueFillBuffer(chi2Counter, chi2Count, 0, sizeof(cl_int), nullptr, &chi2ZeroEvent);
 
   // Calculate sigmas
-  calcSigs(tImgBuf, sImgBuf, axis, model, kernSol, sigmaVals, stampData, clData, args);
+  cl::Event sigsEvent = calcSigs(tImgBuf, sImgBuf, axis, model, kernSol, sigmaVals, stampData, clData, args);
 
   // Find bad sub-stamps
   static constexpr int badLocalSize = 16;
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl_int> badSsFunc(clData.program, "checkBadSubStamps");
-  cl::EnqueueArgs badSsEargs(clData.queue, cl::NDRange(roundUpToMultiple(stampData.stampCount, badLocalSize)), cl::NDRange(badLocalSize));
+  std::vector<cl::Event> badSsInputEvents{sigsEvent, chi2ZeroEvent};
+  cl::EnqueueArgs badSsEargs(clData.queue, badSsInputEvents, cl::NDRange(roundUpToMultiple(stampData.stampCount, badLocalSize)), cl::NDRange(badLocalSize));
   cl::Event badSsEvent = badSsFunc(badSsEargs, sigmaVals, stampData.subStampCounts,
                                    chi2, invalidatedSubStampsBuf, stampData.currentSubStamps, chi2Counter,
                                    cl::Local(badLocalSize * sizeof(cl_double)), stampData.stampCount);
+  clData.profiler.record("checkBadSubStamps", badSsEvent);
 
-  badSsEvent.wait();
-
-  clData.queue.enqueueReadBuffer(chi2Counter, CL_TRUE, 0, sizeof(cl_int), &chi2Count);
-
-  // Read which sub-stamps are bad
+  // Read the chi2 count and which sub-stamps are bad
   std::vector<cl_uchar> invalidatedSubStamps(stampData.stampCount);
-  clData.queue.enqueueReadBuffer(invalidatedSubStampsBuf, CL_TRUE, 0, sizeof(cl_uchar) * invalidatedSubStamps.size(), invalidatedSubStamps.data());
+  std::vector<cl::Event> badSsWaitEvents{badSsEvent};
+  std::vector<cl::Event> readEvents(2);
+  clData.queue.enqueueReadBuffer(chi2Counter, CL_FALSE, 0, sizeof(cl_int), &chi2Count, &badSsWaitEvents, &readEvents[0]);
+  clData.queue.enqueueReadBuffer(invalidatedSubStampsBuf, CL_FALSE, 0, sizeof(cl_uchar) * invalidatedSubStamps.size(), invalidatedSubStamps.data(), &badSsWaitEvents, &readEvents[1]);
+  cl::Event::waitForEvents(readEvents);
 
   // Remove the bad sub-stamps
   bool check = false;
@@ -583,17 +357,17 @@ bool checkFitSolution(const Kernel& k, std::vector<Stamp>& stamps, const std::pa
   // Sigma clip
   double mean = 0.0;
   double stdDev = 0.0;
-  sigmaClip(chi2, 0, chi2Count, &mean, &stdDev, 10, clData, args);
+  sigmaClip(chi2, 0, chi2Count, &mean, &stdDev, 10, clData, args, {badSsEvent});
 
   // Find bad sub-stamps based on the sigma clip
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_double, cl_double, cl_double> badSsClipFunc(clData.program, "checkBadSubStampsFromSigmaClip");
   cl::EnqueueArgs badSsClipEargs(clData.queue, cl::NDRange(stampData.stampCount));
   cl::Event badSsClipEvent = badSsClipFunc(badSsClipEargs, sigmaVals, stampData.subStampCounts, invalidatedSubStampsBuf, stampData.currentSubStamps, mean, stdDev, args.sigKernFit);
-
-  badSsClipEvent.wait();
+  clData.profiler.record("checkBadSubStampsFromSigmaClip", badSsClipEvent);
   
   // Read which sub-stamps are bad (again)
-  clData.queue.enqueueReadBuffer(invalidatedSubStampsBuf, CL_TRUE, 0, sizeof(cl_uchar) * invalidatedSubStamps.size(), invalidatedSubStamps.data());
+  std::vector<cl::Event> badSsClipWaitEvents{badSsClipEvent};
+  clData.queue.enqueueReadBuffer(invalidatedSubStampsBuf, CL_TRUE, 0, sizeof(cl_uchar) * invalidatedSubStamps.size(), invalidatedSubStamps.data(), &badSsClipWaitEvents);
 
   // Remove the bad sub-stamps
   removeBadSubStamps(&check, stampData, stamps, invalidatedSubStamps, axis, sImgBuf, tImgBuf, k, clData, args);
@@ -1,6 +1,10 @@
 #include "clUtil.h"
 
+#include <cstdint>
 #include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
 
 cl::Platform getDefaultPlatform() {
   // get all platforms (drivers)
@@ -32,6 +36,48 @@ cl::Device getDefaultDevice(const cl::Platform &platform) {
   return defaultDevice;
 }
 
+cl::Platform getMultiDevicePlatform() {
+  // A context can only hold devices of one platform, use the one with most devices
+  std::vector<cl::Platform> allPlatforms;
+  cl::Platform::get(&allPlatforms);
+  if(allPlatforms.size() == 0) {
+    std::cout << " No platforms found. Check OpenCL installation!\n";
+    std::exit(1);
+  }
+
+  size_t best = 0;
+  size_t bestCount = 0;
+  for(size_t i = 0; i < allPlatforms.size(); i++) {
+    std::vector<cl::Device> devices;
+    allPlatforms[i].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+    if(devices.size() > bestCount) {
+      best = i;
+      bestCount = devices.size();
+    }
+  }
+
+  cl::Platform platform = allPlatforms[best];
+  std::cout << "Using platform: "
+            << platform.getInfo<CL_PLATFORM_NAME>() << "\n";
+
+  return platform;
+}
+
+std::vector<cl::Device> getAllDevices(const cl::Platform &platform) {
+  std::vector<cl::Device> allDevices;
+  platform.getDevices(CL_DEVICE_TYPE_ALL, &allDevices);
+  if(allDevices.size() == 0) {
+    std::cout << " No devices found. Check OpenCL installation!\n";
+    std::exit(1);
+  }
+
+  for(const cl::Device &device : allDevices) {
+    std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+  }
+
+  return allDevices;
+}
+
 void printVerboseClInfo(const cl::Platform &platform, const cl::Device &device) {
   cl::size_type maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
   std::vector<cl::size_type> maxWorkItemSizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
@@ -61,4 +107,105 @@ std::string getKernelFunc(const std::string &fileName, const std::filesystem::pa
                   std::istreambuf_iterator<char>{}};
 
   return tmp;
-}
\ No newline at end of file
+}
+
+std::string programCacheKey(const std::vector<cl::Device> &devices, const std::string &options, const std::string &source) {
+  // 64-bit FNV-1a over everything that affects the compiled binary
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+  auto add = [&hash](const std::string &str) {
+    for(unsigned char c : str) {
+      hash ^= c;
+      hash *= 0x100000001b3ULL;
+    }
+    hash ^= 0xff;  // separator, so ("ab", "c") and ("a", "bc") differ
+    hash *= 0x100000001b3ULL;
+  };
+
+  for(const cl::Device &device : devices) {
+    add(device.getInfo<CL_DEVICE_NAME>());
+    add(device.getInfo<CL_DEVICE_VERSION>());
+    add(device.getInfo<CL_DRIVER_VERSION>());
+  }
+  add(options);
+  add(source);
+
+  std::stringstream key;
+  key << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return key.str();
+}
+
+bool loadCachedProgram(const cl::Context &context, const std::vector<cl::Device> &devices, const std::filesystem::path &cacheFile,
+                       const std::string &options, cl::Program &program) {
+  std::ifstream in(cacheFile, std::ios::binary);
+  if(!in) return false;
+
+  // One binary per device, each prefixed with its size
+  cl::Program::Binaries binaries(devices.size());
+  for(std::vector<unsigned char> &binary : binaries) {
+    std::uint64_t size = 0;
+    in.read(reinterpret_cast<char *>(&size), sizeof(size));
+    if(!in || size == 0) return false;
+
+    binary.resize(size);
+    in.read(reinterpret_cast<char *>(binary.data()), size);
+    if(!in) return false;
+  }
+
+  // A stale or corrupt binary is not an error, fall back to building from source
+  try {
+    std::vector<cl_int> binaryStatus{};
+    cl_int err = CL_SUCCESS;
+    cl::Program cached(context, devices, binaries, &binaryStatus, &err);
+    if(err != CL_SUCCESS || binaryStatus.size() != devices.size()) return false;
+    for(cl_int status : binaryStatus) {
+      if(status != CL_SUCCESS) return false;
+    }
+    if(cached.build(devices, options.c_str()) != CL_SUCCESS) return false;
+
+    program = cached;
+  } catch(const std::exception &) {
+    return false;
+  }
+
+  return true;
+}
+
+void saveCachedProgram(const cl::Program &program, const std::filesystem::path &cacheFile) {
+  try {
+    cl::Program::Binaries binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+    if(binaries.empty()) return;
+    for(const std::vector<unsigned char> &binary : binaries) {
+      if(binary.empty()) return;
+    }
+
+    std::filesystem::create_directories(cacheFile.parent_path());
+
+    // Write to a temporary file first, so a concurrent run never reads half a binary.
+    // Each run gets its own temporary file, so concurrent writers do not interleave.
+    std::filesystem::path tmpFile = cacheFile;
+    std::random_device random{};
+    std::ostringstream suffix{};
+    suffix << ".tmp." << std::hex << random() << random();
+    tmpFile += suffix.str();
+
+    bool written = false;
+    {
+      std::ofstream out(tmpFile, std::ios::binary);
+      if(!out) return;
+      for(const std::vector<unsigned char> &binary : binaries) {
+        std::uint64_t size = binary.size();
+        out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        out.write(reinterpret_cast<const char *>(binary.data()), binary.size());
+      }
+      written = static_cast<bool>(out);
+    }
+
+    if(!written) {
+      std::filesystem::remove(tmpFile);
+      return;
+    }
+    std::filesystem::rename(tmpFile, cacheFile);
+  } catch(const std::exception &) {
+    // The cache is only an optimization, a read-only install dir is fine
+  }
+}
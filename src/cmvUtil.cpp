@@ -1,8 +1,10 @@
 #include "bachUtil.h"
 #include "mathUtil.h"
+#include <algorithm>
+#include <iostream>
 
 void initFillStamps(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis, const cl::Buffer& tImgBuf, const cl::Buffer& sImgBuf,
-                    const Kernel& k, ClData& clData, ClStampsData& stampData, const Arguments& args) {
+                    const Kernel& k, ClData& clData, ClStampsData& stampData, const Arguments& args, const std::vector<cl::Event> &waitEvents) {
   clData.wColumns = args.fSStampWidth * args.fSStampWidth;
   clData.wRows = args.nPSF + triNum(args.backgroundOrder + 1);
   clData.qCount = args.nPSF + 2;
@@ -13,119 +15,107 @@ void initFillStamps(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int>
   stampData.q = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * clData.qCount * clData.qCount * stamps.size());
   stampData.b = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_double) * clData.bCount * stamps.size());
 
-  // TEMP: initialize vectors for W, Q and B
-  for (Stamp &stamp : stamps) {
-    stamp.W = std::vector<std::vector<double>>(clData.wRows, std::vector<double>(clData.wColumns));
-    stamp.Q = std::vector<std::vector<double>>(clData.qCount, std::vector<double>(clData.qCount));
-    stamp.B = std::vector<double>(clData.bCount);
+  // Host copies of W, Q and B are only kept for debugging
+  if (args.dumpStamps) {
+    for (Stamp &stamp : stamps) {
+      stamp.W = Matrix<double>(clData.wRows, clData.wColumns);
+      stamp.Q = Matrix<double>(clData.qCount, clData.qCount);
+      stamp.B = std::vector<double>(clData.bCount);
+    }
   }
   
-  fillStamps(stamps, axis, tImgBuf, sImgBuf, 0, stamps.size(), k, clData, stampData, args);
+  fillStamps(stamps, axis, tImgBuf, sImgBuf, 0, stamps.size(), k, clData, stampData, args, waitEvents);
 }
 
 void fillStamps(std::vector<Stamp>& stamps, const std::pair<cl_int, cl_int> &axis, const cl::Buffer& tImgBuf, const cl::Buffer& sImgBuf,
-               int stampOffset, int stampCount, const Kernel& k, const ClData& clData, const ClStampsData& stampData, const Arguments& args) {
+               int stampOffset, int stampCount, const Kernel& k, const ClData& clData, const ClStampsData& stampData, const Arguments& args,
+               const std::vector<cl::Event> &waitEvents) {
   /* Fills Substamp with gaussian basis convolved images around said substamp
    * and calculates CMV.
    */
 
-  // Convolve stamps on Y
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
-                    cl_int, cl_int, cl_int, cl_int, cl_int>
-                    yConvFunc(clData.program, "convStampY");
-  cl::EnqueueArgs yConvEargs(clData.queue, cl::NDRange(0, 0, stampOffset), cl::NDRange((2 * (args.hSStampWidth + args.hKernelWidth) + 1) * (2 * args.hSStampWidth + 1), clData.gaussCount, stampCount), cl::NullRange);
-  cl::Event yConvEvent = yConvFunc(yConvEargs, tImgBuf, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts, clData.kernel.filterY, clData.cmv.yConvTmp,
-                                   args.fKernelWidth, args.fSStampWidth, axis.first, clData.gaussCount, 2 * args.maxKSStamps);
-
-  yConvEvent.wait();
-
-  // Convolve stamps on X
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer,
-                    cl_int, cl_int, cl_int, cl_int, cl_int>
-                    xConvFunc(clData.program, "convStampX");
-  cl::EnqueueArgs xConvEargs(clData.queue, cl::NDRange(0, 0, stampOffset), cl::NDRange(args.fSStampWidth * args.fSStampWidth, clData.gaussCount, stampCount), cl::NullRange);
-  cl::Event xConvEvent = xConvFunc(xConvEargs, clData.cmv.yConvTmp, clData.kernel.filterX, stampData.w,
-                                   args.fKernelWidth, args.fSStampWidth, clData.wRows, clData.wColumns, clData.gaussCount);
-
-  xConvEvent.wait();
-
-  // Subtract for odd
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int> oddConvFunc(clData.program, "convStampOdd");
-  cl::EnqueueArgs oddConvEargs(clData.queue, cl::NDRange(0, 1, stampOffset), cl::NDRange(args.fSStampWidth * args.fSStampWidth, clData.gaussCount - 1, stampCount), cl::NullRange);
-  cl::Event oddConvEvent = oddConvFunc(oddConvEargs, clData.kernel.xy, stampData.w,
-                                       clData.wRows, clData.wColumns);
-
-  oddConvEvent.wait();
+  // Convolve the substamps with the gaussian bases
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int,
+                    cl::LocalSpaceArg, cl::LocalSpaceArg, cl_int, cl_int>
+                    convFunc(clData.program, "convStamp");
+
+  static constexpr size_t maxConvLocalSize = 256;
+  size_t convLocalSize = std::min(maxConvLocalSize, convFunc.getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clData.device));
+  int winWidth = args.fSStampWidth + args.fKernelWidth - 1;
+
+  // The window stays in local memory only if it leaves room for at least one
+  // row of the Y pass, tmp then takes as many rows as fit
+  size_t localMem = clData.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  size_t windowBytes = sizeof(cl_float) * winWidth * winWidth;
+  size_t tmpRowBytes = sizeof(cl_float) * winWidth;
+  if(tmpRowBytes > localMem) {
+    std::cout << "Cannot convolve substamps of width " << args.fSStampWidth << " in local memory" << std::endl;
+    std::exit(1);
+  }
+  cl_int windowResident = windowBytes + tmpRowBytes <= localMem;
+  size_t tmpBytes = localMem - (windowResident ? windowBytes : 0);
+  cl_int tmpRows = std::min<size_t>(args.fSStampWidth, tmpBytes / tmpRowBytes);
+
+  cl::EnqueueArgs convEargs(clData.queue, waitEvents, cl::NDRange(0, stampOffset), cl::NDRange(convLocalSize, stampCount), cl::NDRange(convLocalSize, 1));
+  cl::Event convEvent = convFunc(convEargs, tImgBuf, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts,
+                                 clData.kernel.xy, clData.kernel.filterX, clData.kernel.filterY, stampData.w,
+                                 args.fKernelWidth, args.fSStampWidth, axis.first, clData.gaussCount, 2 * args.maxKSStamps,
+                                 clData.wRows, clData.wColumns,
+                                 cl::Local(windowResident ? windowBytes : sizeof(cl_float)),
+                                 cl::Local(tmpRowBytes * tmpRows),
+                                 windowResident, tmpRows);
+  clData.profiler.record("convStamp", convEvent);
 
   // Compute background
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int>
                     bgConvFunc(clData.program, "convStampBg");
-  cl::EnqueueArgs bgConvEargs(clData.queue, cl::NDRange(0, 0, stampOffset), cl::NDRange(clData.wColumns, clData.wRows - clData.gaussCount, stampCount), cl::NullRange);
+  cl::EnqueueArgs bgConvEargs(clData.queue, convEvent, cl::NDRange(0, 0, stampOffset), cl::NDRange(clData.wColumns, clData.wRows - clData.gaussCount, stampCount), cl::NullRange);
   cl::Event bgConvEvent = bgConvFunc(bgConvEargs, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts, clData.bg.xy, stampData.w,
                                      axis.first, axis.second, args.fSStampWidth,
                                      clData.wRows, clData.wColumns, clData.gaussCount, 2 * args.maxKSStamps);
-
-  bgConvEvent.wait();
-
-  // TEMP: move back w to CPU
-  std::vector<cl_double> wGpu(clData.wRows * clData.wColumns * stampCount);
-  clData.queue.enqueueReadBuffer(stampData.w, CL_TRUE, sizeof(cl_double) * stampOffset * clData.wRows * clData.wColumns, sizeof(cl_double) * wGpu.size(), wGpu.data());
-  
-  // TEMP: replace w with GPU data
-  for (int i = 0; i < stampCount; i++) {
-    Stamp& s = stamps[stampOffset + i];
-
-    for (int j = 0; j < clData.wRows; j++) {
-      for (int k = 0; k < clData.wColumns; k++) {
-        s.W[j][k] = wGpu[i * clData.wRows * clData.wColumns + j * clData.wColumns + k];
-      }
-    }
-  }
+  clData.profiler.record("convStampBg", bgConvEvent);
 
   // Create Q
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int>
                     qFunc(clData.program, "createQ");
-  cl::EnqueueArgs qEargs(clData.queue, cl::NDRange(0, 0, stampOffset), cl::NDRange(clData.qCount, clData.qCount, stampCount), cl::NullRange);
+  cl::EnqueueArgs qEargs(clData.queue, bgConvEvent, cl::NDRange(0, 0, stampOffset), cl::NDRange(clData.qCount, clData.qCount, stampCount), cl::NullRange);
   cl::Event qEvent = qFunc(qEargs, stampData.w, stampData.q, clData.wRows, clData.wColumns,
                            clData.qCount, clData.qCount, args.fSStampWidth);
+  clData.profiler.record("createQ", qEvent);
 
   // Create B
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl_int, cl_int, cl_int, cl_int, cl_int, cl_int>
                     bFunc(clData.program, "createB");
-  cl::EnqueueArgs bEargs(clData.queue, cl::NDRange(0, stampOffset), cl::NDRange(clData.bCount, stampCount), cl::NullRange);
+  cl::EnqueueArgs bEargs(clData.queue, bgConvEvent, cl::NDRange(0, stampOffset), cl::NDRange(clData.bCount, stampCount), cl::NullRange);
   cl::Event bEvent = bFunc(bEargs, stampData.subStampCoords, stampData.currentSubStamps, stampData.subStampCounts, sImgBuf,
                            stampData.w, stampData.b, clData.wRows, clData.wColumns, clData.bCount,
                            args.fSStampWidth, 2 * args.maxKSStamps, axis.first);
+  clData.profiler.record("createB", bEvent);
 
-  qEvent.wait();
-  bEvent.wait();
+  if (!args.dumpStamps) return;
 
-  // TEMP: transfer the data back to the CPU
+  // Debug dump, W is read while Q and B are computed
+  std::vector<cl_double> wGpu(clData.wRows * clData.wColumns * stampCount);
   std::vector<cl_double> gpuQ(clData.qCount * clData.qCount * stampCount);
   std::vector<cl_double> gpuB(clData.bCount * stampCount);
 
-  clData.queue.enqueueReadBuffer(stampData.q, CL_TRUE, sizeof(cl_double) * stampOffset * clData.qCount * clData.qCount, sizeof(cl_double) * gpuQ.size(), gpuQ.data());
-  clData.queue.enqueueReadBuffer(stampData.b, CL_TRUE, sizeof(cl_double) * stampOffset * clData.bCount, sizeof(cl_double) * gpuB.size(), gpuB.data());
+  std::vector<cl::Event> wWaitEvents{bgConvEvent};
+  std::vector<cl::Event> qWaitEvents{qEvent};
+  std::vector<cl::Event> bWaitEvents{bEvent};
+  std::vector<cl::Event> readEvents(3);
+  clData.queue.enqueueReadBuffer(stampData.w, CL_FALSE, sizeof(cl_double) * stampOffset * clData.wRows * clData.wColumns, sizeof(cl_double) * wGpu.size(), wGpu.data(), &wWaitEvents, &readEvents[0]);
+  clData.queue.enqueueReadBuffer(stampData.q, CL_FALSE, sizeof(cl_double) * stampOffset * clData.qCount * clData.qCount, sizeof(cl_double) * gpuQ.size(), gpuQ.data(), &qWaitEvents, &readEvents[1]);
+  clData.queue.enqueueReadBuffer(stampData.b, CL_FALSE, sizeof(cl_double) * stampOffset * clData.bCount, sizeof(cl_double) * gpuB.size(), gpuB.data(), &bWaitEvents, &readEvents[2]);
+  cl::Event::waitForEvents(readEvents);
 
-  // TEMP: put data back in Q
   for (int i = 0; i < stampCount; i++) {
     Stamp &s = stamps[stampOffset + i];
-    
-    for (int j = 0; j < clData.qCount; j++) {
-      for (int k = 0; k < clData.qCount; k++) {
-        s.Q[j][k] = gpuQ[i * clData.qCount * clData.qCount + j * clData.qCount + k];
-      }
-    }
-  }
 
-  // TEMP: put data back in B
-  for (int i = 0; i < stampCount; i++) {
-    Stamp &s = stamps[stampOffset + i];
-
-    for (int j = 0; j < clData.bCount; j++) {
-      s.B[j] = gpuB[i * clData.bCount + j];
-    }
+    std::copy_n(wGpu.begin() + i * s.W.size(), s.W.size(), s.W.data());
+    std::copy_n(gpuQ.begin() + i * s.Q.size(), s.Q.size(), s.Q.data());
+    std::copy_n(gpuB.begin() + i * s.B.size(), s.B.size(), s.B.begin());
   }
 }
@@ -0,0 +1,850 @@
+#include <array>
+#include <bit>
+#include <limits>
+#include <memory>
+#include <valarray>
+
+#include "bachUtil.h"
+#include "fitsUtil.h"
+#include "mathUtil.h"
+
+cl::Event enqueueConv(cl::CommandQueue &queue, const std::vector<cl::Event> &waitEvents, const cl::Buffer &kernBuf, int xSteps, int firstYStep,
+                      const cl::Buffer &img, const cl::Buffer &outImg, const cl::Buffer &convMask, const cl::Buffer &outMask,
+                      const std::pair<cl_int, cl_int> &imgSize, int rowOffset, int imgRowOffset, int rowStart, int rowEnd, double invKernMult,
+                      const ClData& clData, const Arguments& args, const std::optional<FusedSub> &fused) {
+  /* Uses the tiled kernel when a tile and its apron fit in local memory of
+   * the device, otherwise the one pixel per work-item kernel. With fused the
+   * kernel also applies maskAfterConv and sub. outImg, convMask and
+   * fused.diffImg hold the rows from rowOffset on, img, outMask and
+   * fused.sImg the rows from imgRowOffset on.
+   */
+  static constexpr int tileSize = 16;
+
+  const auto [w, h] = imgSize;
+  const int nBgComp = (args.nPSF - 1) * triNum(args.kernelOrder + 1) + 1;
+  const int apronSize = tileSize + 2 * args.hKernelWidth;
+  const size_t tileBytes = apronSize * apronSize * (realSize(args) + sizeof(cl_ushort));
+
+  // Without fused the sub arguments are not read, any buffer will do
+  const cl::Buffer &sciImg = fused ? fused->sImg : img;
+  const cl::Buffer &diffImg = fused ? fused->diffImg : outImg;
+  const cl_int fuseSub = fused.has_value();
+  const cl_int writeConv = !fused || fused->writeConv;
+  const double convFactor = fused ? fused->convFactor : 1.0;
+  const double finalFactor = fused ? fused->finalFactor : 1.0;
+
+  cl::KernelFunctor<cl::Buffer, cl_int, cl_int, cl_int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl::LocalSpaceArg, cl::LocalSpaceArg, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_double,
+                    cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double, cl_double, cl_double>
+      convTiledFunc(clData.program, "convTiled");
+
+  cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+  bool tiled = tileBytes <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() &&
+               tileSize * tileSize <= convTiledFunc.getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+
+  cl::Event convEvent{};
+  if(tiled) {
+    cl::EnqueueArgs eargs(queue, waitEvents, cl::NDRange(0, rowStart),
+                          cl::NDRange(roundUpToMultiple(w, tileSize), roundUpToMultiple(rowEnd - rowStart, tileSize)),
+                          cl::NDRange(tileSize, tileSize));
+    convEvent = convTiledFunc(eargs, kernBuf, args.fKernelWidth, xSteps, firstYStep, img, outImg, convMask, outMask, clData.kernel.solution,
+                              cl::Local(apronSize * apronSize * realSize(args)), cl::Local(apronSize * apronSize * sizeof(cl_ushort)),
+                              w, h, rowOffset, imgRowOffset, rowEnd, args.backgroundOrder, nBgComp, invKernMult,
+                              sciImg, diffImg, fuseSub, writeConv, args.threshHigh, args.threshLow, convFactor, finalFactor);
+  }
+  else {
+    cl::KernelFunctor<cl::Buffer, cl_int, cl_int, cl_int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                      cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_double,
+                      cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double, cl_double, cl_double> convFunc(clData.program, "conv");
+    cl::EnqueueArgs eargs(queue, waitEvents, cl::NDRange(w * rowStart), cl::NDRange(w * (rowEnd - rowStart)), cl::NullRange);
+    convEvent = convFunc(eargs, kernBuf, args.fKernelWidth, xSteps, firstYStep, img, outImg, convMask, outMask, clData.kernel.solution,
+                         w, h, rowOffset, imgRowOffset, args.backgroundOrder, nBgComp, invKernMult,
+                         sciImg, diffImg, fuseSub, writeConv, args.threshHigh, args.threshLow, convFactor, finalFactor);
+  }
+  clData.profiler.record(tiled ? "convTiled" : "conv", convEvent);
+
+  return convEvent;
+}
+
+void finishConv(const cl::Event &finalEvent, const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, bool maskAfter,
+                const std::vector<cl::Event> &hostEvents, const ClData& clData, const Arguments& args) {
+  /* Common end of the whole-frame convolutions. Transfers the convolved image
+   * back to CPU when it is written and masks after convolve, unless a fused
+   * kernel already did. Returns once convImg is filled and the hostEvents, the
+   * uploads from host memory owned by the caller, are done.
+   */
+  const auto [w, h] = imgSize;
+
+  std::vector<cl::Event> readWaitEvents{finalEvent};
+  cl::Event readEvent = finalEvent;
+  if(args.outConv) {
+    readEvent = readFloatBuffer(clData.queue, clData.convImg, 0, w * h, &convImg, clData, args, readWaitEvents);
+  }
+
+  if(maskAfter) {
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_double, cl_double> maskAfterFunc(clData.program, "maskAfterConv");
+    cl::EnqueueArgs maskAfterEargs(clData.queue, finalEvent, cl::NDRange(w, h));
+    cl::Event maskAfterEvent = maskAfterFunc(maskAfterEargs, clData.sImgBuf, clData.maskBuf, w, args.threshHigh, args.threshLow);
+    clData.profiler.record("maskAfterConv", maskAfterEvent);
+  }
+
+  readEvent.wait();
+  cl::Event::waitForEvents(hostEvents);
+}
+
+void convBasis(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, const std::vector<double> &centerKernel, double invKernMult,
+               ClData& clData, const Arguments& args) {
+  /* Convolves the image once with every separable kernel basis and sums the
+   * results weighted with the kernel coefficients of each pixel, instead of
+   * applying a full kernel per fKernelWidth tile.
+   */
+  static constexpr int localSize = 16;
+
+  const auto [w, h] = imgSize;
+  const cl::NDRange global(roundUpToMultiple(w, localSize), roundUpToMultiple(h, localSize));
+  const cl::NDRange local(localSize, localSize);
+
+  cl::Buffer convMaskBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * w * h);
+  cl::Buffer centerKernBuf(clData.context, CL_MEM_READ_ONLY, realSize(args) * centerKernel.size());
+  cl::Buffer tmpBuf(clData.context, CL_MEM_READ_WRITE, realSize(args) * w * h);
+  cl::Buffer basis0Buf(clData.context, CL_MEM_READ_WRITE, realSize(args) * w * h);
+  clData.convImg = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * w * h);
+
+  std::vector<cl::Event> writeEvents(2);
+  writeEvents[0] = writeRealBuffer(clData.queue, centerKernBuf, centerKernel.size(), centerKernel.data(), args);
+  writeEvents[1] = fillRealBuffer(clData.queue, clData.convImg, w * h, 0.0, args);
+
+  // Create convolution mask
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double> createMaskFunc(clData.program, "createConvMask");
+  cl::EnqueueArgs createMaskEargs(clData.queue, cl::NDRange(w, h));
+  cl::Event createMaskEvent = createMaskFunc(createMaskEargs, clData.tImgBuf, convMaskBuf, w, 0, args.threshHigh, args.threshLow);
+  clData.profiler.record("createConvMask", createMaskEvent);
+
+  // Convolve with each basis, the passes share tmpBuf so they run one after another
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int> yFunc(clData.program, "convBasisY");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl_int, cl_int, cl_int, cl_int, cl_int, cl_int> xFunc(clData.program, "convBasisX");
+
+  cl::Event basisEvent = writeEvents[1];
+  for(int n = 0; n < args.nPSF; n++) {
+    cl::EnqueueArgs yEargs(clData.queue, basisEvent, global, local);
+    cl::Event yEvent = yFunc(yEargs, clData.tImgBuf, clData.kernel.filterY, tmpBuf, n, args.fKernelWidth, w, h);
+    clData.profiler.record("convBasisY", yEvent);
+
+    cl::EnqueueArgs xEargs(clData.queue, yEvent, global, local);
+    basisEvent = xFunc(xEargs, tmpBuf, clData.kernel.filterX, clData.kernel.xy, clData.kernel.solution, basis0Buf, clData.convImg,
+                       n, args.fKernelWidth, w, h, args.kernelOrder, triNum(args.kernelOrder + 1));
+    clData.profiler.record("convBasisX", basisEvent);
+  }
+
+  // Add basis 0 and background, create the output mask
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl_int, cl_int, cl_int, cl_int, cl_double> finalFunc(clData.program, "convBasisFinal");
+  std::vector<cl::Event> finalWaitEvents{basisEvent, createMaskEvent, writeEvents[0]};
+  cl::EnqueueArgs finalEargs(clData.queue, finalWaitEvents, global, local);
+  cl::Event finalEvent = finalFunc(finalEargs, basis0Buf, clData.convImg, centerKernBuf, args.fKernelWidth, convMaskBuf, clData.maskBuf,
+                                   clData.kernel.solution, w, h, args.backgroundOrder,
+                                   (args.nPSF - 1) * triNum(args.kernelOrder + 1) + 1, invKernMult);
+  clData.profiler.record("convBasisFinal", finalEvent);
+
+  // centerKernel is owned by the caller
+  finishConv(finalEvent, imgSize, convImg, true, {writeEvents[0]}, clData, args);
+}
+
+// Cost model of the overlap-save FFT convolution in flops. A 2D transform is
+// a row and a column pass of 5 n log2 n flops per row of n. The transpose,
+// block load and accumulate passes only move data, each is charged
+// fftMemPassFlops per complex element.
+static constexpr double fftMemPassFlops = 2.0;
+// The FFT kernels reach a lower fraction of peak than conv, so auto mode
+// only takes the FFT when it is estimated well below the direct convolution
+static constexpr double fftAutoMargin = 0.47;
+
+static constexpr double fftConvFlops(int w, int h, int convWidth, int monomials, int logN) {
+  const int n = 1 << logN;
+  const int outSize = n - convWidth + 1;
+  const double n2 = double(n) * n;
+  const double blocks = double((w + outSize - 1) / outSize) * ((h + outSize - 1) / outSize);
+  const double fft2d = 10.0 * n2 * logN + fftMemPassFlops * n2;
+
+  // Load and forward transform of each block, then per monomial a complex
+  // multiply, inverse transform and accumulate, plus the kernel spectra
+  return blocks * (fftMemPassFlops * n2 + (monomials + 1) * fft2d + monomials * (8.0 + fftMemPassFlops) * n2) +
+         monomials * fft2d;
+}
+
+static constexpr double directConvFlops(int w, int h, int convWidth) {
+  return 2.0 * convWidth * convWidth * double(w) * h;
+}
+
+static constexpr int bestFftLogSize(int w, int h, int convWidth, int monomials, int maxLogN) {
+  // Returns the log2 of the cheapest block size, 0 when no block fits the kernel
+  int bestLogN = 0;
+  for(int logN = 6; logN <= maxLogN; logN++) {
+    int outSize = (1 << logN) - convWidth + 1;
+    if(outSize < convWidth) continue;
+    if(bestLogN == 0 || fftConvFlops(w, h, convWidth, monomials, logN) < fftConvFlops(w, h, convWidth, monomials, bestLogN)) {
+      bestLogN = logN;
+    }
+  }
+  return bestLogN;
+}
+
+static constexpr bool fftAutoSelected(int w, int h, int hKernelWidth, int kernelOrder, int maxLogN) {
+  const int convWidth = 2 * hKernelWidth + 1;
+  const int monomials = (kernelOrder + 1) * (kernelOrder + 2) / 2;
+  const int logN = bestFftLogSize(w, h, convWidth, monomials, maxLogN);
+  return logN > 0 && fftConvFlops(w, h, convWidth, monomials, logN) <= fftAutoMargin * directConvFlops(w, h, convWidth);
+}
+
+// Auto mode keeps the direct convolution for the default -kw 10 and
+// kernelOrder 2 and only switches to the FFT for wide kernels, on devices
+// that allow blocks of 512 or 1024
+static constexpr bool fftAutoSelectedFrom(int hKernelWidth, int maxLogN) {
+  bool ok = true;
+  for(int hk = 1; hk < hKernelWidth; hk++) {
+    for(int size : {2048, 4096, 8192, 10000}) {
+      ok = ok && !fftAutoSelected(size, size, hk, 2, maxLogN);
+    }
+  }
+  for(int hk = hKernelWidth; hk <= 20; hk++) {
+    for(int size : {4096, 8192, 10000}) {
+      ok = ok && fftAutoSelected(size, size, hk, 2, maxLogN);
+    }
+    ok = ok && (hk == hKernelWidth || fftAutoSelected(2048, 2048, hk, 2, maxLogN));
+  }
+  return ok;
+}
+static_assert(!fftAutoSelected(2048, 2048, 10, 2, 10) && !fftAutoSelected(4096, 4096, 10, 2, 10) &&
+              !fftAutoSelected(10000, 10000, 10, 2, 10));
+static_assert(fftAutoSelectedFrom(15, 9) && fftAutoSelectedFrom(15, 10));
+
+int chooseFftSize(const std::pair<cl_int, cl_int> &imgSize, const ClData& clData, const Arguments& args) {
+  /* Returns the block size of the FFT convolution, or 0 when the direct
+   * convolution should be used. The block size with the lowest estimated
+   * cost is taken; in auto mode the FFT is only used when that cost is well
+   * below the cost of the direct convolution.
+   */
+  if(args.convMethod == "direct") return 0;
+  if(args.convMethod == "auto" && clData.deviceQueues.size() > 1) return 0;
+
+  const auto [w, h] = imgSize;
+  const int monomials = triNum(args.kernelOrder + 1);
+
+  cl::KernelFunctor<cl::Buffer, cl::LocalSpaceArg, cl_int, cl_int> rowsFunc(clData.program, "fftRows");
+  size_t maxGroup = rowsFunc.getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clData.device);
+  cl_ulong localMem = clData.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+  // Largest block the fftRows work-group and its local buffer allow
+  int maxLogN = 5;
+  while(maxLogN < 10 && size_t(1) << maxLogN <= maxGroup && (size_t(2) << maxLogN) * sizeof(cl_double2) <= localMem) {
+    maxLogN++;
+  }
+
+  int bestLogN = bestFftLogSize(w, h, args.fKernelWidth, monomials, maxLogN);
+  if(bestLogN == 0) {
+    if(args.convMethod == "fft") {
+      std::cout << "FFT convolution not supported by the device, using direct convolution" << std::endl;
+    }
+    return 0;
+  }
+
+  if(args.convMethod == "auto" &&
+     fftConvFlops(w, h, args.fKernelWidth, monomials, bestLogN) > fftAutoMargin * directConvFlops(w, h, args.fKernelWidth)) {
+    return 0;
+  }
+
+  int bestSize = 1 << bestLogN;
+  if(args.verbose) {
+    std::cout << "FFT convolution with " << bestSize << "x" << bestSize << " blocks" << std::endl;
+  }
+
+  return bestSize;
+}
+
+void convFft(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, const Kernel &convolutionKernel,
+             const std::vector<cl_double> &convKernels, int xSteps, int fftSize, double invKernMult,
+             ClData& clData, const Arguments& args) {
+  /* Overlap-save convolution. The kernel of a tile is a polynomial in the
+   * tile position, so the image is convolved with one kernel per monomial
+   * and the results are summed weighted with the monomial at the tile.
+   */
+  static constexpr size_t maxBatchBytes = size_t(256) << 20;
+
+  const auto [w, h] = imgSize;
+  const int n = fftSize;
+  const int logN = std::countr_zero(unsigned(n));
+  const int convWidth = args.fKernelWidth;
+  const int outSize = n - convWidth + 1;
+  const int blocksX = (w + outSize - 1) / outSize;
+  const int blocksY = (h + outSize - 1) / outSize;
+  const int monomials = triNum(args.kernelOrder + 1);
+  const size_t blockBytes = sizeof(cl_double2) * n * n;
+
+  const int batchRows = std::clamp(int(std::min<cl_ulong>(maxBatchBytes, clData.device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) /
+                                       (blockBytes * blocksX)), 1, blocksY);
+  const int batchBlocks = batchRows * blocksX;
+
+  // Kernel of every monomial, zero padded to the block size
+  std::vector<cl_double2> kernBlocks(size_t(monomials) * n * n, cl_double2{});
+  for(int m = 0; m < monomials; m++) {
+    for(int v = 0; v < convWidth; v++) {
+      for(int u = 0; u < convWidth; u++) {
+        double k = m == 0 ? convolutionKernel.solution[1] * convolutionKernel.kernVec[0][u + v * convWidth] : 0.0;
+        for(int psf = 1; psf < args.nPSF; psf++) {
+          k += convolutionKernel.solution[2 + (psf - 1) * monomials + m] * convolutionKernel.kernVec[psf][u + v * convWidth];
+        }
+        kernBlocks[size_t(m) * n * n + u + v * n].s[0] = k;
+      }
+    }
+  }
+
+  cl::Buffer kernSpecBuf(clData.context, CL_MEM_READ_WRITE, blockBytes * monomials);
+  cl::Buffer blocksA(clData.context, CL_MEM_READ_WRITE, blockBytes * std::max(batchBlocks, monomials));
+  cl::Buffer blocksB(clData.context, CL_MEM_READ_WRITE, blockBytes * batchBlocks);
+  cl::Buffer blocksC(clData.context, CL_MEM_READ_WRITE, blockBytes * batchBlocks);
+  cl::Buffer kernBuf(clData.context, CL_MEM_READ_ONLY, realSize(args) * convKernels.size());
+  cl::Buffer convMaskBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * w * h);
+  cl::Buffer rowMaskBuf(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * w * h);
+  clData.convImg = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * w * h);
+
+  std::vector<cl::Event> writeEvents(3);
+  clData.queue.enqueueWriteBuffer(blocksA, CL_FALSE, 0, blockBytes * monomials, kernBlocks.data(), nullptr, &writeEvents[0]);
+  writeEvents[1] = writeRealBuffer(clData.queue, kernBuf, convKernels.size(), convKernels.data(), args);
+  writeEvents[2] = fillRealBuffer(clData.queue, clData.convImg, w * h, 0.0, args);
+
+  cl::KernelFunctor<cl::Buffer, cl::LocalSpaceArg, cl_int, cl_int> rowsFunc(clData.program, "fftRows");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int> transposeFunc(clData.program, "fftTranspose");
+
+  // 2D transform of count blocks, the result is transposed. The inverse takes
+  // transposed input and returns the normal layout.
+  auto fft2d = [&](const cl::Buffer &in, const cl::Buffer &out, int count, bool inverse, const cl::Event &waitEvent) {
+    cl::EnqueueArgs rowsEargs(clData.queue, waitEvent, cl::NDRange(size_t(count) * n * n / 2), cl::NDRange(n / 2));
+    cl::Event rowsEvent = rowsFunc(rowsEargs, in, cl::Local(n * sizeof(cl_double2)), logN, inverse);
+    clData.profiler.record("fftRows", rowsEvent);
+
+    cl::EnqueueArgs transposeEargs(clData.queue, rowsEvent, cl::NDRange(n, n, count));
+    cl::Event transposeEvent = transposeFunc(transposeEargs, in, out, n);
+    clData.profiler.record("fftTranspose", transposeEvent);
+
+    cl::EnqueueArgs colsEargs(clData.queue, transposeEvent, cl::NDRange(size_t(count) * n * n / 2), cl::NDRange(n / 2));
+    cl::Event colsEvent = rowsFunc(colsEargs, out, cl::Local(n * sizeof(cl_double2)), logN, inverse);
+    clData.profiler.record("fftRows", colsEvent);
+
+    return colsEvent;
+  };
+
+  // Kernel spectra
+  cl::Event fftEvent = fft2d(blocksA, kernSpecBuf, monomials, false, writeEvents[0]);
+
+  // Create convolution mask and its row-wise dilation for convFftFinal
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double> createMaskFunc(clData.program, "createConvMask");
+  cl::EnqueueArgs createMaskEargs(clData.queue, cl::NDRange(w, h));
+  cl::Event createMaskEvent = createMaskFunc(createMaskEargs, clData.tImgBuf, convMaskBuf, w, 0, args.threshHigh, args.threshLow);
+  clData.profiler.record("createConvMask", createMaskEvent);
+
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int> dilateFunc(clData.program, "dilateMaskRows");
+  cl::EnqueueArgs dilateEargs(clData.queue, createMaskEvent, cl::NDRange(w, h));
+  cl::Event dilateEvent = dilateFunc(dilateEargs, convMaskBuf, rowMaskBuf, convWidth, w, h);
+  clData.profiler.record("dilateMaskRows", dilateEvent);
+
+  // Convolve the blocks batchRows rows of blocks at a time
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int> loadFunc(clData.program, "fftLoadBlocks");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int> multiplyFunc(clData.program, "fftMultiply");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_int, cl_double>
+      accumulateFunc(clData.program, "fftAccumulate");
+
+  const double norm = 1.0 / (double(n) * n);
+  std::vector<cl::Event> loadWaitEvents{fftEvent, writeEvents[2]};
+  cl::Event batchEvent{};
+  clData.queue.enqueueMarkerWithWaitList(&loadWaitEvents, &batchEvent);
+
+  for(int firstRow = 0; firstRow < blocksY; firstRow += batchRows) {
+    const int count = std::min(batchRows, blocksY - firstRow) * blocksX;
+
+    cl::EnqueueArgs loadEargs(clData.queue, batchEvent, cl::NDRange(n, n, count));
+    cl::Event loadEvent = loadFunc(loadEargs, clData.tImgBuf, blocksA, n, convWidth, blocksX, firstRow, w, h);
+    clData.profiler.record("fftLoadBlocks", loadEvent);
+
+    cl::Event imgSpecEvent = fft2d(blocksA, blocksB, count, false, loadEvent);
+
+    int m = 0;
+    for(int iX = 0; iX <= args.kernelOrder; iX++) {
+      for(int iY = 0; iY <= args.kernelOrder - iX; iY++, m++) {
+        cl::EnqueueArgs multiplyEargs(clData.queue, imgSpecEvent, cl::NDRange(n, n, count));
+        cl::Event multiplyEvent = multiplyFunc(multiplyEargs, blocksB, kernSpecBuf, blocksA, m, n);
+        clData.profiler.record("fftMultiply", multiplyEvent);
+
+        cl::Event inverseEvent = fft2d(blocksA, blocksC, count, true, multiplyEvent);
+
+        cl::EnqueueArgs accumulateEargs(clData.queue, inverseEvent, cl::NDRange(n, n, count));
+        batchEvent = accumulateFunc(accumulateEargs, blocksC, clData.convImg, n, convWidth, blocksX, firstRow, w, h, iX, iY, norm);
+        clData.profiler.record("fftAccumulate", batchEvent);
+      }
+    }
+  }
+
+  // Add background and create the output mask
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+                    cl_int, cl_int, cl_int, cl_int, cl_int, cl_double> finalFunc(clData.program, "convFftFinal");
+  std::vector<cl::Event> finalWaitEvents{batchEvent, dilateEvent, writeEvents[1]};
+  cl::EnqueueArgs finalEargs(clData.queue, finalWaitEvents, cl::NDRange(w, h));
+  cl::Event finalEvent = finalFunc(finalEargs, clData.convImg, kernBuf, xSteps, convMaskBuf, rowMaskBuf, clData.maskBuf,
+                                   clData.kernel.solution, convWidth, w, h, args.backgroundOrder,
+                                   (args.nPSF - 1) * monomials + 1, invKernMult);
+  clData.profiler.record("convFftFinal", finalEvent);
+
+  if(args.verifyConv) {
+    // Direct convolution into scratch buffers for comparison
+    cl::Buffer directImg(clData.context, CL_MEM_WRITE_ONLY, realSize(args) * w * h);
+    cl::Buffer directMask(clData.context, CL_MEM_WRITE_ONLY, sizeof(cl_ushort) * w * h);
+    std::vector<cl::Event> directWaitEvents{createMaskEvent, writeEvents[1]};
+    cl::Event directEvent = enqueueConv(clData.queue, directWaitEvents, kernBuf, xSteps, 0, clData.tImgBuf, directImg, convMaskBuf, directMask,
+                                        imgSize, 0, 0, 0, h, invKernMult, clData, args);
+
+    // Both are compared before the conversion of the output to float
+    std::vector<cl_double> direct(size_t(w) * h);
+    std::vector<cl_double> fft(size_t(w) * h);
+    std::vector<cl::Event> directReadWaitEvents{directEvent};
+    readRealBuffer(clData.queue, directImg, 0, w * h, direct.data(), args, directReadWaitEvents).wait();
+    std::vector<cl::Event> fftReadWaitEvents{finalEvent};
+    readRealBuffer(clData.queue, clData.convImg, 0, w * h, fft.data(), args, fftReadWaitEvents).wait();
+
+    double maxDiff = 0.0;
+    double sumDiff2 = 0.0;
+    double sumRef2 = 0.0;
+    for(int y = args.hKernelWidth; y < h - args.hKernelWidth; y++) {
+      for(int x = args.hKernelWidth; x < w - args.hKernelWidth; x++) {
+        double diff = fft[x + y * w] - direct[x + y * w];
+        maxDiff = std::max(maxDiff, std::abs(diff));
+        sumDiff2 += diff * diff;
+        sumRef2 += direct[x + y * w] * direct[x + y * w];
+      }
+    }
+
+    std::cout << "FFT vs direct convolution: max abs diff " << maxDiff
+              << ", relative rms diff " << (sumRef2 > 0.0 ? std::sqrt(sumDiff2 / sumRef2) : 0.0) << std::endl;
+  }
+
+  // kernBlocks and convKernels are owned by this and the calling function
+  finishConv(finalEvent, imgSize, convImg, true, {writeEvents[0], writeEvents[1]}, clData, args);
+}
+
+void createRowBands(const std::pair<cl_int, cl_int> &imgSize, ClData& clData, const Arguments& args) {
+  /* Splits the image rows evenly over all devices. Each band also holds
+   * hKernelWidth rows above and below, so the convolution of the band rows
+   * only needs data local to the device.
+   */
+  const auto [w, h] = imgSize;
+  const int deviceCount = clData.deviceQueues.size();
+
+  clData.bands.clear();
+
+  for(int i = 0; i < deviceCount; i++) {
+    ClRowBand band{};
+    band.queue = clData.deviceQueues[i];
+    band.rowStart = h * i / deviceCount;
+    band.rowEnd = h * (i + 1) / deviceCount;
+    band.haloStart = std::max(band.rowStart - args.hKernelWidth, 0);
+    band.haloEnd = std::min(band.rowEnd + args.hKernelWidth, h);
+
+    int bandPixels = w * (band.haloEnd - band.haloStart);
+    band.tImg     = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * bandPixels);
+    band.sImg     = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * bandPixels);
+    band.convMask = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * bandPixels);
+    band.mask     = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * bandPixels);
+    band.convImg  = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * bandPixels);
+
+    if(args.verbose) {
+      std::cout << "Device " << i << " convolves rows " << band.rowStart
+                << "-" << band.rowEnd - 1 << std::endl;
+    }
+
+    clData.bands.push_back(band);
+  }
+}
+
+void convRowBands(const std::pair<cl_int, cl_int> &imgSize, OutputImage &convImg, const std::vector<cl_double> &convKernels, int xSteps,
+                  double invKernMult, double convFactor, double finalFactor, ClData& clData, const Arguments& args) {
+  // convFactor and finalFactor are those of sub, used when it is fused
+  const auto [w, h] = imgSize;
+
+  // Everything the devices read is produced on the main queue
+  std::vector<cl::Event> readyEvents(1);
+  clData.queue.enqueueMarkerWithWaitList(nullptr, &readyEvents[0]);
+  clData.queue.flush();
+
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double> createMaskFunc(clData.program, "createConvMask");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_double, cl_double> maskAfterFunc(clData.program, "maskAfterConv");
+
+  std::vector<cl::Event> hostEvents{};
+
+  for(ClRowBand &band : clData.bands) {
+    const int haloRows = band.haloEnd - band.haloStart;
+    const int rows = band.rowEnd - band.rowStart;
+
+    band.kernels = cl::Buffer(clData.context, CL_MEM_READ_ONLY, realSize(args) * convKernels.size());
+
+    // Copy the band with its halo from the full images
+    std::vector<cl::Event> copyEvents(4);
+    band.queue.enqueueCopyBuffer(clData.tImgBuf, band.tImg, realSize(args) * w * band.haloStart, 0,
+                                 realSize(args) * w * haloRows, &readyEvents, &copyEvents[0]);
+    band.queue.enqueueCopyBuffer(clData.sImgBuf, band.sImg, realSize(args) * w * band.haloStart, 0,
+                                 realSize(args) * w * haloRows, &readyEvents, &copyEvents[1]);
+    band.queue.enqueueCopyBuffer(clData.maskBuf, band.mask, sizeof(cl_ushort) * w * band.haloStart, 0,
+                                 sizeof(cl_ushort) * w * haloRows, &readyEvents, &copyEvents[2]);
+    copyEvents[3] = writeRealBuffer(band.queue, band.kernels, convKernels.size(), convKernels.data(), args);
+    hostEvents.push_back(copyEvents[3]);
+
+    // Create convolution mask
+    cl::EnqueueArgs createMaskEargs(band.queue, copyEvents[0], cl::NDRange(w, haloRows));
+    cl::Event createMaskEvent = createMaskFunc(createMaskEargs, band.tImg, band.convMask, w, 0, args.threshHigh, args.threshLow);
+    clData.profiler.record("createConvMask", createMaskEvent);
+
+    std::optional<FusedSub> fused{};
+    band.diffImg = cl::Buffer();
+    if(args.fuseSub) {
+      band.diffImg = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * w * haloRows);
+      fused = FusedSub{band.sImg, band.diffImg, convFactor, finalFactor, args.outConv || args.outNoise};
+    }
+
+    // Convolve the rows of the band, the kernel solution is read from the main queue
+    std::vector<cl::Event> convWaitEvents{createMaskEvent, copyEvents[1], copyEvents[2], copyEvents[3], readyEvents[0]};
+    cl::Event convEvent = enqueueConv(band.queue, convWaitEvents, band.kernels, xSteps, 0, band.tImg, band.convImg, band.convMask, band.mask,
+                                      imgSize, band.haloStart, band.haloStart, band.rowStart, band.rowEnd, invKernMult, clData, args, fused);
+
+    // Transfer the rows back to CPU when they are written
+    if(args.outConv) {
+      std::vector<cl::Event> readWaitEvents{convEvent};
+      cl::Event readEvent = readFloatBuffer(band.queue, band.convImg, w * (band.rowStart - band.haloStart), w * rows,
+                                            &convImg + w * band.rowStart, clData, args, readWaitEvents);
+      hostEvents.push_back(readEvent);
+    }
+
+    // Mask after convolve, done by the fused kernel
+    if(!fused) {
+      std::vector<cl::Event> maskAfterWaitEvents{convEvent, copyEvents[1]};
+      cl::EnqueueArgs maskAfterEargs(band.queue, maskAfterWaitEvents, cl::NDRange(0, band.rowStart - band.haloStart),
+                                     cl::NDRange(w, rows), cl::NullRange);
+      cl::Event maskAfterEvent = maskAfterFunc(maskAfterEargs, band.sImg, band.mask, w, args.threshHigh, args.threshLow);
+      clData.profiler.record("maskAfterConv", maskAfterEvent);
+    }
+
+    band.queue.flush();
+  }
+
+  // convKernels is owned by the caller and convImg is needed by fin
+  cl::Event::waitForEvents(hostEvents);
+}
+
+void subRowBands(const std::pair<cl_int, cl_int> &imgSize, const std::vector<ClRowBand> &bands, OutputImage &diffImg,
+                 OutputImage &noiseImg, MaskImage &maskImg, double convFactor, double finalFactor,
+                 const ClData& clData, const Arguments& args) {
+  /* Runs the selected products on the rows of each band and reads back only
+   * the ones that are written. The difference stays on the devices for the
+   * statistics.
+   */
+  const auto [w, h] = imgSize;
+
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int,
+                    cl_double, cl_double> subFunc(clData.program, "sub");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int,
+                    cl_double, cl_double> noiseFunc(clData.program, "noise");
+
+  std::vector<cl::Buffer> diffBufs{};
+  std::vector<cl::Event> readEvents{};
+
+  for(const ClRowBand &band : bands) {
+    cl::CommandQueue queue = band.queue;
+    const int rows = band.rowEnd - band.rowStart;
+    const int bandPixels = w * (band.haloEnd - band.haloStart);
+    const size_t rowsOffset = w * (band.rowStart - band.haloStart);
+
+    // The band queue is in-order, so everything runs after the convolution of the band
+    cl::EnqueueArgs eargs(queue, cl::NDRange(w * band.rowStart), cl::NDRange(w * rows), cl::NullRange);
+
+    if(args.outDiff || args.diffStats) {
+      // A fused convolution has already subtracted
+      cl::Buffer diffBuf = band.diffImg;
+      if(!diffBuf()) {
+        diffBuf = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * bandPixels);
+        cl::Event subEvent = subFunc(eargs, band.sImg, band.convImg, band.mask, diffBuf, args.fKernelWidth, w, h, band.haloStart, band.haloStart,
+                                     convFactor, finalFactor);
+        clData.profiler.record("sub", subEvent);
+      }
+      diffBufs.push_back(diffBuf);
+
+      if(args.outDiff) {
+        readEvents.push_back(readFloatBuffer(queue, diffBuf, rowsOffset, w * rows,
+                                             &diffImg + w * band.rowStart, clData, args));
+      }
+    }
+
+    if(args.outNoise) {
+      cl::Buffer noiseBuf(clData.context, CL_MEM_WRITE_ONLY, realSize(args) * bandPixels);
+      cl::Event noiseEvent = noiseFunc(eargs, band.sImg, band.convImg, band.mask, noiseBuf, args.fKernelWidth, w, h, band.haloStart,
+                                       convFactor, finalFactor);
+      clData.profiler.record("noise", noiseEvent);
+
+      std::vector<cl::Event> readWaitEvents{noiseEvent};
+      readEvents.push_back(readFloatBuffer(queue, noiseBuf, rowsOffset, w * rows,
+                                           &noiseImg + w * band.rowStart, clData, args, readWaitEvents));
+    }
+
+    if(args.outMask) {
+      readEvents.emplace_back();
+      queue.enqueueReadBuffer(band.mask, CL_FALSE, sizeof(cl_ushort) * rowsOffset, sizeof(cl_ushort) * w * rows,
+                              &maskImg + w * band.rowStart, nullptr, &readEvents.back());
+      clData.profiler.record("readMask", readEvents.back());
+    }
+
+    queue.flush();
+  }
+
+  if(args.diffStats) {
+    diffStats(imgSize, bands, diffBufs, clData, args);
+  }
+
+  cl::Event::waitForEvents(readEvents);
+}
+
+void diffStats(const std::pair<cl_int, cl_int> &imgSize, const std::vector<ClRowBand> &bands, const std::vector<cl::Buffer> &diffBufs,
+               const ClData& clData, const Arguments& args) {
+  /* Sigma-clipped mean and standard deviation of the difference image and
+   * its number of bad output pixels. Every iteration reduces all pixels
+   * within the current bounds on the devices, only the partial sums of the
+   * work-groups are read back.
+   */
+  const auto [w, h] = imgSize;
+  constexpr int localSize = 64;
+  constexpr int maxGroups = 256;
+  constexpr int maxIter = 10;
+
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int,
+                    cl_double, cl_double> statsFunc(clData.program, "diffStats");
+
+  std::vector<int> groupCounts{};
+  std::vector<cl::Buffer> partialBufs{};
+  std::vector<std::vector<cl_double>> partials{};
+  for(const ClRowBand &band : bands) {
+    int rowPixels = w * (band.rowEnd - band.rowStart);
+    groupCounts.push_back(std::min((rowPixels + localSize - 1) / localSize, maxGroups));
+    partialBufs.emplace_back(clData.context, CL_MEM_WRITE_ONLY, sizeof(cl_double) * 4 * groupCounts.back());
+    partials.emplace_back(4 * groupCounts.back());
+  }
+
+  double lo = -std::numeric_limits<double>::max();
+  double hi = std::numeric_limits<double>::max();
+  double mean = 0.0;
+  double stdDev = 0.0;
+  double prevCount = -1.0;
+  double count = 0.0;
+  double badCount = 0.0;
+
+  for(int iter = 0; iter < maxIter && count != prevCount; iter++) {
+    std::vector<cl::Event> readEvents{};
+
+    for(size_t i = 0; i < bands.size(); i++) {
+      const ClRowBand &band = bands[i];
+      cl::CommandQueue queue = band.queue;
+      const int rowPixels = w * (band.rowEnd - band.rowStart);
+
+      cl::EnqueueArgs eargs(queue, cl::NDRange(w * band.rowStart), cl::NDRange(groupCounts[i] * localSize), cl::NDRange(localSize));
+      cl::Event statsEvent = statsFunc(eargs, diffBufs[i], band.mask, partialBufs[i], rowPixels, args.fKernelWidth, w, h, band.haloStart,
+                                       lo, hi);
+      clData.profiler.record("diffStats", statsEvent);
+
+      readEvents.emplace_back();
+      queue.enqueueReadBuffer(partialBufs[i], CL_FALSE, 0, sizeof(cl_double) * partials[i].size(), partials[i].data(),
+                              nullptr, &readEvents.back());
+      queue.flush();
+    }
+    cl::Event::waitForEvents(readEvents);
+
+    double sum = 0.0;
+    double sum2 = 0.0;
+    prevCount = count;
+    count = 0.0;
+    badCount = 0.0;
+    for(const std::vector<cl_double> &p : partials) {
+      for(size_t g = 0; g < p.size(); g += 4) {
+        count += p[g];
+        sum += p[g + 1];
+        sum2 += p[g + 2];
+        badCount += p[g + 3];
+      }
+    }
+
+    if(count <= 1.0) {
+      std::cout << "Not enough good pixels in the difference image for statistics" << std::endl;
+      return;
+    }
+
+    mean = sum / count;
+    stdDev = std::sqrt(std::max((sum2 - count * mean * mean) / (count - 1.0), 0.0));
+    lo = mean - args.sigClipAlpha * stdDev;
+    hi = mean + args.sigClipAlpha * stdDev;
+  }
+
+  std::cout << "Difference image: clipped mean " << mean << ", sigma " << stdDev << " from " << (long long)count
+            << " pixels, " << (long long)badCount << " bad pixels" << std::endl;
+}
+
+void convSubStrips(const std::pair<cl_int, cl_int> &imgSize, const OutputImage &convImg, const OutputImage &diffImg, Kernel &convolutionKernel,
+                   double invKernMult, double convFactor, double finalFactor, ClData& clData, const Arguments& args) {
+  /* Convolves and subtracts stripRows rows at a time and writes them to the
+   * output files right away, so neither the device nor the host holds a full
+   * output frame. The kernels are also only made for the rows of a strip.
+   * The strips read the full-frame template, science and mask buffers in
+   * place, those stay resident.
+   * Two strips alternate, the host makes the kernels of the next strip and
+   * writes the previous one while the device works on the current one.
+   */
+  const auto [w, h] = imgSize;
+  const int stripRows = std::min(args.stripRows, h);
+  const int bufferPixels = w * std::min(stripRows + 2 * args.hKernelWidth, h);
+  const int xSteps = std::ceil(w / double(args.fKernelWidth));
+  const int kernelSize = args.fKernelWidth * args.fKernelWidth;
+  const int maxYSteps = stripRows / args.fKernelWidth + 2;
+
+  FitsFile convFits = args.outConv ? createImageFile(convImg, args) : nullptr;
+  FitsFile diffFits = args.outDiff ? createImageFile(diffImg, args) : nullptr;
+
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_double, cl_double> createMaskFunc(clData.program, "createConvMask");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_double, cl_double> maskAfterFunc(clData.program, "maskAfterConv");
+  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int,
+                    cl_double, cl_double> subFunc(clData.program, "sub");
+
+  struct Strip {
+    ClRowBand band;
+    cl::Buffer diffImg;
+    std::vector<cl_double> kernels;
+    std::vector<cl_float> floatKernels;
+    std::valarray<cl_float> convRows;
+    std::valarray<cl_float> diffRows;
+    // Transfers that read or write the host memory of the strip
+    std::vector<cl::Event> hostEvents;
+  };
+
+  std::array<Strip, 2> strips{};
+  for(Strip &strip : strips) {
+    strip.band.queue    = clData.queue;
+    strip.band.convMask = cl::Buffer(clData.context, CL_MEM_READ_WRITE, sizeof(cl_ushort) * bufferPixels);
+    strip.band.convImg  = cl::Buffer(clData.context, CL_MEM_READ_WRITE, realSize(args) * bufferPixels);
+    strip.band.kernels  = cl::Buffer(clData.context, CL_MEM_READ_ONLY, realSize(args) * maxYSteps * xSteps * kernelSize);
+    strip.diffImg       = cl::Buffer(clData.context, CL_MEM_WRITE_ONLY, realSize(args) * bufferPixels);
+  }
+
+  auto finishStrip = [&](Strip &strip) {
+    cl::Event::waitForEvents(strip.hostEvents);
+    strip.hostEvents.clear();
+
+    auto writeStart = Profiler::now();
+    if(convFits) writeImageRows(convFits.get(), convImg, strip.convRows, strip.band.rowStart);
+    if(diffFits) writeImageRows(diffFits.get(), diffImg, strip.diffRows, strip.band.rowStart);
+    clData.profiler.recordHost("writeImageRows", writeStart);
+  };
+
+  for(int stripIndex = 0; stripIndex * stripRows < h; stripIndex++) {
+    Strip &strip = strips[stripIndex % 2];
+    ClRowBand &band = strip.band;
+
+    band.rowStart = stripIndex * stripRows;
+    band.rowEnd = std::min(band.rowStart + stripRows, h);
+    band.haloStart = std::max(band.rowStart - args.hKernelWidth, 0);
+    band.haloEnd = std::min(band.rowEnd + args.hKernelWidth, h);
+
+    const int haloRows = band.haloEnd - band.haloStart;
+    const int rows = band.rowEnd - band.rowStart;
+
+    // Kernel rows used by the pixels of the strip, same positions as in conv
+    const int firstYStep = std::max(band.rowStart - args.hKernelWidth, 0) / args.fKernelWidth;
+    const int lastYStep = std::max(band.rowEnd - 1 - args.hKernelWidth, 0) / args.fKernelWidth;
+
+    auto kernelsStart = Profiler::now();
+    strip.kernels.clear();
+    for(int yStep = firstYStep; yStep <= lastYStep; yStep++) {
+      for(int xStep = 0; xStep < xSteps; xStep++) {
+        makeKernel(convolutionKernel, imgSize,
+                   xStep * args.fKernelWidth + args.hKernelWidth + args.hKernelWidth,
+                   yStep * args.fKernelWidth + args.hKernelWidth + args.hKernelWidth,
+                   args);
+        strip.kernels.insert(strip.kernels.end(),
+                             convolutionKernel.currKernel.begin(),
+                             convolutionKernel.currKernel.end());
+      }
+    }
+    clData.profiler.recordHost("makeKernel", kernelsStart);
+
+    // The upload does not block, the strip keeps its host copy until finishStrip.
+    // The queue is in-order, so every command runs after the previous one.
+    cl::Event uploadEvent{};
+    if(args.singlePrecision) {
+      strip.floatKernels.assign(strip.kernels.begin(), strip.kernels.end());
+      clData.queue.enqueueWriteBuffer(band.kernels, CL_FALSE, 0, sizeof(cl_float) * strip.floatKernels.size(),
+                                      strip.floatKernels.data(), nullptr, &uploadEvent);
+    }
+    else {
+      uploadEvent = writeRealBuffer(clData.queue, band.kernels, strip.kernels.size(), strip.kernels.data(), args);
+    }
+    strip.hostEvents.push_back(uploadEvent);
+    std::vector<cl::Event> convWaitEvents{uploadEvent};
+
+    // Create convolution mask of the strip and its halo
+    cl::EnqueueArgs createMaskEargs(clData.queue, cl::NDRange(0, band.haloStart), cl::NDRange(w, haloRows), cl::NullRange);
+    cl::Event createMaskEvent = createMaskFunc(createMaskEargs, clData.tImgBuf, band.convMask, w, band.haloStart,
+                                               args.threshHigh, args.threshLow);
+    clData.profiler.record("createConvMask", createMaskEvent);
+    convWaitEvents.push_back(createMaskEvent);
+
+    std::optional<FusedSub> fused{};
+    if(args.fuseSub) {
+      fused = FusedSub{clData.sImgBuf, strip.diffImg, convFactor, finalFactor, args.outConv};
+    }
+
+    // Convolve, the template, science and mask are addressed in frame rows
+    cl::Event convEvent = enqueueConv(clData.queue, convWaitEvents, band.kernels, xSteps, firstYStep, clData.tImgBuf, band.convImg,
+                                      band.convMask, clData.maskBuf, imgSize, band.haloStart, 0, band.rowStart, band.rowEnd,
+                                      invKernMult, clData, args, fused);
+    cl::Event subEvent = convEvent;
+
+    if(!fused) {
+      // Mask after convolve
+      cl::EnqueueArgs maskAfterEargs(clData.queue, convEvent, cl::NDRange(0, band.rowStart), cl::NDRange(w, rows), cl::NullRange);
+      cl::Event maskAfterEvent = maskAfterFunc(maskAfterEargs, clData.sImgBuf, clData.maskBuf, w, args.threshHigh, args.threshLow);
+      clData.profiler.record("maskAfterConv", maskAfterEvent);
+
+      // Subtract
+      cl::EnqueueArgs subEargs(clData.queue, maskAfterEvent, cl::NDRange(w * band.rowStart), cl::NDRange(w * rows), cl::NullRange);
+      subEvent = subFunc(subEargs, clData.sImgBuf, band.convImg, clData.maskBuf, strip.diffImg, args.fKernelWidth, w, h,
+                         band.haloStart, 0, convFactor, finalFactor);
+      clData.profiler.record("sub", subEvent);
+    }
+
+    // Transfer the written rows of the strip back to CPU
+    std::vector<cl::Event> readWaitEvents{subEvent};
+    if(args.outConv) {
+      strip.convRows.resize(w * rows);
+      strip.hostEvents.push_back(readFloatBuffer(clData.queue, band.convImg, w * (band.rowStart - band.haloStart), w * rows,
+                                                 &strip.convRows[0], clData, args, readWaitEvents));
+    }
+    if(args.outDiff) {
+      strip.diffRows.resize(w * rows);
+      strip.hostEvents.push_back(readFloatBuffer(clData.queue, strip.diffImg, w * (band.rowStart - band.haloStart), w * rows,
+                                                 &strip.diffRows[0], clData, args, readWaitEvents));
+    }
+    clData.queue.flush();
+
+    if(args.verbose) {
+      std::cout << "Strip " << stripIndex << ": rows " << band.rowStart << "-" << band.rowEnd - 1 << std::endl;
+    }
+
+    // The device works on this strip while the previous one is written
+    if(stripIndex > 0) {
+      finishStrip(strips[(stripIndex + 1) % 2]);
+    }
+  }
+
+  const int stripCount = (h + stripRows - 1) / stripRows;
+  finishStrip(strips[(stripCount - 1) % 2]);
+}
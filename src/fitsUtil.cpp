@@ -1,11 +1,28 @@
 #include "fitsUtil.h"
 
 #include <CL/opencl.hpp>
+#include <fstream>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+bool fitsReentrant() {
+  static const bool reentrant = fits_is_reentrant() != 0;
+  return reentrant;
+}
+
+static std::unique_lock<std::mutex> lockFits() {
+  /* Images are read and written on worker threads. A cfitsio that is not
+   * built reentrant is only used by one thread at a time.
+   */
+  static std::mutex fitsMutex{};
+  return fitsReentrant() ? std::unique_lock<std::mutex>{} : std::unique_lock<std::mutex>{fitsMutex};
+}
+
 void readImage(Image& input, const Arguments& args) {
+  auto fitsLock = lockFits();
   CCfits::FITS* pIn{};
   try {
     pIn = new CCfits::FITS(input.getFile(), CCfits::RWmode::Read, true);
@@ -35,27 +52,162 @@ void readImage(Image& input, const Arguments& args) {
   delete pIn;
 }
 
-void writeImage(const Image& img, const Arguments& args) {
+std::optional<RawImage> openRawImage(Image& input, const Arguments& args) {
+  /* Reads only the header of the primary image and sets the axis of input,
+   * its pixels are left for readRawPixels. Returns nothing when the pixels
+   * are not stored as is, e.g. in a gzip compressed file.
+   */
+  {
+    std::ifstream file(input.getFile(), std::ios::binary);
+    char magic[6]{};
+    if(!file.read(magic, sizeof(magic)) || std::string(magic, sizeof(magic)) != "SIMPLE") {
+      return std::nullopt;
+    }
+  }
+
+  auto fitsLock = lockFits();
+  fitsfile *fptr{};
+  int status = 0;
+  if(fits_open_file(&fptr, input.getFile().c_str(), READONLY, &status)) {
+    char err[FLEN_ERRMSG]{};
+    fits_get_errstatus(status, err);
+    std::cout << "Unable to open file '" << input.getFile() << "'" << std::endl << err << std::endl;
+    throw std::invalid_argument("Unable to open file '" + input.getFile() + "'");
+  }
+
+  RawImage raw{0, 1.0, 0.0, 0};
+  int nAxis = 0;
+  long axis[2]{0, 0};
+  fits_get_img_param(fptr, 2, &raw.bitpix, &nAxis, axis, &status);
+
+  LONGLONG headStart{}, dataStart{}, dataEnd{};
+  fits_get_hduaddrll(fptr, &headStart, &dataStart, &dataEnd, &status);
+  raw.dataOffset = dataStart;
+
+  // Scaling keywords are optional
+  for(auto [key, value] : {std::make_pair("BSCALE", &raw.bscale), std::make_pair("BZERO", &raw.bzero)}) {
+    if(status == 0 && fits_read_key(fptr, TDOUBLE, key, value, nullptr, &status) == KEY_NO_EXIST) {
+      status = 0;
+    }
+  }
+
+  int closeStatus = 0;
+  fits_close_file(fptr, &closeStatus);
+  fitsLock = {};
+
+  if(status != 0) {
+    char err[FLEN_ERRMSG]{};
+    fits_get_errstatus(status, err);
+    throw std::invalid_argument("Unable to read header of '" + input.getFile() + "': " + err);
+  }
+  if(nAxis != 2) {
+    throw std::invalid_argument("fits image with " + std::to_string(nAxis) + " axes is not supported.");
+  }
+
+  input = Image(input.name, 0, std::make_pair(cl_int(axis[0]), cl_int(axis[1])), input.path);
+
+  if(args.verbose) {
+    std::cout << input.getFile() << ": " << axis[0] << "x" << axis[1] << ", BITPIX " << raw.bitpix
+              << ", BSCALE " << raw.bscale << ", BZERO " << raw.bzero << std::endl;
+  }
+
+  return raw;
+}
+
+void readRawPixels(const Image& input, const RawImage& raw, void* dst) {
+  // The pixels are big-endian and unscaled, see decodeImage in ini.cl
+  std::ifstream file(input.getFile(), std::ios::binary);
+  file.seekg(raw.dataOffset);
+
+  if(!file.read(static_cast<char*>(dst), raw.pixelSize() * input.size())) {
+    throw std::invalid_argument("Unable to read the pixels of '" + input.getFile() + "'");
+  }
+}
+
+void FitsFileCloser::operator()(fitsfile* fits) const {
+  auto fitsLock = lockFits();
+  int status = 0;
+  fits_close_file(fits, &status);
+}
+
+static FitsFile createFile(const std::string& outFile, const std::string& file, const std::pair<cl_int, cl_int>& axis,
+                           int bitpix, const Arguments& args) {
+  /* Creates an image output, tile-compressed when asked for. cfitsio then
+   * writes the image to the first extension after an empty primary.
+   */
   constexpr int nAxis = 2;
-  CCfits::FITS* pFits{};
+  long axisArr[nAxis]{axis.first, axis.second};
 
-  try {
-    long axisArr[nAxis]{img.axis.first, img.axis.second};
+  auto fitsLock = lockFits();
+  fitsfile *fptr{};
+  int status = 0;
+  fits_create_file(&fptr, outFile.c_str(), &status);
 
-    pFits = new CCfits::FITS(img.getOutFile(), FLOAT_IMG, nAxis, axisArr);
-  } catch(const CCfits::FITS::CantCreate &err) {
-    std::cout << "Unable to save file '" << img.getFile() << "'" << std::endl << err.message() << std::endl;
-    throw;
+  if(status == 0 && !args.outCompression.empty()) {
+    fits_set_compression_type(fptr, args.outCompression == "rice" ? RICE_1 : GZIP_1, &status);
+  }
+  if(status == 0) {
+    fits_create_img(fptr, bitpix, nAxis, axisArr, &status);
   }
 
-  long fpixel(1);
+  // The closer takes the lock itself
+  fitsLock = {};
+  FitsFile fits{fptr};
+
+  if(status != 0) {
+    char err[FLEN_ERRMSG]{};
+    fits_get_errstatus(status, err);
+    std::cout << "Unable to save file '" << file << "'" << std::endl << err << std::endl;
+    throw std::invalid_argument("Unable to save file '" + file + "'");
+  }
+
+  return fits;
+}
+
+FitsFile createImageFile(const OutputImage& img, const Arguments& args) {
+  return createFile(img.getOutFile(), img.getFile(), img.axis, FLOAT_IMG, args);
+}
+
+void writeImageRows(fitsfile* fits, const OutputImage& img, const std::valarray<cl_float>& rows, int firstRow) {
+  // FITS pixels are numbered from 1
+  LONGLONG fpixel = LONGLONG(firstRow) * img.axis.first + 1;
+
+  auto fitsLock = lockFits();
+  int status = 0;
+  fits_write_img(fits, TFLOAT, fpixel, rows.size(), const_cast<cl_float*>(&rows[0]), &status);
+
+  if(status != 0) {
+    char err[FLEN_ERRMSG]{};
+    fits_get_errstatus(status, err);
+    throw std::invalid_argument("Unable to write to '" + img.getFile() + "': " + err);
+  }
+}
 
-  pFits->pHDU().write(fpixel, img.data.size(), img.data);
+void writeImage(const OutputImage& img, const Arguments& args) {
+  FitsFile fits = createImageFile(img, args);
+  writeImageRows(fits.get(), img, img.data, 0);
 
   if(args.verbose) {
-    std::cout << pFits->pHDU() << std::endl;
-    std::cout << pFits->extension().size() << std::endl;
+    std::cout << "Wrote " << img.getFile() << ": " << img.axis.first << "x" << img.axis.second
+              << (args.outCompression.empty() ? "" : ", " + args.outCompression + " compressed") << std::endl;
+  }
+}
+
+void writeImage(const MaskImage& img, const Arguments& args) {
+  FitsFile fits = createFile(img.getOutFile(), img.getFile(), img.axis, USHORT_IMG, args);
+
+  auto fitsLock = lockFits();
+  int status = 0;
+  fits_write_img(fits.get(), TUSHORT, 1, img.data.size(), const_cast<cl_ushort*>(&img.data[0]), &status);
+  fitsLock = {};
+
+  if(status != 0) {
+    char err[FLEN_ERRMSG]{};
+    fits_get_errstatus(status, err);
+    throw std::invalid_argument("Unable to write to '" + img.getFile() + "': " + err);
   }
 
-  delete pFits;
+  if(args.verbose) {
+    std::cout << "Wrote " << img.getFile() << ": " << img.axis.first << "x" << img.axis.second << " mask" << std::endl;
+  }
 }
@@ -1,7 +1,6 @@
-#include <time.h>
-
 #include <CL/opencl.hpp>
 #include <filesystem>
+#include <future>
 #include <iterator>
 #include <vector>
 #include <iostream>
@@ -11,9 +10,10 @@
 #include "bachUtil.h"
 #include "datatypeUtil.h"
 #include "bach.h"
+#include "profUtil.h"
 
 int main(int argc, const char* argv[]) {
-  clock_t p1 = clock();
+  Profiler profiler{};
 
   CCfits::FITS::setVerboseMode(true);
   
@@ -25,127 +25,234 @@ int main(int argc, const char* argv[]) {
     std::cout << err.what() << '\n';
     return 1;
   }
+  profiler.enabled = args.profile;
+  if(!fitsReentrant()) {
+    std::cout << "cfitsio is not reentrant, FITS files are read and written one at a time" << std::endl;
+  }
   
-  std::cout << "\nReading in images..." << std::endl;
-  Image templateImg{args.templateName};
-  Image scienceImg{args.scienceName};
-  templateImg.path = scienceImg.path = args.inputPath + "/";
-  
-  
-  if(args.verbose)
-    std::cout << "template image name: " << args.templateName
-              << ", science image name: " << args.scienceName << std::endl;
+  std::vector<std::string> scienceNames{};
+  try {
+    scienceNames = getScienceNames(args);
+  } catch(const std::invalid_argument& err) {
+    std::cout << err.what() << '\n';
+    return 1;
+  }
+  bool batch = !args.scienceList.empty();
 
   std::cout << "\nSetting up openCL..." << std::endl;
-  cl::Platform platform = getDefaultPlatform();
-  cl::Device device = getDefaultDevice(platform);
-  cl::Context context(device);
+  cl::Platform platform = args.multiDevice ? getMultiDevicePlatform() : getDefaultPlatform();
+  std::vector<cl::Device> devices = args.multiDevice ? getAllDevices(platform)
+                                                     : std::vector<cl::Device>{getDefaultDevice(platform)};
+  cl::Device device = devices[0];
+  cl::Context context(devices);
   cl::Program program =
-      loadBuildPrograms(context, device, std::filesystem::path(argv[0]).parent_path(),
-      "bach.cl", "ini.cl", "sss.cl", "cmv.cl", "cd.cl", "ksc.cl", "conv.cl", "sub.cl");
-  cl::CommandQueue queue(context, device);
+      loadBuildPrograms(context, devices, std::filesystem::path(argv[0]).parent_path(),
+      args.singlePrecision ? "-DREAL=float" : "-DREAL=double",
+      "bach.cl", "ini.cl", "sss.cl", "cmv.cl", "cd.cl", "ksc.cl", "conv.cl", "fft.cl", "sub.cl");
+  cl_command_queue_properties queueProperties = args.profile ? CL_QUEUE_PROFILING_ENABLE : 0;
+  cl::CommandQueue queue(context, device, queueProperties);
 
   if (args.verbose) {
-    printVerboseClInfo(platform, device);
+    for(const cl::Device &d : devices) {
+      printVerboseClInfo(platform, d);
+    }
   }
 
-  ClData clData { device, context, program, queue };
+  ClData clData { device, context, program, queue, profiler };
 
-  init(templateImg, scienceImg, clData, args);
-
-  clock_t p2 = clock();
-  if(args.verboseTime) {
-    std::cout << "Ini took " << (p2 - p1) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
+  clData.deviceQueues.push_back(queue);
+  for(size_t i = 1; i < devices.size(); i++) {
+    clData.deviceQueues.emplace_back(context, devices[i], queueProperties);
   }
 
-  /* ===== SSS ===== */
+  // Both images are read from disk at the same time, every following
+  // science image while the previous one is processed
+  auto scienceFile = [&](size_t index) {
+    std::filesystem::path sciencePath{scienceNames[index]};
+    Image scienceImg{sciencePath.filename().string()};
+    scienceImg.path = sciencePath.parent_path().string() + "/";
+    return scienceImg;
+  };
 
-  clock_t p3 = clock();
-  std::vector<Stamp> templateStamps{};
-  std::vector<Stamp> sciStamps{};
-  sss(templateImg.axis, templateStamps, sciStamps, args, clData);
+  std::cout << "\nReading in template image..." << std::endl;
+  Image templateImg{args.templateName};
+  templateImg.path = args.inputPath + "/";
 
-  clock_t p4 = clock();
-  if(args.verboseTime) {
-    std::cout << "SSS took " << (p4 - p3) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
-  }
+  PendingImage pendingTemplate = startImageRead(templateImg, clData, args);
+  PendingImage pendingScience = startImageRead(scienceFile(0), clData, args);
 
-  std::cout << std::endl;
+  initTemplate(pendingTemplate, templateImg, clData, args);
 
-  /* ===== CMV ===== */
+  // The template buffer is swapped with the science buffer in CD when the
+  // science image is convolved, so keep a handle to restore it per image.
+  cl::Buffer templateBuf = clData.tImgBuf;
 
-  clock_t p5 = clock();
+  for(size_t imageIndex = 0; imageIndex < scienceNames.size(); imageIndex++) {
+    std::filesystem::path sciencePath{scienceNames[imageIndex]};
 
-  Kernel convolutionKernel{args};
-  cmv(templateImg.axis, templateStamps, sciStamps, convolutionKernel, clData, args);
-  
-  clock_t p6 = clock();
-  if(args.verboseTime) {
-    std::cout << "CMV took " << (p6 - p5) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
-  }
+    // Stages adjust the arguments to the current images
+    Arguments frameArgs = args;
+    frameArgs.scienceName = sciencePath.filename().string();
 
-  /* ===== CD ===== */
+    std::string diffName = "sub.fits";
+    std::string noiseName = "noise.fits";
+    std::string maskName = "mask.fits";
+    if(batch) {
+      std::string stem = sciencePath.stem().string();
+      frameArgs.outName = stem + "_" + args.outName;
+      diffName = stem + "_sub.fits";
+      noiseName = stem + "_noise.fits";
+      maskName = stem + "_mask.fits";
 
-  clock_t p7 = clock();
+      std::cout << "\n===== Science image " << imageIndex + 1 << "/" << scienceNames.size()
+                << ": " << sciencePath.string() << " =====" << std::endl;
+    }
 
-  bool convTemplate = cd(templateImg, scienceImg, templateStamps, sciStamps, clData, args);
+    /* ===== Ini ===== */
 
-  clock_t p8 = clock();
-  if(args.verboseTime) {
-    std::cout << "CD took " << (p8 - p7) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
-  }
+    if(imageIndex > 0) profiler.beginStage("Ini");
 
-  /* ===== KSC ===== */
+    std::cout << "\nReading in science image..." << std::endl;
+    Image scienceImg{frameArgs.scienceName};
 
-  clock_t p9 = clock();
+    if(args.verbose)
+      std::cout << "template image name: " << args.templateName
+                << ", science image name: " << frameArgs.scienceName << std::endl;
 
-  ksc(templateStamps, convolutionKernel, scienceImg, clData.tImgBuf, clData.sImgBuf, clData, clData.tmpl, args);
+    initScience(templateImg, pendingScience, scienceImg, clData, frameArgs);
 
-  clock_t p10 = clock();
-  if(args.verboseTime) {
-    std::cout << "KSC took " << (p10 - p9) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
-  }
+    if(imageIndex + 1 < scienceNames.size()) {
+      pendingScience = startImageRead(scienceFile(imageIndex + 1), clData, args);
+    }
 
-  /* ===== Conv ===== */
+    double iniMs = profiler.endStage();
+    if(args.verboseTime) {
+      std::cout << "Ini took " << iniMs << " ms" << std::endl;
+    }
 
-  clock_t p11 = clock();
+    /* ===== SSS ===== */
 
-  Image convImg{args.outName, templateImg.axis, args.outPath};
-  double kernSum = conv(templateImg.axis, convImg, convolutionKernel, convTemplate, clData, args);
+    profiler.beginStage("SSS");
+    std::vector<Stamp> templateStamps{};
+    std::vector<Stamp> sciStamps{};
+    sss(templateImg.axis, templateStamps, sciStamps, frameArgs, clData);
 
-  clock_t p12 = clock();
-  if(args.verboseTime) {
-    std::cout << "Conv took " << (p12 - p11) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
-  }
+    double sssMs = profiler.endStage();
+    if(args.verboseTime) {
+      std::cout << "SSS took " << sssMs << " ms" << std::endl;
+    }
 
-  /* ===== Sub ===== */
+    std::cout << std::endl;
 
-  clock_t p13 = clock();
+    /* ===== CMV ===== */
 
-  Image diffImg{"sub.fits", templateImg.axis, args.outPath};
-  sub(templateImg.axis, diffImg, convTemplate, kernSum, clData, args);
+    profiler.beginStage("CMV");
 
-  clock_t p14 = clock();
-  if(args.verboseTime) {
-    std::cout << "Sub took " << (p14 - p13) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
-  }
+    Kernel convolutionKernel{frameArgs};
+    cmv(templateImg.axis, templateStamps, sciStamps, convolutionKernel, clData, frameArgs);
+    
+    double cmvMs = profiler.endStage();
+    if(args.verboseTime) {
+      std::cout << "CMV took " << cmvMs << " ms" << std::endl;
+    }
 
-  /* ===== Fin ===== */
+    /* ===== CD ===== */
 
-  clock_t p15 = clock();
+    profiler.beginStage("CD");
 
-  fin(convImg, diffImg, args);
+    bool convTemplate = cd(templateImg, scienceImg, templateStamps, sciStamps, clData, frameArgs);
 
-  clock_t p16 = clock();
-  if(args.verboseTime) {
-    std::cout << "Fin took " << (p16 - p15) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
+    double cdMs = profiler.endStage();
+    if(args.verboseTime) {
+      std::cout << "CD took " << cdMs << " ms" << std::endl;
+    }
+
+    /* ===== KSC ===== */
+
+    profiler.beginStage("KSC");
+
+    ksc(templateStamps, convolutionKernel, scienceImg, clData.tImgBuf, clData.sImgBuf, clData, clData.tmpl, frameArgs);
+
+    double kscMs = profiler.endStage();
+    if(args.verboseTime) {
+      std::cout << "KSC took " << kscMs << " ms" << std::endl;
+    }
+
+    if(args.stripRows > 0) {
+      /* ===== Conv + Sub in strips ===== */
+
+      profiler.beginStage("Strips");
+
+      // Outputs are written strip by strip, so the images hold no pixels
+      OutputImage convImg{frameArgs.outName, 0, templateImg.axis, args.outPath};
+      OutputImage diffImg{diffName, 0, templateImg.axis, args.outPath};
+      convSub(templateImg.axis, convImg, diffImg, convolutionKernel, convTemplate, clData, frameArgs);
+
+      double stripsMs = profiler.endStage();
+      if(args.verboseTime) {
+        std::cout << "Strips took " << stripsMs << " ms" << std::endl;
+      }
+    } else {
+      /* ===== Conv ===== */
+
+      profiler.beginStage("Conv");
+
+      // Only the outputs that are written hold pixels on the host
+      OutputImage convImg{frameArgs.outName, args.outConv ? templateImg.size() : 0, templateImg.axis, args.outPath};
+      double kernSum = conv(templateImg.axis, convImg, convolutionKernel, convTemplate, clData, frameArgs);
+
+      // The convolved image is written while the subtraction runs
+      std::future<void> convWrite{};
+      if(args.outConv) {
+        convWrite = std::async(std::launch::async, [&] { writeImage(convImg, frameArgs); });
+      }
+
+      double convMs = profiler.endStage();
+      if(args.verboseTime) {
+        std::cout << "Conv took " << convMs << " ms" << std::endl;
+      }
+
+      /* ===== Sub ===== */
+
+      profiler.beginStage("Sub");
+
+      OutputImage diffImg{diffName, args.outDiff ? templateImg.size() : 0, templateImg.axis, args.outPath};
+      OutputImage noiseImg{noiseName, args.outNoise ? templateImg.size() : 0, templateImg.axis, args.outPath};
+      MaskImage maskImg{maskName, args.outMask ? templateImg.size() : 0, templateImg.axis, args.outPath};
+      sub(templateImg.axis, diffImg, noiseImg, maskImg, convTemplate, kernSum, clData, frameArgs);
+
+      double subMs = profiler.endStage();
+      if(args.verboseTime) {
+        std::cout << "Sub took " << subMs << " ms" << std::endl;
+      }
+
+      /* ===== Fin ===== */
+
+      profiler.beginStage("Fin");
+
+      fin(convWrite, diffImg, noiseImg, maskImg, frameArgs);
+
+      double finMs = profiler.endStage();
+      if(args.verboseTime) {
+        std::cout << "Fin took " << finMs << " ms" << std::endl;
+      }
+    }
+
+    // Restore the template for the next science image
+    if(!convTemplate) {
+      std::swap(scienceImg, templateImg);
+      std::swap(clData.sImgBuf, clData.tImgBuf);
+    }
+    clData.tImgBuf = templateBuf;
   }
 
   std::cout << "\nBACH finished." << std::endl;
 
   if(args.verboseTime) {
-    std::cout << "BACH took " << (p16 - p1) * 1000 / CLOCKS_PER_SEC << " ms" << std::endl;
+    std::cout << "BACH took " << profiler.totalMs() << " ms" << std::endl;
   }
 
+  writeProfile(profiler, args);
+
   return 0;
 }
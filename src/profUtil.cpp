@@ -0,0 +1,175 @@
+#include "profUtil.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+
+namespace {
+
+struct EventTimes {
+  cl_ulong queued;
+  cl_ulong submit;
+  cl_ulong start;
+  cl_ulong end;
+};
+
+struct Summary {
+  int count = 0;
+  double totalMs = 0.0;
+  double minMs = 0.0;
+  double maxMs = 0.0;
+  double queueMs = 0.0;  // time spent between being queued and starting
+
+  void add(double ms, double waitMs) {
+    minMs = count == 0 ? ms : std::min(minMs, ms);
+    maxMs = count == 0 ? ms : std::max(maxMs, ms);
+    totalMs += ms;
+    queueMs += waitMs;
+    count++;
+  }
+};
+
+constexpr double nsToMs = 1e-6;
+
+void writeSummaryJson(std::ofstream &out, const Summary &s) {
+  out << "\"count\": " << s.count << ", \"totalMs\": " << s.totalMs
+      << ", \"meanMs\": " << (s.count > 0 ? s.totalMs / s.count : 0.0)
+      << ", \"minMs\": " << s.minMs << ", \"maxMs\": " << s.maxMs
+      << ", \"queueMs\": " << s.queueMs;
+}
+
+void writeSummaryCsv(std::ofstream &out, const std::string &type, const std::string &stage,
+                     const std::string &name, const Summary &s) {
+  out << type << "," << stage << "," << name << "," << s.count << "," << s.totalMs << ","
+      << (s.count > 0 ? s.totalMs / s.count : 0.0) << "," << s.minMs << "," << s.maxMs << ","
+      << s.queueMs << "\n";
+}
+
+}  // namespace
+
+void writeProfile(const Profiler &profiler, const Arguments &args) {
+  if(!profiler.enabled) return;
+
+  // Query all events, they have to be finished at this point
+  std::vector<EventTimes> times{};
+  times.reserve(profiler.kernels.size());
+
+  cl_ulong firstQueued = std::numeric_limits<cl_ulong>::max();
+  for(const KernelRecord &k : profiler.kernels) {
+    k.event.wait();
+    EventTimes t{k.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(),
+                 k.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>(),
+                 k.event.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
+                 k.event.getProfilingInfo<CL_PROFILING_COMMAND_END>()};
+    firstQueued = std::min(firstQueued, t.queued);
+    times.push_back(t);
+  }
+
+  std::map<std::string, Summary> perKernel{};
+  std::map<std::pair<std::string, std::string>, Summary> perStageKernel{};
+  std::map<std::pair<std::string, std::string>, Summary> perStageHost{};
+  std::map<std::string, double> stageDeviceMs{};
+  std::map<std::string, double> stageHostMs{};
+
+  for(size_t i = 0; i < times.size(); i++) {
+    const KernelRecord &k = profiler.kernels[i];
+    double ms = (times[i].end - times[i].start) * nsToMs;
+    double waitMs = (times[i].start - times[i].queued) * nsToMs;
+
+    perKernel[k.name].add(ms, waitMs);
+    perStageKernel[{k.stage, k.name}].add(ms, waitMs);
+    stageDeviceMs[k.stage] += ms;
+  }
+
+  for(const HostRecord &h : profiler.hosts) {
+    perStageHost[{h.stage, h.name}].add(h.ms, 0.0);
+    stageHostMs[h.stage] += h.ms;
+  }
+
+  // JSON report
+  std::string jsonName = args.outPath + "profile.json";
+  std::ofstream json(jsonName);
+  if(!json) {
+    std::cout << "Unable to write profile '" << jsonName << "'" << std::endl;
+    return;
+  }
+
+  json << "{\n  \"totalMs\": " << profiler.totalMs() << ",\n";
+
+  json << "  \"stages\": [\n";
+  for(size_t i = 0; i < profiler.stages.size(); i++) {
+    const StageRecord &s = profiler.stages[i];
+    json << "    {\"name\": \"" << s.name << "\", \"wallMs\": " << s.endMs - s.startMs
+         << ", \"startMs\": " << s.startMs << ", \"deviceMs\": " << stageDeviceMs[s.name]
+         << ", \"hostMs\": " << stageHostMs[s.name] << "}"
+         << (i + 1 < profiler.stages.size() ? ",\n" : "\n");
+  }
+  json << "  ],\n";
+
+  json << "  \"kernels\": [\n";
+  size_t n = 0;
+  for(const auto &[name, s] : perKernel) {
+    json << "    {\"name\": \"" << name << "\", ";
+    writeSummaryJson(json, s);
+    json << "}" << (++n < perKernel.size() ? ",\n" : "\n");
+  }
+  json << "  ],\n";
+
+  json << "  \"stageKernels\": [\n";
+  n = 0;
+  for(const auto &[key, s] : perStageKernel) {
+    json << "    {\"stage\": \"" << key.first << "\", \"name\": \"" << key.second << "\", ";
+    writeSummaryJson(json, s);
+    json << "}" << (++n < perStageKernel.size() ? ",\n" : "\n");
+  }
+  json << "  ],\n";
+
+  json << "  \"host\": [\n";
+  n = 0;
+  for(const auto &[key, s] : perStageHost) {
+    json << "    {\"stage\": \"" << key.first << "\", \"name\": \"" << key.second << "\", ";
+    writeSummaryJson(json, s);
+    json << "}" << (++n < perStageHost.size() ? ",\n" : "\n");
+  }
+  json << "  ],\n";
+
+  // Raw timeline, relative to the first queued command
+  json << "  \"events\": [\n";
+  for(size_t i = 0; i < times.size(); i++) {
+    const KernelRecord &k = profiler.kernels[i];
+    json << "    {\"stage\": \"" << k.stage << "\", \"name\": \"" << k.name
+         << "\", \"queuedNs\": " << times[i].queued - firstQueued
+         << ", \"submitNs\": " << times[i].submit - firstQueued
+         << ", \"startNs\": " << times[i].start - firstQueued
+         << ", \"endNs\": " << times[i].end - firstQueued << "}"
+         << (i + 1 < times.size() ? ",\n" : "\n");
+  }
+  json << "  ]\n}\n";
+
+  // CSV report
+  std::string csvName = args.outPath + "profile.csv";
+  std::ofstream csv(csvName);
+  if(!csv) {
+    std::cout << "Unable to write profile '" << csvName << "'" << std::endl;
+    return;
+  }
+
+  csv << "type,stage,name,count,totalMs,meanMs,minMs,maxMs,queueMs\n";
+  for(const StageRecord &s : profiler.stages) {
+    Summary stage{};
+    stage.add(s.endMs - s.startMs, 0.0);
+    writeSummaryCsv(csv, "stage", s.name, "", stage);
+  }
+  for(const auto &[key, s] : perStageKernel) {
+    writeSummaryCsv(csv, "kernel", key.first, key.second, s);
+  }
+  for(const auto &[key, s] : perStageHost) {
+    writeSummaryCsv(csv, "host", key.first, key.second, s);
+  }
+
+  if(args.verbose) {
+    std::cout << "Profile written to " << jsonName << " and " << csvName << std::endl;
+  }
+}
@@ -1,5 +1,7 @@
 #include "bachUtil.h"
 #include "mathUtil.h"
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <iostream>
 
@@ -7,17 +9,17 @@ void identifySStamps(const std::pair<cl_int, cl_int> &axis, const Arguments& arg
   std::cout << "Identifying sub-stamps..." << std::endl;
 
   if (args.verbose) std::cout << "calcStats (template)" << std::endl;
-  calcStats(axis, args, clData.tImgBuf, clData.tmpl, clData);
+  cl::Event tmplStatsEvent = calcStats(axis, args, clData.tImgBuf, clData.tmpl, clData);
   if (args.verbose) std::cout << "calcStats (science)" << std::endl;
-  calcStats(axis, args, clData.sImgBuf, clData.sci, clData);
+  cl::Event sciStatsEvent = calcStats(axis, args, clData.sImgBuf, clData.sci, clData);
 
   if (args.verbose) std::cout << "findSStamps (template)" << std::endl;
-  findSStamps(axis, true, args, clData.tImgBuf, clData.tmpl, clData);
+  findSStamps(axis, true, args, clData.tImgBuf, clData.tmpl, clData, {tmplStatsEvent});
   if (args.verbose) std::cout << "findSStamps (science)" << std::endl;
-  findSStamps(axis, false, args, clData.sImgBuf, clData.sci, clData);
+  findSStamps(axis, false, args, clData.sImgBuf, clData.sci, clData, {sciStatsEvent});
 }
 
-void createStamps(std::vector<Stamp>& stamps, const int w, const int h, ClStampsData& stampsData, const ClData& clData, const Arguments& args) {
+cl::Event createStamps(std::vector<Stamp>& stamps, const int w, const int h, ClStampsData& stampsData, const ClData& clData, const Arguments& args) {
   cl::EnqueueArgs eargsBounds{clData.queue, cl::NDRange(args.stampsx * args.stampsy)};
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_int, cl_int, cl_int, cl_int, cl_int>
   boundsFunc(clData.program, "createStampBounds");
@@ -27,11 +29,14 @@ void createStamps(std::vector<Stamp>& stamps, const int w, const int h, ClStamps
                 stampsData.stampCoords, stampsData.stampSizes,
                 args.stampsx, args.stampsy, args.fStampWidth,
                 w, h)};
-  boundsEvent.wait();
+  clData.profiler.record("createStampBounds", boundsEvent);
   stampsData.stampCount = args.stampsx * args.stampsy;
+
+  return boundsEvent;
 }
 
-cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData) {
+cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate, const Arguments& args, const cl::Buffer& imgBuf, const ClStampsData& stampsData, const ClData& clData,
+                   const std::vector<cl::Event> &waitEvents) {
   auto [imgW, imgH] = axis;
 
   cl::size_type nStamps{static_cast<cl::size_type>(args.stampsx) * static_cast<cl::size_type>(args.stampsy)};
@@ -52,9 +57,6 @@ cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate,
   
   cl_int maxSStamps{2 * args.maxKSStamps};
 
-  constexpr int localSize{1};
-
-  cl::EnqueueArgs eargsFindSStamps(clData.queue, cl::NDRange(roundUpToMultiple(nStamps, localSize)), cl::NDRange(localSize));
   cl::KernelFunctor<cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer,
@@ -62,9 +64,15 @@ cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate,
                     cl_int, cl_int, cl_int, 
                     cl_int, cl_int,
                     cl_ushort, cl_ushort, cl_ushort,
+                    cl::LocalSpaceArg, cl::LocalSpaceArg,
                     cl::LocalSpaceArg, cl::LocalSpaceArg> 
   findSStampsFunc{clData.program, "findSubStamps"};
-  
+
+  // One work-group per stamp, the reductions need a power of two
+  static constexpr size_t maxLocalSize{64};
+  size_t localSize{std::bit_floor(std::min(maxLocalSize, findSStampsFunc.getKernel().getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(clData.device)))};
+
+  cl::EnqueueArgs eargsFindSStamps(clData.queue, waitEvents, cl::NDRange(nStamps * localSize), cl::NDRange(localSize));
   cl::Event findSStampsEvent{findSStampsFunc(eargsFindSStamps, 
                   imgBuf, clData.maskBuf,
                   stampsData.stampCoords, stampsData.stampSizes,
@@ -75,10 +83,11 @@ cl_int findSStamps(const std::pair<cl_int, cl_int> &axis, const bool isTemplate,
                   static_cast<cl_ushort>(badMask),
                   static_cast<cl_ushort>(badPixelMask),
                   static_cast<cl_ushort>(skipMask),
-                  cl::Local(sizeof(cl_int2) * maxSStamps * localSize),
-                  cl::Local(sizeof(cl_double) * maxSStamps * localSize))};
-
-  findSStampsEvent.wait();
+                  cl::Local(sizeof(cl_int2) * maxSStamps),
+                  cl::Local(sizeof(cl_double) * maxSStamps),
+                  cl::Local(sizeof(cl_double) * localSize),
+                  cl::Local(sizeof(cl_int) * localSize))};
+  clData.profiler.record("findSubStamps", findSStampsEvent);
 
   if(args.verbose) {  
     std::vector<cl_int> sstampCounts(nStamps);
@@ -102,7 +111,6 @@ void removeEmptyStamps(const Arguments& args, ClStampsData& stampsData, const Cl
   int maxSStamps{2 * args.maxKSStamps};
   
   cl::size_type nStamps{static_cast<cl::size_type>(args.stampsx * args.stampsy)};
-  cl::size_type paddedNStamps{static_cast<cl::size_type>(leastGreaterPow2(args.stampsx * args.stampsy))};
 
   cl::Buffer filteredStampCoords{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int2) * nStamps};
   cl::Buffer filteredStampSizes{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int2) * nStamps};
@@ -113,20 +121,12 @@ void removeEmptyStamps(const Arguments& args, ClStampsData& stampsData, const Cl
   cl::Buffer filteredSubStampCounts{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * maxSStamps * nStamps};
 
   cl::Buffer keepCounter{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int)};
-  cl::Buffer keepIndeces{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * paddedNStamps};
+  cl::Buffer keepFlags{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * nStamps};
+  cl::Buffer keepIndeces{clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * nStamps};
   
-  cl::EnqueueArgs eargsMark{clData.queue,cl::NDRange{nStamps}};
-  cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer>
-  markFunc(clData.program, "markStampsToKeep");
-
-  cl::EnqueueArgs eargsSort{clData.queue,cl::NDRange{paddedNStamps}};
   cl::KernelFunctor<cl::Buffer, cl::Buffer>
-  padFunc(clData.program, "padMarks");
-
-  cl::KernelFunctor<cl::Buffer, cl_int, cl_int>
-  sortFunc(clData.program, "sortMarks");
+  markFunc(clData.program, "markStampsToKeep");
 
-  cl::EnqueueArgs eargsRemove{clData.queue,cl::NDRange{nStamps}};  
   cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, 
                     cl::Buffer, cl::Buffer, cl::Buffer,
                     cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
@@ -134,31 +134,22 @@ void removeEmptyStamps(const Arguments& args, ClStampsData& stampsData, const Cl
                     cl::Buffer, cl::Buffer, cl::Buffer, cl_int>
   removeFunc(clData.program, "removeEmptyStamps");
 
-  cl_int zero{0};
-  clData.queue.enqueueWriteBuffer(keepCounter, CL_TRUE, 0, sizeof(cl_int), &zero);
+  cl::EnqueueArgs eargsMark{clData.queue, cl::NDRange{nStamps}};
+  cl::Event markEvent{markFunc(eargsMark, stampsData.subStampCounts, keepFlags)};
+  clData.profiler.record("markStampsToKeep", markEvent);
 
-  cl::Event markEvent{markFunc(eargsMark, stampsData.subStampCounts, keepIndeces, keepCounter)};
-  markEvent.wait();
+  // Indices of the kept stamps in stamp order
+  cl::Event compactEvent = compactIndices(keepFlags, nStamps, keepIndeces, keepCounter, clData, {markEvent});
 
-  cl::Event padEvent{padFunc(eargsSort, keepIndeces, keepCounter)};
-  padEvent.wait();
-  
-  cl::Event sortEvent;
-  for (cl_int k=2;k<=paddedNStamps;k=2*k) // Outer loop, double size for each step
-  {
-    for (cl_int j=k>>1;j>0;j=j>>1)  // Inner loop, half size for each step
-    {
-      sortEvent = sortFunc(eargsSort, keepIndeces, j, k);
-      sortEvent.wait();
-    }
-  }
-  
+  // The count is needed on the host for the buffer sizes
+  std::vector<cl::Event> countWaitEvents{compactEvent};
   cl_int removedStampCount{};
-  clData.queue.enqueueReadBuffer(keepCounter, CL_TRUE, 0, sizeof(cl_int), &removedStampCount);
+  clData.queue.enqueueReadBuffer(keepCounter, CL_TRUE, 0, sizeof(cl_int), &removedStampCount, &countWaitEvents);
 
   stampsData.stampCount = removedStampCount;
   stampsData.currentSubStamps = {clData.context, CL_MEM_READ_WRITE, sizeof(cl_int) * removedStampCount};
 
+  cl::EnqueueArgs eargsRemove{clData.queue, compactEvent, cl::NDRange{nStamps}};
   cl::Event removeEvent = removeFunc(eargsRemove, 
       stampsData.stampCoords, stampsData.stampSizes,
       stampsData.stats.skyEsts, stampsData.stats.fwhms,
@@ -167,7 +158,7 @@ void removeEmptyStamps(const Arguments& args, ClStampsData& stampsData, const Cl
       filteredSkyEsts, filteredFwhms,
       filteredSubStampCounts, filteredSubStampCoords, filteredSubStampValues,
       keepIndeces, keepCounter, stampsData.currentSubStamps, maxSStamps);
-  removeEvent.wait();
+  clData.profiler.record("removeEmptyStamps", removeEvent);
   
   stampsData.stampCoords    = filteredStampCoords;
   stampsData.stampSizes     = filteredStampSizes;
@@ -178,11 +169,13 @@ void removeEmptyStamps(const Arguments& args, ClStampsData& stampsData, const Cl
   stampsData.subStampCounts = filteredSubStampCounts;
 }
 
-void resetSStampSkipMask(const int w, const int h, const ClData& clData) {
+cl::Event resetSStampSkipMask(const int w, const int h, const ClData& clData) {
   cl::EnqueueArgs eargs{clData.queue, cl::NDRange(w * h)};
   cl::KernelFunctor<cl::Buffer> resetFunc(clData.program, "resetSkipMask");
   cl::Event unmaskEvent{resetFunc(eargs, clData.maskBuf)};
-  unmaskEvent.wait();
+  clData.profiler.record("resetSkipMask", unmaskEvent);
+
+  return unmaskEvent;
 }
 
 void readFinalStamps(std::vector<Stamp>& stamps, const ClStampsData& stampsData, const ClData& clData, const Arguments& args) {